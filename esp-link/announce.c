@@ -0,0 +1,101 @@
+/*
+Readiness announcement and discovery: once the http listener is up and the wifi has an address,
+the device broadcasts a small JSON packet saying which image it runs and how its boot health
+stands. A flashing client that rebooted the device learns the moment it is back, and whether it
+rolled back, without polling a device that is still booting. The same port answers discovery
+queries, so a client can list all devices on the LAN with one broadcast.
+*/
+
+#include <esp8266.h>
+#include "announce.h"
+#include "cgiflash.h"
+#include "partitions.h"
+#include "safeupgrade.h"
+#include "stringdefs.h"
+
+#ifdef ANNOUNCE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+# define VERS_STR_STR(V) #V
+# define VERS_STR(V) VERS_STR_STR(V)
+
+// UDP broadcasts get lost, the announcement goes out a few times with growing gaps
+#define ANNOUNCE_REPEATS  3
+#define ANNOUNCE_GAP      250 // ms, doubles after each packet
+
+static struct espconn announceConn;
+static esp_udp announceUdp;
+static ETSTimer announceTimer;
+static uint8 announceCount;
+
+// Describe the device in JSON, returns the length. The buffer needs ANNOUNCE_MAX_LEN bytes.
+int ICACHE_FLASH_ATTR announceFormat(char *buf, const char *type) {
+  uint8 mac[6];
+  wifi_get_macaddr(STATION_IF, mac);
+  const Partition *running = partitionRunning();
+  uint8 map = system_get_flash_size_map();
+  return os_sprintf(buf,
+      "{\"type\":\"%s\",\"id\":\"%02x%02x%02x%02x%02x%02x\",\"running\":\"user%d.bin\","
+      "\"next\":\"%s\",\"app_version\":%d,\"version\":\"%s\",\"flash_map\":\"%s\","
+      "\"flash_id\":\"%06lx\",\"confirmed\":%s,\"pending\":%s,\"attempts\":%d}",
+      type, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], flashRunningPartition(),
+      partitionNext() != NULL ? flashNextImageName() : "", running != NULL ? (int)running->version : 0,
+      VERS_STR(VERSION), map < sizeof(flash_maps)/sizeof(flash_maps[0]) ? flash_maps[map] : "?",
+      (unsigned long)spi_flash_get_id(), bootHealthConfirmed() ? "true" : "false",
+      bootHealthPending() ? "true" : "false", (int)bootHealthAttempts());
+}
+
+// Answer a discovery query with the description of the device, to the sender only
+static void ICACHE_FLASH_ATTR announceRecvCb(void *arg, char *data, unsigned short len) {
+  static const char query[] = "{\"type\":\"discover\"";
+  remot_info *remote = NULL;
+  if (len < sizeof(query) - 1 || os_strncmp(data, query, sizeof(query) - 1) != 0) return;
+  if (espconn_get_connection_info(&announceConn, &remote, 0) != ESPCONN_OK) return;
+
+  char buf[ANNOUNCE_MAX_LEN];
+  int n = announceFormat(buf, "device");
+  announceUdp.remote_port = remote->remote_port;
+  os_memcpy(announceUdp.remote_ip, remote->remote_ip, 4);
+  if (espconn_sendto(&announceConn, (uint8 *)buf, n) != ESPCONN_OK)
+    DBG("Discover: send failed\n");
+  DBG("Discover from %d.%d.%d.%d:%d\n", remote->remote_ip[0], remote->remote_ip[1],
+      remote->remote_ip[2], remote->remote_ip[3], remote->remote_port);
+}
+
+static void ICACHE_FLASH_ATTR announceTimerCb(void *arg) {
+  char buf[ANNOUNCE_MAX_LEN];
+  int len = announceFormat(buf, "ready");
+  // espconn_sendto takes the destination from the connection, which it may overwrite
+  announceUdp.remote_port = ANNOUNCE_PORT;
+  os_memset(announceUdp.remote_ip, 0xff, 4);
+  if (espconn_sendto(&announceConn, (uint8 *)buf, len) != ESPCONN_OK)
+    DBG("Announce: send failed\n");
+  DBG("Announce %d: %s\n", announceCount, buf);
+
+  if (++announceCount < ANNOUNCE_REPEATS)
+    os_timer_arm(&announceTimer, ANNOUNCE_GAP << (announceCount - 1), false);
+}
+
+// Listen for discovery queries, the announcements go out from the same port
+void ICACHE_FLASH_ATTR announceInit(void) {
+  announceConn.type = ESPCONN_UDP;
+  announceConn.proto.udp = &announceUdp;
+  announceUdp.local_port = ANNOUNCE_PORT;
+  espconn_regist_recvcb(&announceConn, announceRecvCb);
+  if (espconn_create(&announceConn) != ESPCONN_OK) {
+    DBG("Announce: cannot create connection\n");
+    announceConn.type = ESPCONN_INVALID;
+  }
+}
+
+// Broadcast that the device is ready, the wifi must be up
+void ICACHE_FLASH_ATTR announceReady(void) {
+  if (announceConn.type == ESPCONN_INVALID) return;
+  announceCount = 0;
+  os_timer_disarm(&announceTimer);
+  os_timer_setfn(&announceTimer, announceTimerCb, NULL);
+  announceTimerCb(NULL);
+}
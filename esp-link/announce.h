@@ -0,0 +1,15 @@
+#ifndef ANNOUNCE_H
+#define ANNOUNCE_H
+
+#include <esp8266.h>
+
+// UDP port of the readiness announcement, flashing clients listen on it. The device answers
+// discovery queries, {"type":"discover"}, on the same port.
+#define ANNOUNCE_PORT     8267
+#define ANNOUNCE_MAX_LEN  384
+
+void announceInit(void);
+void announceReady(void);
+int announceFormat(char *buf, const char *type);
+
+#endif // ANNOUNCE_H
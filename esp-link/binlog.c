@@ -0,0 +1,145 @@
+/*
+Deferred binary logging. A LOG() call copies its arguments into a RAM ring and returns, the text
+is never formatted on the chip: the format strings stay in the build (firmware/logfmt.bin) and
+host/logdump turns the records into lines. A record takes a few microseconds where os_printf
+formats the message and queues it for a UART that does 11.5 bytes per millisecond, so the
+debug output of the httpd and the flash code can stay on without changing their timing.
+
+The records are fetched with GET /log?since=<seq> and, while the console is on, drained to the
+UART between other work as SLIP frames that logdump picks out of the console text. A seq is the
+number of words ever written to the ring, a reader that falls behind by more than the ring sees
+a gap in it.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "uart.h"
+#include "binlog.h"
+
+// start of the format strings, the linker script puts the section at 0 on the chip. Weak, a
+// build without LOG() calls has no such section.
+extern const char __start_logfmt[] __attribute__((weak));
+
+static uint32 ring[BINLOG_RING_WORDS];
+static uint32 head;         // seq of the next word written
+static uint32 oldest;       // seq of the oldest record still in the ring
+static uint32 drained;      // seq of the next record for the console
+static bool drainArmed;
+static ETSTimer drainTimer;
+
+#define RING(seq) ring[(seq) % BINLOG_RING_WORDS]
+
+static void binLogDrain(void *arg);
+
+void ICACHE_FLASH_ATTR binLogRecord(const char *format, uint32 strings, int count, ...) {
+  uint32 rec[2 + 12*(1 + BINLOG_MAX_STRING/4)];
+  uint32 n = 2;
+  va_list ap;
+  va_start(ap, count);
+  for (int i = 0; i < count; i++) {
+    if (strings & (1 << i)) {
+      const char *s = va_arg(ap, const char *);
+      uint32 len = s == NULL ? 0 : os_strlen(s);
+      if (len > BINLOG_MAX_STRING) len = BINLOG_MAX_STRING;
+      rec[n++] = len;
+      if (len > 0) rec[n + (len - 1)/4] = 0;
+      os_memcpy(rec + n, s, len);
+      n += (len + 3) / 4;
+    } else {
+      rec[n++] = va_arg(ap, uint32);
+    }
+  }
+  va_end(ap);
+  rec[0] = (uint32)(format - __start_logfmt) << 8 | n;
+  rec[1] = system_get_time();
+
+  // make room by dropping the oldest records
+  while (head + n - oldest > BINLOG_RING_WORDS) oldest += RING(oldest) & 0xff;
+  for (uint32 i = 0; i < n; i++) RING(head + i) = rec[i];
+  head += n;
+
+  if (!drainArmed && system_get_os_print()) {
+    drainArmed = true;
+    os_timer_setfn(&drainTimer, binLogDrain, NULL);
+    os_timer_arm(&drainTimer, BINLOG_DRAIN_MS, false);
+  }
+}
+
+// SLIP encode len bytes into buf, returns the encoded length
+static uint16 ICACHE_FLASH_ATTR slipEncode(uint8 *buf, const uint8 *data, uint16 len) {
+  uint16 n = 0;
+  for (uint16 i = 0; i < len; i++) {
+    if (data[i] == 0xC0 || data[i] == 0xDB) {
+      buf[n++] = 0xDB;
+      buf[n++] = data[i] == 0xC0 ? 0xDC : 0xDD;
+    } else {
+      buf[n++] = data[i];
+    }
+  }
+  return n;
+}
+
+// Write the records the console hasn't had while the UART has room for them, each frame is
+// END, 'L', seq, the record and END
+static void ICACHE_FLASH_ATTR binLogDrain(void *arg) {
+  drainArmed = false;
+  if (!system_get_os_print()) return;
+  // the frames carry the seq, logdump reports what the console missed
+  if (drained < oldest) drained = oldest;
+  while (drained != head) {
+    uint32 words = RING(drained) & 0xff, rec[words + 1];
+    rec[0] = drained;
+    for (uint32 i = 0; i < words; i++) rec[i + 1] = RING(drained + i);
+    uint8 frame[2*sizeof(rec) + 3];
+    uint16 len = 0;
+    frame[len++] = 0xC0;
+    frame[len++] = BINLOG_FRAME;
+    len += slipEncode(frame + len, (uint8 *)rec, sizeof(rec));
+    frame[len++] = 0xC0;
+    // a record with many long strings can be too big for the UART ring even when it's empty,
+    // waiting for room would stop the drain for good. Skipped, logdump sees the seq jump.
+    if (len > UART_TX_RING_SIZE - 1) {
+      drained += words;
+      continue;
+    }
+    if (uart0_tx_free() < len) break;
+    uart0_write(frame, len);
+    drained += words;
+  }
+  if (drained != head) {
+    drainArmed = true;
+    os_timer_arm(&drainTimer, BINLOG_DRAIN_MS, false);
+  }
+}
+
+// GET /log?since=<seq>: the records from seq on as far as they fit, after a header of the magic,
+// the seq of the first record sent and the seq to ask for next. The first is later than since
+// if records were lost. Little endian words, all of it.
+int ICACHE_FLASH_ATTR cgiLog(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char arg[16];
+  uint32 since = 0;
+  if (httpdFindArg(connData->getArgs, "since", arg, sizeof(arg)) > 0) since = atoi(arg);
+  // a seq from before a reboot, or not from this ring at all
+  if (since > head) since = 0;
+  uint32 first = since < oldest ? oldest : since;
+  uint32 end = first;
+  while (end != head && end - first + (RING(end) & 0xff) <= BINLOG_RING_WORDS) {
+    end += RING(end) & 0xff;
+  }
+
+  noCacheHeaders(connData, 200);
+  httpdHeader(connData, "Content-Type", "application/octet-stream");
+  httpdEndHeaders(connData);
+  uint32 hdr[3] = { BINLOG_MAGIC, first, end };
+  httpdSend(connData, (char *)hdr, sizeof(hdr));
+  for (uint32 seq = first; seq != end; ) {
+    // the ring wraps, send up to its end at once
+    uint32 n = end - seq, pos = seq % BINLOG_RING_WORDS;
+    if (n > BINLOG_RING_WORDS - pos) n = BINLOG_RING_WORDS - pos;
+    httpdSend(connData, (char *)(ring + pos), n*4);
+    seq += n;
+  }
+  return HTTPD_CGI_DONE;
+}
@@ -0,0 +1,56 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <esp8266.h>
+#include "httpd.h"
+
+// Size of the RAM ring, in 4 byte words. The oldest records make room for new ones.
+#define BINLOG_RING_WORDS   512
+// Longest string argument that is kept, longer ones are cut
+#define BINLOG_MAX_STRING   32
+// How often the ring is drained to the console while records are waiting, ms
+#define BINLOG_DRAIN_MS     10
+// Marks a record on the console, after the SLIP END that starts it
+#define BINLOG_FRAME        'L'
+// First word of a /log response
+#define BINLOG_MAGIC        0x474f4c42  // "BLOG"
+
+// LOG(format, ...) stores a binary record instead of formatting: the offset of the format in
+// the logfmt section, system_get_time() and the arguments as 32 bit words. String arguments
+// (char pointers) are copied. The logfmt section isn't loaded, the build extracts it to
+// firmware/logfmt.bin and host/logdump formats the records with it. Up to 12 arguments.
+//
+// A record is: id << 8 | length in words, the time, then a word per argument. A string is its
+// length in bytes and the bytes, padded to a word.
+#define LOG(format, ...) do {                                                           \
+  static const char binlogFmt[] __attribute__((section("logfmt"))) = format;            \
+  binLogRecord(binlogFmt, BINLOG_MASK(BINLOG_COUNT(format, ## __VA_ARGS__), format,     \
+      ## __VA_ARGS__), BINLOG_COUNT(format, ## __VA_ARGS__), ## __VA_ARGS__);           \
+} while (0)
+
+// Number of arguments after the format, and a bit for each that is a string
+#define BINLOG_COUNT(...) BINLOG_NTH(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define BINLOG_NTH(f, a, b, c, d, e, g, h, i, j, k, l, m, n, ...) n
+#define BINLOG_IS(x, t) __builtin_types_compatible_p(__typeof__(x), t)
+#define BINLOG_STR(x) (BINLOG_IS(x, char *) || BINLOG_IS(x, const char *) ||                \
+    BINLOG_IS(x, char []) || BINLOG_IS(x, const char []))
+#define BINLOG_MASK(n, ...) BINLOG_MASK_(n, __VA_ARGS__)
+#define BINLOG_MASK_(n, ...) BINLOG_MASK_##n(__VA_ARGS__)
+#define BINLOG_MASK_0(f) 0
+#define BINLOG_MASK_1(f, a) BINLOG_STR(a)
+#define BINLOG_MASK_2(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_1(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_3(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_2(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_4(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_3(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_5(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_4(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_6(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_5(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_7(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_6(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_8(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_7(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_9(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_8(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_10(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_9(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_11(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_10(f, __VA_ARGS__) << 1)
+#define BINLOG_MASK_12(f, a, ...) (BINLOG_STR(a) | BINLOG_MASK_11(f, __VA_ARGS__) << 1)
+
+void binLogRecord(const char *format, uint32 strings, int count, ...);
+int cgiLog(HttpdConnData *connData);
+
+#endif // BINLOG_H
@@ -0,0 +1,261 @@
+/*
+Boot journal: small status records appended to flash. Each update writes one pre-erased slot, so
+marking a boot costs a flash write of 8 bytes instead of an erase.
+
+With 2MB of flash or more the journal has two sectors of its own in front of the partition table
+and uses one of them at a time. Its first record is a head with a generation number, the valid
+head with the newer generation is the active sector. When the active sector is full the other
+one is erased, gets the latest record of each type and last its head. Until that head is in the
+flash the full sector stays active, so a power loss during a wrap loses no record.
+
+Smaller flash has no room for that. The journal goes into the tail of the bootloader config
+sector, which is never erased by the firmware: the head of that sector is what the 2nd stage
+bootloader boots from. Once the tail is full the records go to RTC memory, where they survive
+everything but a power loss, until the SDK rewrites the sector at the next partition switch.
+*/
+
+#include <esp8266.h>
+#include "bootjournal.h"
+#include "partitions.h"
+
+#ifdef BOOT_JOURNAL_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#ifndef BOOTLOADER_CONFIG_ADDR
+#warning Use default bootloader config address for 512KB flash
+/* defaults to 512KB flash */
+#define BOOTLOADER_CONFIG_ADDR  0x7F000
+#endif
+
+/* In the bootloader config sector the head belongs to the 2nd stage bootloader and the SDK. The
+ * SDK rewrites the sector when it switches partitions, which clears the journal along with it.
+ */
+#define BOOT_JOURNAL_OFFSET   0x100
+#define BOOT_JOURNAL_SHARED   (BOOTLOADER_CONFIG_ADDR + BOOT_JOURNAL_OFFSET)
+#define BOOT_JOURNAL_SHARED_SLOTS ((SPI_FLASH_SEC_SIZE - BOOT_JOURNAL_OFFSET) / sizeof(BootRecord))
+#define BOOT_RECORD_MAGIC     0xA5
+#define BOOT_RECORD_HEAD      0x80 // first record of a sector of its own, value is the generation
+#define RTC_JOURNAL_MAGIC     0x4A544252 // "RBTJ"
+
+// The records that didn't fit into a full shared journal, the latest of each type in the order
+// they were written
+typedef struct {
+  uint32 magic;
+  BootRecord records[BOOT_RECORD_TYPES];
+} RtcJournal;
+RTC_MEM_FITS(RTC_MEM_BOOT_JOURNAL, sizeof(RtcJournal), RTC_MEM_END);
+
+// sectors of its own, 0 if the journal shares the bootloader config sector
+static uint32 journalBase;
+// address and size of the journal in use, 0 until it has been located
+static uint32 journalAddr;
+static int journalSlots;
+static uint32 journalGen;
+// index of the first free slot, -1 until the journal has been scanned
+static int journalFree = -1;
+
+static uint8 ICACHE_FLASH_ATTR recordCheck(const BootRecord *rec) {
+  return ~(rec->magic ^ rec->type ^ rec->partition ^ rec->value ^ (rec->value >> 8) ^
+      (rec->value >> 16) ^ (rec->value >> 24));
+}
+
+static bool ICACHE_FLASH_ATTR recordValid(const BootRecord *rec) {
+  return rec->magic == BOOT_RECORD_MAGIC && rec->check == recordCheck(rec);
+}
+
+static void ICACHE_FLASH_ATTR recordMake(BootRecord *rec, uint8 type, uint8 partition,
+    uint32 value) {
+  rec->magic = BOOT_RECORD_MAGIC;
+  rec->type = type;
+  rec->partition = partition;
+  rec->value = value;
+  rec->check = recordCheck(rec);
+}
+
+static void ICACHE_FLASH_ATTR recordRead(uint32 base, int slot, BootRecord *rec) {
+  spi_flash_read(base + slot*sizeof(BootRecord), (uint32 *)rec, sizeof(*rec));
+}
+
+static bool ICACHE_FLASH_ATTR recordFree(uint32 base, int slot) {
+  BootRecord rec;
+  recordRead(base, slot, &rec);
+  return ((uint32 *)&rec)[0] == 0xffffffff && rec.value == 0xffffffff;
+}
+
+// Records are appended without gaps, so the first free slot can be found by bisection. A torn
+// record isn't free, it just doesn't pass the check.
+static int ICACHE_FLASH_ATTR findFree(uint32 base, int slots) {
+  int lo = 0, hi = slots;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (recordFree(base, mid)) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+// The most recent valid record of a type in the journal at base, its slot or -1
+static int ICACHE_FLASH_ATTR findLatest(uint32 base, int used, uint8 type, BootRecord *rec) {
+  for (int slot = used - 1; slot >= 0; slot--) {
+    recordRead(base, slot, rec);
+    if (recordValid(rec) && rec->type == type) return slot;
+  }
+  return -1;
+}
+
+// The latest record of each type in the journal at base, in the order they were written.
+// Returns how many there are.
+static int ICACHE_FLASH_ATTR latestRecords(uint32 base, int used, BootRecord *keep) {
+  int slots[BOOT_RECORD_TYPES];
+  int n = 0;
+  for (uint8 type = 1; type <= BOOT_RECORD_TYPES; type++) {
+    BootRecord rec;
+    int slot = findLatest(base, used, type, &rec);
+    if (slot < 0) continue;
+    int i = n++;
+    for (; i > 0 && slots[i-1] > slot; i--) {
+      slots[i] = slots[i-1];
+      keep[i] = keep[i-1];
+    }
+    slots[i] = slot;
+    keep[i] = rec;
+  }
+  return n;
+}
+
+// Generation of the sector at addr, false if it has no valid head
+static bool ICACHE_FLASH_ATTR sectorGen(uint32 addr, uint32 *gen) {
+  BootRecord head;
+  recordRead(addr, 0, &head);
+  *gen = head.value;
+  return recordValid(&head) && head.type == BOOT_RECORD_HEAD;
+}
+
+// Start the sector that isn't active over with the n records of keep and make it the active one.
+// Its head goes in last, a power loss before that leaves the active sector as it was.
+static const char* ICACHE_FLASH_ATTR journalRewrite(const BootRecord *keep, int n) {
+  uint32 addr = journalAddr == journalBase ? journalBase + SPI_FLASH_SEC_SIZE : journalBase;
+  BootRecord head;
+  recordMake(&head, BOOT_RECORD_HEAD, 0, journalGen + 1);
+  if (spi_flash_erase_sector(addr / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+    return "Flash erase failed";
+  if ((n > 0 && spi_flash_write(addr + sizeof(BootRecord), (uint32 *)keep,
+      n*sizeof(BootRecord)) != SPI_FLASH_RESULT_OK) ||
+      spi_flash_write(addr, (uint32 *)&head, sizeof(head)) != SPI_FLASH_RESULT_OK)
+    return "Flash write failed";
+  journalAddr = addr;
+  journalGen++;
+  journalFree = n + 1;
+  return NULL;
+}
+
+static void ICACHE_FLASH_ATTR rtcLoad(RtcJournal *rtc) {
+  system_rtc_mem_read(RTC_MEM_BOOT_JOURNAL, rtc, sizeof(*rtc));
+  if (rtc->magic != RTC_JOURNAL_MAGIC) os_memset(rtc, 0, sizeof(*rtc));
+}
+
+// Locate the journal and its first free slot. Sectors of their own without a valid head are new,
+// they take over the latest records from the shared sector, where earlier firmware kept them.
+static int ICACHE_FLASH_ATTR journalFindFree(void) {
+  if (journalFree >= 0) return journalFree;
+  journalBase = flashJournalAddr();
+  if (journalBase == 0) {
+    journalAddr = BOOT_JOURNAL_SHARED;
+    journalSlots = BOOT_JOURNAL_SHARED_SLOTS;
+    journalFree = findFree(journalAddr, journalSlots);
+    DBG("Boot journal: %d of %d slots used at 0x%x\n", journalFree, journalSlots, journalAddr);
+    // records in RTC memory are from before the SDK last cleared the sector
+    if (journalFree < journalSlots) {
+      RtcJournal rtc;
+      os_memset(&rtc, 0, sizeof(rtc));
+      system_rtc_mem_write(RTC_MEM_BOOT_JOURNAL, &rtc, sizeof(rtc));
+    }
+    return journalFree;
+  }
+
+  uint32 gen[BOOT_JOURNAL_SECTORS];
+  bool valid[BOOT_JOURNAL_SECTORS];
+  for (int i = 0; i < BOOT_JOURNAL_SECTORS; i++) valid[i] = sectorGen(journalBase + i*SPI_FLASH_SEC_SIZE, &gen[i]);
+  int active = valid[1] && (!valid[0] || (sint32)(gen[1] - gen[0]) > 0) ? 1 : 0;
+  journalAddr = journalBase + active*SPI_FLASH_SEC_SIZE;
+  journalSlots = SPI_FLASH_SEC_SIZE/sizeof(BootRecord);
+  journalGen = gen[active];
+  if (valid[active]) {
+    journalFree = findFree(journalAddr, journalSlots);
+    DBG("Boot journal: %d of %d slots used at 0x%x, generation %d\n", journalFree, journalSlots,
+        journalAddr, journalGen);
+    return journalFree;
+  }
+
+  // new, the rewrite goes into the first sector
+  BootRecord keep[BOOT_RECORD_TYPES];
+  int n = latestRecords(BOOT_JOURNAL_SHARED,
+      findFree(BOOT_JOURNAL_SHARED, BOOT_JOURNAL_SHARED_SLOTS), keep);
+  DBG("Boot journal: new, taking %d records from the config sector\n", n);
+  journalAddr = journalBase + SPI_FLASH_SEC_SIZE;
+  journalGen = 0;
+  // without a sector to write to every append fails, which the callers cope with
+  if (journalRewrite(keep, n) != NULL) journalFree = journalSlots;
+  return journalFree;
+}
+
+// Find the most recent valid record of a type, returns its slot or -1 if there is none. Slots
+// tell the order in which records of different types were written.
+int ICACHE_FLASH_ATTR bootJournalLatest(uint8 type, BootRecord *rec) {
+  int used = journalFindFree();
+  if (journalBase == 0 && used >= journalSlots) {
+    // the records in RTC memory come after the full shared sector
+    RtcJournal rtc;
+    rtcLoad(&rtc);
+    for (int i = BOOT_RECORD_TYPES - 1; i >= 0; i--) {
+      if (recordValid(&rtc.records[i]) && rtc.records[i].type == type) {
+        *rec = rtc.records[i];
+        return journalSlots + i;
+      }
+    }
+  }
+  return findLatest(journalAddr, used, type, rec);
+}
+
+// Keep a record in RTC memory, after the latest record of each other type
+static void ICACHE_FLASH_ATTR rtcAppend(const BootRecord *rec) {
+  RtcJournal rtc;
+  rtcLoad(&rtc);
+  int n = 0;
+  for (int i = 0; i < BOOT_RECORD_TYPES; i++) {
+    if (recordValid(&rtc.records[i]) && rtc.records[i].type != rec->type)
+      rtc.records[n++] = rtc.records[i];
+  }
+  rtc.records[n++] = *rec;
+  if (n < BOOT_RECORD_TYPES) os_memset(rtc.records + n, 0, (BOOT_RECORD_TYPES - n)*sizeof(*rec));
+  rtc.magic = RTC_JOURNAL_MAGIC;
+  system_rtc_mem_write(RTC_MEM_BOOT_JOURNAL, &rtc, sizeof(rtc));
+}
+
+// Append a record to the journal. A full journal of its own wraps, keeping the latest record of
+// each type in their original order. A full shared one continues in RTC memory.
+const char* ICACHE_FLASH_ATTR bootJournalAppend(uint8 type, uint8 partition, uint32 value) {
+  BootRecord rec;
+  recordMake(&rec, type, partition, value);
+  if (journalFindFree() >= journalSlots) {
+    if (journalBase == 0) {
+      DBG("Boot journal: full, record type %d goes to RTC memory\n", type);
+      rtcAppend(&rec);
+      return NULL;
+    }
+    BootRecord keep[BOOT_RECORD_TYPES];
+    int n = latestRecords(journalAddr, journalFree, keep);
+    DBG("Boot journal: wrapping, keeping %d records\n", n);
+    const char *err = journalRewrite(keep, n);
+    if (err != NULL) return err;
+  }
+  int slot = journalFree++;
+  if (spi_flash_write(journalAddr + slot*sizeof(BootRecord), (uint32 *)&rec, sizeof(rec)) !=
+      SPI_FLASH_RESULT_OK)
+    return "Flash write failed";
+  DBG("Boot journal: record %d type %d partition %d value %d\n", slot, type, partition, value);
+  return NULL;
+}
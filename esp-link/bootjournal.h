@@ -0,0 +1,26 @@
+#ifndef BOOTJOURNAL_H
+#define BOOTJOURNAL_H
+
+#include <esp8266.h>
+
+// Record types
+#define BOOT_RECORD_SUCCESS   1 // the firmware in the partition booted successfully, value is
+                                // its version in the partition table
+#define BOOT_RECORD_ATTEMPT   2 // unconfirmed boot of the partition, value counts the attempts
+#define BOOT_RECORD_WIFI_AP   3 // first 4 bytes of the BSSID the station joined, see wificache.c
+#define BOOT_RECORD_WIFI_CHAN 4 // the rest of the BSSID, the channel and a check of both records
+#define BOOT_RECORD_TYPES     4
+
+// A record of the boot journal, see bootjournal.c for where it is kept
+typedef struct {
+  uint8  magic;
+  uint8  type;
+  uint8  partition;   // partition that was running when the record was written, 1 or 2
+  uint8  check;       // detects records torn by a power loss
+  uint32 value;
+} BootRecord;
+
+int bootJournalLatest(uint8 type, BootRecord *rec);
+const char *bootJournalAppend(uint8 type, uint8 partition, uint32 value);
+
+#endif // BOOTJOURNAL_H
@@ -0,0 +1,57 @@
+/*
+Boot timeline: records when each phase of the boot is reached, so that the biggest contributors
+to the time from power-on to being ready for an upgrade can be found.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "boottimeline.h"
+
+static const char *phaseNames[BOOT_PHASES] = {
+  "rf_pre_init", "health_check", "user_init", "uart_init", "wifi_init", "listening",
+  "init_done", "wifi_up", "first_request"
+};
+// system_get_time() when the phase was reached, 0 if it wasn't yet
+static uint32 phaseTimes[BOOT_PHASES];
+
+// Print the timeline in one line, times in ms since power-on
+static void ICACHE_FLASH_ATTR bootTimelinePrint(void) {
+  os_printf("Boot timeline:");
+  for (int i = 0; i < BOOT_PHASES; i++) {
+    if (phaseTimes[i] != 0)
+      os_printf(" %s=%d.%d", phaseNames[i], phaseTimes[i] / 1000, phaseTimes[i] / 100 % 10);
+  }
+  os_printf(" ms\n");
+}
+
+// Record that a phase has been reached, only the first time counts. The timeline is printed
+// once the device is ready for an upgrade, the first request gets a line of its own.
+void ICACHE_FLASH_ATTR bootTimelineMark(BootPhase phase) {
+  if (phase >= BOOT_PHASES || phaseTimes[phase] != 0) return;
+  phaseTimes[phase] = system_get_time();
+  if (phaseTimes[phase] == 0) phaseTimes[phase] = 1;
+
+  if (phase == BOOT_PHASE_FIRST_REQUEST) {
+    os_printf("Boot timeline: first_request=%d ms\n", phaseTimes[phase] / 1000);
+  } else if ((phase == BOOT_PHASE_LISTENING || phase == BOOT_PHASE_WIFI_UP) &&
+      phaseTimes[BOOT_PHASE_LISTENING] != 0 && phaseTimes[BOOT_PHASE_WIFI_UP] != 0) {
+    bootTimelinePrint();
+  }
+}
+
+//===== Cgi that returns the boot timeline, times in us since power-on and -1 for phases that
+// haven't been reached
+int ICACHE_FLASH_ATTR cgiBootTimeline(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char buf[48];
+  jsonHeader(connData, 200);
+  os_sprintf(buf, "{\"reset\":%d", system_get_rst_info()->reason);
+  httpdSend(connData, buf, -1);
+  for (int i = 0; i < BOOT_PHASES; i++) {
+    os_sprintf(buf, ",\"%s\":%d", phaseNames[i], phaseTimes[i] != 0 ? (int)phaseTimes[i] : -1);
+    httpdSend(connData, buf, -1);
+  }
+  httpdSend(connData, "}", 1);
+  return HTTPD_CGI_DONE;
+}
@@ -0,0 +1,23 @@
+#ifndef BOOTTIMELINE_H
+#define BOOTTIMELINE_H
+
+#include "httpd.h"
+
+// Phases of the boot, in the order they normally happen
+typedef enum {
+  BOOT_PHASE_RF_PRE_INIT,     // user_rf_pre_init entered
+  BOOT_PHASE_HEALTH_CHECK,    // upgrade health check done
+  BOOT_PHASE_USER_INIT,       // user_init entered
+  BOOT_PHASE_UART_INIT,       // uart initialized
+  BOOT_PHASE_WIFI_INIT,       // wifi configured
+  BOOT_PHASE_LISTENING,       // http listener accepting connections
+  BOOT_PHASE_INIT_DONE,       // the SDK finished its initialization
+  BOOT_PHASE_WIFI_UP,         // the soft-AP is up or the station got an IP
+  BOOT_PHASE_FIRST_REQUEST,   // the first http request has been served
+  BOOT_PHASES
+} BootPhase;
+
+void bootTimelineMark(BootPhase phase);
+int cgiBootTimeline(HttpdConnData *connData);
+
+#endif // BOOTTIMELINE_H
@@ -19,26 +19,26 @@ Some flash handling cgi routines. Used for reading the existing flash and updati
 #include "cgi.h"
 #include "cgiflash.h"
 #include "safeupgrade.h"
+#include "otasession.h"
+#include "flashqueue.h"
+#include "dataregion.h"
+#include "partitions.h"
+#ifdef BINARY_LOG
+#include "binlog.h"
+#endif
 
 #define SPI_FLASH_MEM_EMU_START_ADDR    0x40200000
-#define USER1_BIN_SPI_FLASH_ADDR        (4*1024)                                      // either start after 4KB boot partition
-
-#ifdef USER2_BIN_SPI_FLASH_ADDR
-/* an unsymetric partition table is used */
-#define FIRMWARE_SIZE_PARTITION1        (USER2_BIN_SPI_FLASH_ADDR - USER1_BIN_SPI_FLASH_ADDR)
-#define FIRMWARE_SIZE_PARTITION2        FIRMWARE_SIZE
-#else
-#define USER2_BIN_SPI_FLASH_ADDR        (4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024)   // 4KB boot, fw1, 16KB user param, 4KB reserved
-#endif
 
-#ifdef CGIFLASH_DBG
+#if defined(CGIFLASH_DBG) && defined(BINARY_LOG)
+#define DBG(format, ...) LOG(format, ## __VA_ARGS__)
+#elif defined(CGIFLASH_DBG)
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
 #else
 #define DBG(format, ...) do { } while(0)
 #endif
 
 // Check that the header of the firmware blob looks like actual firmware...
-static char* ICACHE_FLASH_ATTR check_header(void *buf) {
+char* ICACHE_FLASH_ATTR check_header(void *buf) {
   uint8_t *cd = (uint8_t *)buf;
 #ifdef CGIFLASH_DBG
   uint32_t *buf32 = buf;
@@ -51,34 +51,16 @@ static char* ICACHE_FLASH_ATTR check_header(void *buf) {
   return NULL;
 }
 
-// check whether the flash map/size we have allows for OTA upgrade
+// check whether the partition layout allows for OTA upgrade
 static bool canOTA(void) {
-        enum flash_size_map map = system_get_flash_size_map();
-        return map >= FLASH_SIZE_4M_MAP_256_256;
+        return partitionNext() != NULL;
 }
 
 static char *flash_too_small = "Flash too small for OTA update";
 
-extern uint32 _irom0_text_start;
-
-static uint8 ICACHE_FLASH_ATTR system_upgrade_enhance_userbin_check()
-{
-    const uint32* const user2_bin_start = (uint32*)(SPI_FLASH_MEM_EMU_START_ADDR + USER2_BIN_SPI_FLASH_ADDR);
-    if (&_irom0_text_start >= user2_bin_start) {
-        /* The currently used IROM section lies behind the user 2 start.
-         * So the current ROM is in user 2
-         */
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-static uint32 ICACHE_FLASH_ATTR getNextSPIFlashAddr(void) {
-    const uint8 id = system_upgrade_enhance_userbin_check();
-    const uint32 address = ( (id == 1) ? USER1_BIN_SPI_FLASH_ADDR : USER2_BIN_SPI_FLASH_ADDR );
-
-    return address;
+uint32 ICACHE_FLASH_ATTR getNextSPIFlashAddr(void) {
+    const Partition *next = partitionNext();
+    return next != NULL ? next->address : 0;
 }
 
 const char* const ICACHE_FLASH_ATTR checkUpgradedFirmware()
@@ -94,6 +76,16 @@ const char* const ICACHE_FLASH_ATTR checkUpgradedFirmware()
     return err;
 }
 
+// Partition the firmware is running from, 1 or 2
+uint8 ICACHE_FLASH_ATTR flashRunningPartition(void) {
+  return partitionAppIndex(partitionRunning()) + 1;
+}
+
+// Name of the image that goes into the partition we flash next
+const char* ICACHE_FLASH_ATTR flashNextImageName(void) {
+  return partitionAppIndex(partitionNext()) == 0 ? "user1.bin" : "user2.bin";
+}
+
 uint32* const ICACHE_FLASH_ATTR getNextFlashAddr(void) {
     const uint32 addr = SPI_FLASH_MEM_EMU_START_ADDR + getNextSPIFlashAddr();
 
@@ -112,14 +104,13 @@ int ICACHE_FLASH_ATTR cgiGetFirmwareNext(HttpdConnData *connData) {
           return HTTPD_CGI_DONE;
         }
 
-  const uint8 id = system_upgrade_enhance_userbin_check();
   httpdStartResponse(connData, 200);
   httpdHeader(connData, "Content-Type", "text/plain");
   httpdHeader(connData, "Content-Length", "9");
   httpdEndHeaders(connData);
-  char *next = id == 1 ? "user1.bin" : "user2.bin";
+  const char *next = flashNextImageName();
   httpdSend(connData, next, -1);
-  DBG("Next firmware: %s (got %d)\n", next, id);
+  DBG("Next firmware: %s\n", next);
 
   /* the httpd works and a firmeware upgrade would be possible.
    * So the last upgrade was successful
@@ -129,20 +120,249 @@ int ICACHE_FLASH_ATTR cgiGetFirmwareNext(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
-//===== Cgi that allows the firmware to be replaced via http POST
-int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
-  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+// Largest image that fits into the partition we flash next
+uint32 ICACHE_FLASH_ATTR getNextFirmwareMaxSize(void) {
+  const Partition *next = partitionNext();
+  return next != NULL ? next->size : 0;
+}
 
-        if (!canOTA()) {
-          errorResponse(connData, 400, flash_too_small);
-          return HTTPD_CGI_DONE;
-        }
+// Check that a data image can be written to the flash without clobbering the boot loader, one
+// of the firmware partitions, the partition table or the SDK parameters at the end of the flash
+static char* ICACHE_FLASH_ATTR checkDataRegion(uint32 address, uint32 size) {
+  uint32 end = address + size;
+  if (address % SPI_FLASH_SEC_SIZE != 0) return "Unaligned image address";
+  if (address < SPI_FLASH_SEC_SIZE || end > flashReservedStart() || end < address)
+    return "Image address out of range";
+  if (partitionOverlapsApp(address, size)) return "Image overlaps firmware";
+  return NULL;
+}
 
-  int offset = connData->post->received - connData->post->buffLen;
-  if (offset == 0) {
-    connData->cgiPrivData = NULL;
-  } else if (connData->cgiPrivData != NULL) {
-    // we have an error condition, do nothing
+// Parse a decimal number, returns the char following it
+static char* ICACHE_FLASH_ATTR parseNumber(char *p, uint32 *val) {
+  *val = 0;
+  while (*p >= '0' && *p <= '9') *val = *val * 10 + (*p++ - '0');
+  return p;
+}
+
+// Parse a "bytes <first>-<last>/<total>" Content-Range header value
+static bool ICACHE_FLASH_ATTR parseContentRange(char *p, uint32 *first, uint32 *last,
+    uint32 *total) {
+  if (os_strncmp(p, "bytes ", 6) != 0) return false;
+  p = parseNumber(p + 6, first);
+  if (*p++ != '-') return false;
+  p = parseNumber(p, last);
+  if (*p++ != '/') return false;
+  p = parseNumber(p, total);
+  return *p == 0 && *first <= *last && *last < *total;
+}
+
+// Per-request state of an upload
+typedef struct {
+  uint32 start;   // image offset of the first byte of the POST body
+  uint32 address; // flash address the image is written to
+  uint32 idle;    // system_get_time() when we were done with the previous chunk
+  bool claimed;   // whether the range of the POST body is claimed in the session
+  bool finishing; // the whole body arrived, waiting for the flash queue to write it
+  bool held;      // receiving is on hold until the flash queue drains
+  uint8 pending;  // blocks in the flash queue
+  const char *err; // first error the flash queue reported
+} UploadState;
+
+static int ICACHE_FLASH_ATTR uploadDone(HttpdConnData *connData) {
+  UploadState *state = connData->cgiData;
+  if (state != NULL) {
+    // blocks of an aborted upload must not be written once the claim is gone
+    if (state->pending > 0) flashQueueCancel(connData);
+    if (state->claimed) otaSessionRelease(state->start, state->start + connData->post->len);
+    os_free(state);
+  }
+  connData->cgiData = NULL;
+  return HTTPD_CGI_DONE;
+}
+
+// Take the sectors the X-Sector-Map header lists as being in the flash already. The map is hex,
+// bit i%8 of byte i/8 stands for sector i of the image. A client sets the bits of the sectors
+// whose hash in /flash/sectors matches its image and uploads only the others.
+static char* ICACHE_FLASH_ATTR uploadKeepSectors(HttpdConnData *connData) {
+  char map[2*OTA_MAX_BLOCKS*OTA_BLOCK_SIZE/SPI_FLASH_SEC_SIZE/8 + 1];
+  if (!httpdGetHeader(connData, "X-Sector-Map", map, sizeof(map))) return NULL;
+
+  int kept = 0;
+  for (int i = 0; map[i] != 0 && map[i+1] != 0; i += 2) {
+    char hex[3] = { map[i], map[i+1], 0 }, *end;
+    uint8 byte = strtoul(hex, &end, 16);
+    if (*end != 0) return "Invalid sector map";
+    for (int b = 0; b < 8; b++) {
+      if (!(byte & (1 << b))) continue;
+      char *err = (char *)otaSessionKeep((i/2*8 + b) * SPI_FLASH_SEC_SIZE);
+      if (err != NULL) return err;
+      kept++;
+    }
+  }
+  DBG("Kept %d sectors\n", kept);
+  return NULL;
+}
+
+// Start or resume the upload session for the request. An image may be uploaded in pieces using
+// Content-Range, in which case the X-Image-Digest header (MD5 of the whole image in hex)
+// identifies the session the piece belongs to. Pieces may be uploaded over several connections
+// at the same time, the session finishes when the last missing block arrives.
+// Firmware goes to the partition we flash next, data images to the inactive data slot, which
+// requires a digest.
+static char* ICACHE_FLASH_ATTR uploadBegin(HttpdConnData *connData, UploadState *state,
+    bool data, int *code) {
+  char buf[48];
+  uint8 digest[OTA_DIGEST_LEN];
+  bool haveDigest = false;
+  uint32 first = 0, last = connData->post->len - 1, total = connData->post->len;
+
+  if (httpdGetHeader(connData, "X-Image-Digest", buf, sizeof(buf))) {
+    if (!otaParseDigest(buf, digest)) return "Invalid digest";
+    haveDigest = true;
+  }
+  if (httpdGetHeader(connData, "Content-Range", buf, sizeof(buf))) {
+    if (!parseContentRange(buf, &first, &last, &total) || last - first + 1 != connData->post->len)
+      return "Invalid range";
+    if (!haveDigest) return "Range requires digest";
+    if (first % OTA_BLOCK_SIZE != 0) return "Unaligned range";
+  }
+  if (total < (data ? 1 : 1024)) return "Invalid request";
+  state->start = first;
+
+  uint32 maxLen;
+  char *err;
+  if (data) {
+    if (!haveDigest) return "Data image requires digest";
+    err = (char *)dataRegionNext(&state->address);
+    if (err != NULL) return err;
+    maxLen = dataRegionMaxSize();
+  } else {
+    state->address = getNextSPIFlashAddr();
+    maxLen = getNextFirmwareMaxSize();
+  }
+
+  bool resumed;
+  err = (char *)otaSessionBegin(state->address, maxLen, haveDigest ? digest : NULL, total,
+      &resumed);
+  if (err != NULL) {
+    DBG("Image: %d (max %d)\n", total, maxLen);
+    return err;
+  }
+  DBG("Upload %d-%d/%d %s\n", first, last, total, resumed ? "resumed" : "started");
+
+  // concurrent uploads of the same image must cover disjoint ranges
+  if (!otaSessionClaim(first, last + 1)) {
+    *code = 409;
+    return "Range busy";
+  }
+  state->claimed = true;
+  if (data) {
+    err = (char *)dataRegionBegin(state->address);
+    if (err != NULL) return err;
+  }
+  return uploadKeepSectors(connData);
+}
+
+// A block of the upload has been written by the flash queue
+static void ICACHE_FLASH_ATTR uploadWritten(void *arg, const char *err) {
+  HttpdConnData *connData = arg;
+  UploadState *state = connData->cgiData;
+  state->pending--;
+  if (err != NULL && state->err == NULL) state->err = err;
+  // resume receiving once the queue drained, or our own blocks are all written
+  if (state->held && (flashQueuePending() <= FLASH_QUEUE_LOW || state->pending == 0)) {
+    httpdRecvHold(connData, false);
+    state->held = false;
+    state->idle = system_get_time(); // the wait until now was for the flash, not the network
+  }
+  if (state->pending == 0 && state->finishing) httpdContinue(connData);
+}
+
+static int ICACHE_FLASH_ATTR uploadError(HttpdConnData *connData, int code, const char *err) {
+  DBG("Error %d: %s\n", code, err);
+  httpdStartResponse(connData, code);
+  httpdHeader(connData, "Content-Type", "text/plain");
+  //httpdHeader(connData, "Content-Length", strlen(err)+2);
+  httpdEndHeaders(connData);
+  httpdSend(connData, err, -1);
+  httpdSend(connData, "\r\n", -1);
+  return uploadDone(connData);
+}
+
+// All of the POST body is in the flash, finish the session if this was its last piece
+static int ICACHE_FLASH_ATTR uploadFinish(HttpdConnData *connData, bool data) {
+  UploadState *state = connData->cgiData;
+  const char *err = state->err;
+  if (err == NULL && otaSessionComplete()) {
+    err = otaSessionFinish();
+    // a verified data image replaces the active one right away
+    if (err == NULL && data) err = dataRegionCommit(state->address);
+  }
+  if (err != NULL) return uploadError(connData, 400, err);
+
+  if (otaSessionComplete()) {
+    // summarize where the time went
+    // the stats are gone if the session was resumed after a reboot
+    char buf[320] = "{}";
+    const OtaStats *st = otaStatsGet(0);
+    if (st != NULL) otaStatsFormat(st, buf);
+    jsonHeader(connData, 200);
+    httpdSend(connData, buf, -1);
+  } else {
+    // a piece of the image arrived, others are still missing
+    char buf[48];
+    os_sprintf(buf, "%d bytes missing\r\n", otaSessionMissingBytes());
+    httpdStartResponse(connData, 202);
+    httpdHeader(connData, "Content-Type", "text/plain");
+    httpdEndHeaders(connData);
+    httpdSend(connData, buf, -1);
+  }
+  return uploadDone(connData);
+}
+
+// Whether the image a request is about is in the flash already: If-None-Match has its digest and
+// the partition we flash next, or the active data slot, was verified against the same one.
+static bool ICACHE_FLASH_ATTR uploadNotModified(HttpdConnData *connData, bool data, bool *asked) {
+  char buf[48];
+  uint8 digest[OTA_DIGEST_LEN];
+  *asked = httpdGetHeader(connData, "If-None-Match", buf, sizeof(buf));
+  if (!*asked) return false;
+  // take the digest as it is or quoted like an ETag
+  char *hex = buf[0] == '"' ? buf + 1 : buf;
+  hex[os_strlen(hex) > OTA_DIGEST_HEX_LEN ? OTA_DIGEST_HEX_LEN : os_strlen(hex)] = 0;
+  if (!otaParseDigest(hex, digest)) return false;
+
+  if (data) {
+    DataSlotHeader hdr;
+    uint32 address;
+    return dataRegionActive(&hdr, &address) >= 0 &&
+      os_memcmp(hdr.digest, digest, OTA_DIGEST_LEN) == 0;
+  }
+  const Partition *next = partitionNext();
+  return next != NULL && next->state != PART_STATE_WRITING &&
+    os_memcmp(next->digest, digest, OTA_DIGEST_LEN) == 0;
+}
+
+// Receive a firmware or data image via http POST. The chunks go to the flash queue, so the
+// receive callback returns before the flash is erased or written. Once the last chunk is in,
+// the request waits for the queue and uploadWritten continues it.
+static int ICACHE_FLASH_ATTR uploadImage(HttpdConnData *connData, bool data) {
+  UploadState *state = connData->cgiData;
+  if (state != NULL && state->finishing) return uploadFinish(connData, data);
+
+  // nothing to do if the image is there already, a client may ask with an empty body first
+  bool asked = false;
+  if (state == NULL && uploadNotModified(connData, data, &asked)) {
+    DBG("Image not modified\n");
+    httpdStartResponse(connData, 304);
+    httpdEndHeaders(connData);
+    return HTTPD_CGI_DONE;
+  }
+  if (asked && connData->post->len == 0) {
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "Content-Type", "text/plain");
+    httpdEndHeaders(connData);
+    httpdSend(connData, "Image differs\r\n", -1);
     return HTTPD_CGI_DONE;
   }
 
@@ -150,73 +370,228 @@ int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
   char *err = NULL;
   int code = 400;
 
-  // check overall size
-#ifdef FIRMWARE_SIZE_PARTITION1
-  /* An unsymetric partition table is used.
-   * If partition 2 is active, check with first partition size.
-   */
-  if ( (system_upgrade_enhance_userbin_check() == UPGRADE_FW_BIN1 && connData->post->len > FIRMWARE_SIZE_PARTITION2) ||
-       (system_upgrade_enhance_userbin_check() == UPGRADE_FW_BIN2 && connData->post->len > FIRMWARE_SIZE_PARTITION1) ) {
-      DBG("FW: %d (max1 %d, max2 %d, id %u)\n", connData->post->len, FIRMWARE_SIZE_PARTITION1, FIRMWARE_SIZE_PARTITION2, system_upgrade_enhance_userbin_check());
-#else
-  if (connData->post->len > FIRMWARE_SIZE) {
-      DBG("FW: %d (max %d)\n", connData->post->len, FIRMWARE_SIZE);
-#endif
-      err = "Firmware image too large";
-  }
+  if (connData->post->buff == NULL || connData->requestType != HTTPD_METHOD_POST)
+    err = "Invalid request";
 
-  if (connData->post->buff == NULL || connData->requestType != HTTPD_METHOD_POST ||
-      connData->post->len < 1024) err = "Invalid request";
-
-  // check that data starts with an appropriate header
+  int offset = connData->post->received - connData->post->buffLen;
   if (err == NULL && offset == 0) {
-      err = check_header(connData->post->buff);
+    state = connData->cgiData = os_zalloc(sizeof(UploadState));
+    if (state == NULL) {
+      err = "Out of memory";
+      code = 500;
+    } else {
+      err = uploadBegin(connData, state, data, &code);
+    }
   }
 
   // make sure we're buffering in 1024 byte chunks
-  if (err == NULL && offset % 1024 != 0) {
+  if (err == NULL && offset % OTA_BLOCK_SIZE != 0) {
     err = "Buffering problem";
     code = 500;
   }
 
+  // account the time spent waiting for this chunk
+  if (err == NULL) {
+    otaStatsNetWait(system_get_time() - (offset == 0 ? connData->startTime : state->idle));
+  }
+
+  // a block queued earlier may have failed
+  if (err == NULL && state->err != NULL) err = (char *)state->err;
+
+  // check that firmware starts with an appropriate header
+  uint32 imageOffset = state != NULL ? state->start + offset : 0;
+  if (err == NULL && imageOffset == 0 && !data) {
+    err = check_header(connData->post->buff);
+  }
+
+  // the flash fell behind more than the hold allows for, the client sends the rest again
+  if (err == NULL && flashQueuePending() >= FLASH_QUEUE_LEN) {
+    err = "Flash busy";
+    code = 503;
+  }
+
+  // queue the data, the flash task erases the sector if necessary and writes it
+  if (err == NULL) {
+    //DBG("Queueing %d bytes at 0x%05x (%d of %d)\n", connData->post->buffLen, imageOffset,
+    //		connData->post->received, connData->post->len);
+    state->pending++;
+    err = (char *)flashQueueWrite(imageOffset, connData->post->buff, connData->post->buffLen,
+        uploadWritten, connData);
+    if (err != NULL) state->pending--;
+  }
+
   // return an error if there is one
-  if (err != NULL) {
-    DBG("Error %d: %s\n", code, err);
-    httpdStartResponse(connData, code);
-    httpdHeader(connData, "Content-Type", "text/plain");
-    //httpdHeader(connData, "Content-Length", strlen(err)+2);
-    httpdEndHeaders(connData);
-    httpdSend(connData, err, -1);
-    httpdSend(connData, "\r\n", -1);
-    connData->cgiPrivData = (void *)1;
+  if (err != NULL) return uploadError(connData, code, err);
+
+  if (connData->post->received == connData->post->len) {
+    state->finishing = true;
+    if (state->pending > 0) return HTTPD_CGI_MORE;
+    return uploadFinish(connData, data);
+  } else {
+    // the sender is ahead of the flash, let the TCP window close
+    if (!state->held && flashQueuePending() >= FLASH_QUEUE_HIGH) {
+      httpdRecvHold(connData, true);
+      state->held = true;
+    }
+    state->idle = system_get_time();
+    return HTTPD_CGI_MORE;
+  }
+}
+
+//===== Cgi that allows the firmware to be replaced via http POST
+int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
+  if (connData->conn==NULL) return uploadDone(connData); // Connection aborted. Clean up.
+
+        if (!canOTA()) {
+          errorResponse(connData, 400, flash_too_small);
+          return HTTPD_CGI_DONE;
+        }
+
+  return uploadImage(connData, false);
+}
+
+//===== Cgi that replaces the ESPFS/data image via http POST, without a reboot
+int ICACHE_FLASH_ATTR cgiUploadData(HttpdConnData *connData) {
+  if (connData->conn==NULL) return uploadDone(connData); // Connection aborted. Clean up.
+
+  if (!dataRegionAvailable()) {
+    errorResponse(connData, 400, "No data region");
     return HTTPD_CGI_DONE;
   }
 
-  // let's see which partition we need to flash and what flash address that puts us at
-  uint32 address = getNextSPIFlashAddr();
-  address += offset;
+  return uploadImage(connData, true);
+}
 
-  // erase next flash block if necessary
-  if (address % SPI_FLASH_SEC_SIZE == 0){
-#ifdef CGIFLASH_DBG
-    const uint8 id = system_upgrade_enhance_userbin_check();
-    DBG("Flashing 0x%05x (id=%d)\n", address, 2 - id);
-#endif
-    spi_flash_erase_sector(address/SPI_FLASH_SEC_SIZE);
+//===== Cgi that describes the active ESPFS/data image
+int ICACHE_FLASH_ATTR cgiDataInfo(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char buf[160];
+  char digest[OTA_DIGEST_HEX_LEN+1] = "";
+  DataSlotHeader hdr;
+  uint32 address = 0;
+  int slot = dataRegionActive(&hdr, &address);
+  if (slot >= 0) otaFormatDigest(hdr.digest, digest);
+
+  jsonHeader(connData, 200);
+  os_sprintf(buf, "{\"available\":%s,\"max\":%d,\"slot\":%d,\"seq\":%d,\"address\":%d,"
+      "\"length\":%d,\"digest\":\"%s\"}", dataRegionAvailable() ? "true" : "false",
+      dataRegionMaxSize(), slot, slot >= 0 ? hdr.seq : 0, address, slot >= 0 ? hdr.length : 0,
+      digest);
+  httpdSend(connData, buf, -1);
+  return HTTPD_CGI_DONE;
+}
+
+// Per-request state of a download of the data image
+typedef struct {
+  uint32 seq;     // the image being sent, see dataRegionRead
+  uint32 length;
+  uint32 sent;
+} DataReadState;
+
+#define DATA_READ_CHUNK 1024 // bytes sent per call, the send buffer also holds the headers
+
+//===== Cgi that sends the active ESPFS/data image. The image that is active when the request
+// comes in is sent to its end, or the connection is closed early if an upload replaces it.
+int ICACHE_FLASH_ATTR cgiDataImage(HttpdConnData *connData) {
+  DataReadState *state = connData->cgiData;
+  if (connData->conn==NULL) { // Connection aborted. Clean up.
+    os_free(state);
+    connData->cgiData = NULL;
+    return HTTPD_CGI_DONE;
   }
 
-  // Write the data
-  //DBG("Writing %d bytes at 0x%05x (%d of %d)\n", connData->post->buffSize, address,
-  //		connData->post->received, connData->post->len);
-  spi_flash_write(address, (uint32 *)connData->post->buff, connData->post->buffLen);
+  if (state == NULL) {
+    bool asked;
+    if (uploadNotModified(connData, true, &asked)) {
+      httpdStartResponse(connData, 304);
+      httpdEndHeaders(connData);
+      return HTTPD_CGI_DONE;
+    }
+    DataSlotHeader hdr;
+    if (dataRegionActive(&hdr, NULL) < 0) {
+      errorResponse(connData, 404, "No data image");
+      return HTTPD_CGI_DONE;
+    }
+    state = connData->cgiData = os_zalloc(sizeof(DataReadState));
+    if (state == NULL) {
+      errorResponse(connData, 500, "Out of memory");
+      return HTTPD_CGI_DONE;
+    }
+    state->seq = hdr.seq;
+    state->length = hdr.length;
 
-  if (connData->post->received == connData->post->len){
+    char buf[OTA_DIGEST_HEX_LEN+3] = "\"";
+    otaFormatDigest(hdr.digest, buf + 1);
+    buf[OTA_DIGEST_HEX_LEN+1] = '"';
+    buf[OTA_DIGEST_HEX_LEN+2] = 0;
     httpdStartResponse(connData, 200);
+    httpdHeader(connData, "Content-Type", "application/octet-stream");
+    httpdHeader(connData, "ETag", buf);
+    os_sprintf(buf, "%d", hdr.length);
+    httpdHeader(connData, "Content-Length", buf);
     httpdEndHeaders(connData);
-    return HTTPD_CGI_DONE;
-  } else {
-    return HTTPD_CGI_MORE;
   }
+
+  uint32 buf[DATA_READ_CHUNK/4];
+  uint32 len = state->length - state->sent < DATA_READ_CHUNK ?
+    state->length - state->sent : DATA_READ_CHUNK;
+  const char *err = len > 0 ? dataRegionRead(state->seq, state->sent, buf, len) : NULL;
+  if (err != NULL) DBG("Data image: %s at %d\n", err, state->sent);
+  else httpdSend(connData, (char *)buf, len);
+  state->sent += len;
+  if (err == NULL && state->sent < state->length) return HTTPD_CGI_MORE;
+  os_free(state);
+  connData->cgiData = NULL;
+  return HTTPD_CGI_DONE;
+}
+
+//===== Cgi that returns the timing breakdown of the last few uploads
+int ICACHE_FLASH_ATTR cgiUploadStats(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char buf[320];
+  uint32_t fid = spi_flash_get_id();
+  jsonHeader(connData, 200);
+  os_sprintf(buf, "{\"flash_manuf\":\"0x%02lX\",\"flash_chip\":\"0x%04lX\",\"sessions\":[",
+      fid & 0xff, (fid&0xff00)|((fid>>16)&0xff));
+  httpdSend(connData, buf, -1);
+  const OtaStats *stats;
+  for (int i = 0; (stats = otaStatsGet(i)) != NULL; i++) {
+    if (i > 0) httpdSend(connData, ",", 1);
+    otaStatsFormat(stats, buf);
+    httpdSend(connData, buf, -1);
+  }
+  httpdSend(connData, "]}", 2);
+  return HTTPD_CGI_DONE;
+}
+
+//===== Cgi to query the state of the current upload session, used to resume an upload
+int ICACHE_FLASH_ATTR cgiUploadStatus(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char buf[128];
+  char digest[OTA_DIGEST_HEX_LEN+1] = "";
+  const OtaSession *session = otaSessionGet();
+  if (session != NULL) otaFormatDigest(session->digest, digest);
+
+  jsonHeader(connData, 200);
+  os_sprintf(buf, "{\"address\":%d,\"length\":%d,\"digest\":\"%s\",\"complete\":%s,\"missing\":[",
+      session ? session->address : 0, session ? session->length : 0, digest,
+      otaSessionComplete() ? "true" : "false");
+  httpdSend(connData, buf, -1);
+
+  // missing ranges in Content-Range notation, limited to what fits into the send buffer
+  uint32 start = 0, end;
+  int n = 0;
+  while (n < 64 && otaSessionNextMissing(&start, &end)) {
+    os_sprintf(buf, "%s\"%d-%d\"", n++ ? "," : "", start, end - 1);
+    httpdSend(connData, buf, -1);
+    start = end;
+  }
+  os_sprintf(buf, "],\"truncated\":%s}", otaSessionNextMissing(&start, &end) ? "true" : "false");
+  httpdSend(connData, buf, -1);
+  return HTTPD_CGI_DONE;
 }
 
 
@@ -229,6 +604,30 @@ static void cgiRebootFirmwareTimer(void *timer_arg)
     }
 }
 
+// Check that the 'next' partition holds a complete firmware and schedule a reboot into it.
+// Returns an error message if the partition doesn't look bootable.
+const char* ICACHE_FLASH_ATTR flashRebootIntoNext(void) {
+  // sanity-check that the 'next' partition actually contains something that looks like
+  // valid firmware
+  // and that no upload into it is unfinished, also one that a power cycle interrupted
+  const char* err = checkUpgradedFirmware();
+  const Partition *next = partitionNext();
+  if (err == NULL && (otaSessionIncomplete(getNextSPIFlashAddr()) ||
+      (next != NULL && next->state == PART_STATE_WRITING))) err = "Upload incomplete";
+  if (err != NULL) return err;
+
+  // the partition keeps the digest its upload was verified against, if any
+  err = partitionSetImage(next);
+  if (err != NULL) DBG("Partition table: %s\n", err);
+
+  // Schedule a reboot
+  system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+  os_timer_disarm(&flash_reboot_timer);
+  os_timer_setfn(&flash_reboot_timer, cgiRebootFirmwareTimer, NULL);
+  os_timer_arm(&flash_reboot_timer, 2000, 1);
+  return NULL;
+}
+
 // Handle request to reboot into the new firmware
 int ICACHE_FLASH_ATTR cgiRebootFirmware(HttpdConnData *connData) {
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
@@ -238,9 +637,7 @@ int ICACHE_FLASH_ATTR cgiRebootFirmware(HttpdConnData *connData) {
     return HTTPD_CGI_DONE;
   }
 
-  // sanity-check that the 'next' partition actually contains something that looks like
-  // valid firmware
-  const char* const err = checkUpgradedFirmware();
+  const char* err = flashRebootIntoNext();
   if (err != NULL) {
     DBG("Error %d: %s\n", 400, err);
     httpdStartResponse(connData, 400);
@@ -255,11 +652,227 @@ int ICACHE_FLASH_ATTR cgiRebootFirmware(HttpdConnData *connData) {
   httpdStartResponse(connData, 200);
   httpdHeader(connData, "Content-Length", "0");
   httpdEndHeaders(connData);
+  return HTTPD_CGI_DONE;
+}
 
-  // Schedule a reboot
-  system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
-  os_timer_disarm(&flash_reboot_timer);
-  os_timer_setfn(&flash_reboot_timer, cgiRebootFirmwareTimer, NULL);
-  os_timer_arm(&flash_reboot_timer, 2000, 1);
+//===== Multi-image bundles
+
+/* A bundle carries several images that get written in one POST and committed with one reboot.
+ * It starts with a 1KB manifest: a BundleHeader followed by one BundleImage per image, padded
+ * with zeros. The payloads follow in manifest order, each padded with zeros to a multiple of
+ * 1KB so that every POST chunk belongs to exactly one image. All values are little endian.
+ */
+#define BUNDLE_MAGIC        0x42505345 // "ESPB"
+#define BUNDLE_VERSION      1
+#define BUNDLE_MAX_IMAGES   8
+
+#define BUNDLE_USER1        1 // firmware for partition 1, skipped unless it is flashed next
+#define BUNDLE_USER2        2 // firmware for partition 2, skipped unless it is flashed next
+#define BUNDLE_ESPFS        3 // ESPFS image written to the address in the manifest, or to the
+                              // data region if the address is 0
+#define BUNDLE_CONFIG       4 // configuration written to the address in the manifest
+
+typedef struct {
+  uint32 magic;
+  uint8  version;
+  uint8  count;               // number of images
+  uint16 reserved[5];
+} BundleHeader;
+
+typedef struct {
+  uint8  type;
+  uint8  reserved[3];
+  uint32 address;             // flash address, ignored for firmware
+  uint32 size;                // payload size without padding
+  uint32 reserved2;
+  uint8  digest[OTA_DIGEST_LEN];  // MD5 of the payload
+} BundleImage;
+
+typedef struct {
+  BundleImage images[BUNDLE_MAX_IMAGES];
+  uint8  count;
+  uint8  cur;                 // image being received
+  uint32 curStart;            // offset in the POST body where the current image starts
+  uint32 written;             // number of images written
+  bool   claimed;             // whether the current image is claimed in the upload session
+  bool   reboot;              // reboot into the next partition once everything is written
+  bool   rebootAsked;         // the request said reboot=1
+  uint8  dataImage;           // 1 + index of the image that goes to the data region, 0 if none
+} BundleState;
+
+#define BUNDLE_PADDED(size) (((size) + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE * OTA_BLOCK_SIZE)
+
+// Parse and validate the manifest at the start of a bundle
+static char* ICACHE_FLASH_ATTR bundleManifest(HttpdConnData *connData, BundleState *state) {
+  BundleHeader *hdr = (BundleHeader *)connData->post->buff;
+  if (connData->post->buffLen < OTA_BLOCK_SIZE || hdr->magic != BUNDLE_MAGIC ||
+      hdr->version != BUNDLE_VERSION) return "Not a bundle";
+  if (hdr->count == 0 || hdr->count > BUNDLE_MAX_IMAGES) return "Bad image count";
+
+  const uint8 nextType = partitionAppIndex(partitionNext()) == 0 ? BUNDLE_USER1 : BUNDLE_USER2;
+  uint32 len = OTA_BLOCK_SIZE;
+  bool firmware = false;
+  state->count = hdr->count;
+  os_memcpy(state->images, hdr + 1, hdr->count * sizeof(BundleImage));
+  for (int i = 0; i < state->count; i++) {
+    BundleImage *img = &state->images[i];
+    len += BUNDLE_PADDED(img->size);
+    if (img->size == 0) return "Empty image";
+    switch (img->type) {
+    case BUNDLE_USER1:
+    case BUNDLE_USER2:
+      if (img->type == nextType) {
+        img->address = getNextSPIFlashAddr();
+        if (img->size > getNextFirmwareMaxSize()) return "Firmware image too large";
+        firmware = true;
+      } else {
+        img->address = 0; // skip
+      }
+      break;
+    case BUNDLE_ESPFS:
+    case BUNDLE_CONFIG: {
+      char *err;
+      if (img->type == BUNDLE_ESPFS && img->address == 0) {
+        if (state->dataImage != 0) return "Images overlap";
+        if (img->size > dataRegionMaxSize()) return "Data image too large";
+        err = (char *)dataRegionNext(&img->address);
+        state->dataImage = i + 1;
+      } else {
+        err = checkDataRegion(img->address, img->size);
+      }
+      if (err != NULL) return err;
+      for (int j = 0; j < i; j++) {
+        BundleImage *o = &state->images[j];
+        if (o->address != 0 && img->address < o->address + o->size &&
+            o->address < img->address + img->size) return "Images overlap";
+      }
+      break;
+    }
+    default:
+      return "Unknown image type";
+    }
+  }
+  if (len != connData->post->len) return "Bundle size mismatch";
+  // without firmware for the next partition a reboot would boot whatever it holds, after an
+  // earlier upgrade the previous firmware
+  if (!firmware) {
+    if (state->rebootAsked) return "No firmware to reboot into";
+    state->reboot = false;
+  }
+  state->curStart = OTA_BLOCK_SIZE;
+  return NULL;
+}
+
+// Write one chunk of the bundle into the image it belongs to
+static char* ICACHE_FLASH_ATTR bundleWrite(HttpdConnData *connData, BundleState *state,
+    uint32 offset) {
+  while (state->cur < state->count &&
+      offset >= state->curStart + BUNDLE_PADDED(state->images[state->cur].size)) {
+    state->curStart += BUNDLE_PADDED(state->images[state->cur].size);
+    state->cur++;
+  }
+  if (state->cur >= state->count) return "Bundle size mismatch";
+  BundleImage *img = &state->images[state->cur];
+  if (img->address == 0) return NULL; // firmware for the partition we're running from
+
+  uint32 imgOffset = offset - state->curStart;
+  char *err;
+  if (imgOffset == 0) {
+    DBG("Bundle image %d: type %d, %d bytes at 0x%05x\n", state->cur, img->type, img->size,
+        img->address);
+    // the data slot is only touched once its payload arrives, the manifest may still fail
+    if (state->dataImage == state->cur + 1) {
+      err = (char *)dataRegionBegin(img->address);
+      if (err != NULL) return err;
+    }
+    err = (char *)otaSessionBegin(img->address, img->size, img->digest, img->size, NULL);
+    if (err != NULL) return err;
+    if (!otaSessionClaim(0, img->size)) return "Upload in progress";
+    state->claimed = true;
+    if (img->type == BUNDLE_USER1 || img->type == BUNDLE_USER2) {
+      err = check_header(connData->post->buff);
+      if (err != NULL) return err;
+    }
+  }
+
+  uint32 len = img->size - imgOffset < connData->post->buffLen ?
+    img->size - imgOffset : connData->post->buffLen;
+  err = (char *)otaSessionWrite(imgOffset, connData->post->buff, len);
+  if (err != NULL) return err;
+
+  if (imgOffset + len == img->size) {
+    otaSessionRelease(0, img->size);
+    state->claimed = false;
+    err = (char *)otaSessionFinish();
+    if (err == NULL && state->dataImage == state->cur + 1)
+      err = (char *)dataRegionCommit(img->address);
+    if (err != NULL) return err;
+    state->written++;
+  }
+  return NULL;
+}
+
+static int ICACHE_FLASH_ATTR bundleDone(HttpdConnData *connData) {
+  BundleState *state = connData->cgiData;
+  if (state != NULL) {
+    if (state->claimed) otaSessionRelease(0, state->images[state->cur].size);
+    os_free(state);
+  }
+  connData->cgiData = NULL;
   return HTTPD_CGI_DONE;
 }
+
+//===== Cgi that writes a multi-image bundle and reboots into the new firmware, unless called
+// with reboot=0. A bundle without firmware for the next partition never reboots, with reboot=1
+// it is rejected.
+int ICACHE_FLASH_ATTR cgiUploadBundle(HttpdConnData *connData) {
+  if (connData->conn==NULL) return bundleDone(connData); // Connection aborted. Clean up.
+
+  if (!canOTA()) {
+    errorResponse(connData, 400, flash_too_small);
+    return HTTPD_CGI_DONE;
+  }
+
+  char *err = NULL;
+  int offset = connData->post->received - connData->post->buffLen;
+  BundleState *state = connData->cgiData;
+
+  if (connData->post->buff == NULL || connData->requestType != HTTPD_METHOD_POST ||
+      offset % OTA_BLOCK_SIZE != 0) {
+    err = "Invalid request";
+  } else if (offset == 0) {
+    char arg[4];
+    state = connData->cgiData = os_zalloc(sizeof(BundleState));
+    if (state == NULL) {
+      err = "Out of memory";
+    } else {
+      bool given = httpdFindArg(connData->getArgs, "reboot", arg, sizeof(arg)) > 0;
+      state->reboot = !given || arg[0] != '0';
+      state->rebootAsked = given && arg[0] != '0';
+      err = bundleManifest(connData, state);
+    }
+  } else {
+    err = bundleWrite(connData, state, offset);
+  }
+
+  if (err == NULL && connData->post->received == connData->post->len) {
+    if (state->cur != state->count - 1) err = "Bundle size mismatch";
+    else if (state->reboot) err = (char *)flashRebootIntoNext();
+  }
+
+  if (err != NULL) {
+    DBG("Bundle error: %s\n", err);
+    errorResponse(connData, 400, err);
+    return bundleDone(connData);
+  }
+
+  if (connData->post->received == connData->post->len) {
+    char buf[64];
+    os_sprintf(buf, "{\"images\":%d,\"reboot\":%s}", state->written,
+        state->reboot ? "true" : "false");
+    jsonHeader(connData, 200);
+    httpdSend(connData, buf, -1);
+    return bundleDone(connData);
+  }
+  return HTTPD_CGI_MORE;
+}
@@ -4,9 +4,21 @@
 #include "httpd.h"
 
 const char* const checkUpgradedFirmware(void);
+const char *flashRebootIntoNext(void);
+const char *flashNextImageName(void);
+uint8 flashRunningPartition(void);
+uint32 getNextSPIFlashAddr(void);
+uint32 getNextFirmwareMaxSize(void);
+char *check_header(void *buf);
 
 int cgiGetFirmwareNext(HttpdConnData *connData);
 int cgiUploadFirmware(HttpdConnData *connData);
+int cgiUploadStatus(HttpdConnData *connData);
+int cgiUploadStats(HttpdConnData *connData);
 int cgiRebootFirmware(HttpdConnData *connData);
+int cgiUploadBundle(HttpdConnData *connData);
+int cgiUploadData(HttpdConnData *connData);
+int cgiDataInfo(HttpdConnData *connData);
+int cgiDataImage(HttpdConnData *connData);
 
 #endif
@@ -16,8 +16,14 @@ Cgi/template routines for the /wifi url.
 #include <esp8266.h>
 #include "cgiwifi.h"
 #include "cgi.h"
+#include "wificache.h"
+#ifdef BINARY_LOG
+#include "binlog.h"
+#endif
 
-#ifdef CGIWIFI_DBG
+#if defined(CGIWIFI_DBG) && defined(BINARY_LOG)
+#define DBG(format, ...) LOG(format, ## __VA_ARGS__)
+#elif defined(CGIWIFI_DBG)
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
 #else
 #define DBG(format, ...) do { } while(0)
@@ -132,11 +138,182 @@ static int ICACHE_FLASH_ATTR checkString(char *str){
 }
 #endif
 
+// Whether the station got an IP address or the soft-AP is up. The SDK has no event for the
+// soft-AP coming up, so this needs to be polled.
+bool ICACHE_FLASH_ATTR wifiIsUp(void) {
+  struct ip_info info;
+  uint8 mode = wifi_get_opmode();
+  return ((mode & STATION_MODE) && wifi_station_get_connect_status() == STATION_GOT_IP) ||
+    ((mode & SOFTAP_MODE) && wifi_get_ip_info(SOFTAP_IF, &info) && info.ip.addr != 0);
+}
+
+#ifdef STA_SSID
+// Station mode: join STA_SSID, right away with the access point, channel and lease cached from
+// the last time (see wificache.c). If the cached access point doesn't answer within
+// WIFI_FAST_TIMEOUT the station scans and asks DHCP instead. Without an address after
+// WIFI_STA_TIMEOUT the soft-AP comes up as well, so the device can still be reached.
+#define WIFI_FAST_TIMEOUT   3000  // ms
+#define WIFI_STA_TIMEOUT    15000 // ms, from the start of the connect
+#define WIFI_LEASE_RENEW    60000 // ms, a reused lease is renewed with the DHCP server after this
+
+static ETSTimer staTimer;
+static enum { STA_FAST, STA_SCAN, STA_FALLBACK, STA_UP } staState;
+static bool staReused;      // the address is the cached lease, the DHCP client is off
+static uint8 staBssid[6], staChannel;
+
+// The address set with STA_IP, false if it uses DHCP
+static bool ICACHE_FLASH_ATTR staStaticIp(struct ip_info *info) {
+#ifdef STA_IP
+  info->ip.addr = ipaddr_addr(VERS_STR(STA_IP));
+#ifdef STA_NETMASK
+  info->netmask.addr = ipaddr_addr(VERS_STR(STA_NETMASK));
+#else
+  IP4_ADDR(&info->netmask, 255, 255, 255, 0);
+#endif
+#ifdef STA_GATEWAY
+  info->gw.addr = ipaddr_addr(VERS_STR(STA_GATEWAY));
+#else
+  info->gw.addr = 0;
+#endif
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void ICACHE_FLASH_ATTR staConfig(const uint8 *bssid) {
+  struct station_config sc;
+  os_memset(&sc, 0, sizeof(sc));
+  os_strncpy((char *)sc.ssid, VERS_STR(STA_SSID), sizeof(sc.ssid));
+#ifdef STA_PASS
+  os_strncpy((char *)sc.password, VERS_STR(STA_PASS), sizeof(sc.password));
+#endif
+  if (bssid != NULL) {
+    sc.bssid_set = 1;
+    os_memcpy(sc.bssid, bssid, 6);
+  }
+  wifi_station_set_config_current(&sc);
+}
+
+// Connect the way a station without a cache does: scan for STA_SSID and ask DHCP
+static void ICACHE_FLASH_ATTR staScan(void) {
+  staState = STA_SCAN;
+  wifi_station_disconnect();
+  staConfig(NULL);
+  struct ip_info info;
+  if (!staStaticIp(&info)) wifi_station_dhcpc_start();
+  staReused = false;
+  wifi_station_connect();
+  os_timer_arm(&staTimer, WIFI_STA_TIMEOUT - WIFI_FAST_TIMEOUT, 0);
+}
+
+static void ICACHE_FLASH_ATTR staTimerCb(void *arg) {
+  switch (staState) {
+  case STA_FAST:
+    DBG("Wifi: cached access point didn't answer, scanning\n");
+    wifiCacheForget();
+    staScan();
+    break;
+  case STA_SCAN:
+    DBG("Wifi: no address, starting the soft-AP\n");
+    staState = STA_FALLBACK;
+    wifi_set_opmode_current(STATIONAP_MODE);
+    break;
+  case STA_UP:
+    if (staReused) {
+      DBG("Wifi: renewing the cached lease\n");
+      staReused = false;
+      wifi_station_dhcpc_start();
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void ICACHE_FLASH_ATTR staEventCb(System_Event_t *evt) {
+  switch (evt->event) {
+  case EVENT_STAMODE_CONNECTED:
+    os_memcpy(staBssid, evt->event_info.connected.bssid, 6);
+    staChannel = evt->event_info.connected.channel;
+    break;
+  case EVENT_STAMODE_DISCONNECTED:
+    // the cached access point is gone, no need to wait for the timeout
+    if (staState == STA_FAST && evt->event_info.disconnected.reason == REASON_NO_AP_FOUND) {
+      os_timer_disarm(&staTimer);
+      staTimerCb(NULL);
+    }
+    break;
+  case EVENT_STAMODE_GOT_IP: {
+    os_timer_disarm(&staTimer);
+    staState = STA_UP;
+    struct ip_info info;
+    bool dhcp = !staStaticIp(&info);
+    if (dhcp) {
+      info.ip = evt->event_info.got_ip.ip;
+      info.netmask = evt->event_info.got_ip.mask;
+      info.gw = evt->event_info.got_ip.gw;
+    }
+    wifiCacheSave(staBssid, staChannel, dhcp ? &info : NULL);
+    if (staReused) os_timer_arm(&staTimer, WIFI_LEASE_RENEW, 0);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Start joining STA_SSID, the SDK wants this after the system init is done
+void ICACHE_FLASH_ATTR wifiConnect(void) {
+  os_timer_disarm(&staTimer);
+  os_timer_setfn(&staTimer, staTimerCb, NULL);
+
+  WifiCache cache;
+  struct ip_info info;
+  bool fast = wifiCacheLoad(&cache);
+  staState = fast ? STA_FAST : STA_SCAN;
+  staConfig(fast ? cache.bssid : NULL);
+  if (fast) wifi_set_channel(cache.channel);
+  staReused = false;
+  if (staStaticIp(&info)) {
+    wifi_station_dhcpc_stop();
+    wifi_set_ip_info(STATION_IF, &info);
+  } else if (fast && (cache.flags & WIFI_CACHE_LEASE)) {
+    // use the lease right away, it is renewed once the device has been up for a while
+    info.ip.addr = cache.ip;
+    info.netmask.addr = cache.netmask;
+    info.gw.addr = cache.gw;
+    wifi_station_dhcpc_stop();
+    wifi_set_ip_info(STATION_IF, &info);
+    staReused = true;
+  } else {
+    wifi_station_dhcpc_start();
+  }
+  DBG("Wifi: joining %s, %s\n", VERS_STR(STA_SSID), fast ? "cached" : "scanning");
+  wifi_station_connect();
+  os_timer_arm(&staTimer, fast ? WIFI_FAST_TIMEOUT : WIFI_STA_TIMEOUT, 0);
+}
+#else
+void ICACHE_FLASH_ATTR wifiConnect(void) {
+}
+#endif
+
+#if defined(CGIWIFI_DBG) || defined(STA_SSID)
+static void ICACHE_FLASH_ATTR wifiEventCb(System_Event_t *evt) {
+#ifdef CGIWIFI_DBG
+  wifiHandleEventCb(evt);
+#endif
+#ifdef STA_SSID
+  staEventCb(evt);
+#endif
+}
+#endif
+
 /*  Init the wireless
  *
  *  Call both Soft-AP and Station default config
  *  Change values according to Makefile hard-coded variables
- *  Anyway set wifi opmode to STA+AP, it will change to STA if CHANGE_TO_STA is set to yes in Makefile
+ *  The opmode is SOFTAP, or STA if STA_SSID is set in the Makefile, see wifiConnect
  *  Call a timer to check the STA connection
  */
 void ICACHE_FLASH_ATTR wifiInit() {
@@ -146,7 +323,14 @@ void ICACHE_FLASH_ATTR wifiInit() {
     DBG("Wifi init, mode=%s\n",wifiMode[x]);
 #endif
 
+#ifdef STA_SSID
+    // not saved to flash, a station that fell back to STA+AP starts as a station again
+    wifi_set_opmode_current(STATION_MODE);
+    // wifiConnect joins, the SDK shouldn't try with what it has in flash
+    if (wifi_station_get_auto_connect()) wifi_station_set_auto_connect(0);
+#else
     wifi_set_opmode(SOFTAP_MODE);
+#endif
 
     // Change SOFT_AP settings if defined
 #if defined(AP_SSID)
@@ -214,8 +398,10 @@ void ICACHE_FLASH_ATTR wifiInit() {
     // all connections.
     wifi_set_sleep_type(MODEM_SLEEP_T);
 
+#if defined(CGIWIFI_DBG) || defined(STA_SSID)
+    wifi_set_event_handler_cb(wifiEventCb);
+#endif
 #ifdef CGIWIFI_DBG
-    wifi_set_event_handler_cb(wifiHandleEventCb);
     // check on the wifi in a few seconds to see whether we need to switch mode
     os_timer_disarm(&resetTimer);
     os_timer_setfn(&resetTimer, resetTimerCb, NULL);
@@ -8,6 +8,8 @@ typedef void(*WifiStateChangeCb)(uint8_t wifiStatus);
 
 void configWifiIP();
 void wifiInit(void);
+void wifiConnect(void);
+bool wifiIsUp(void);
 void wifiAddStateChangeCb(WifiStateChangeCb cb);
 int checkString(char *str);
 
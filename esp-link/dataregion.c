@@ -0,0 +1,134 @@
+/*
+Double buffered data region: keeps the current ESPFS/data image in one slot while the next one is
+uploaded into the other, and switches over atomically once the new image is verified. Readers
+go through dataRegionRead, so the next one they start after the switch reads the new image.
+*/
+
+#include <esp8266.h>
+#include "dataregion.h"
+#include "partitions.h"
+
+#ifdef DATA_REGION_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define DATA_SLOT_MAGIC   0x54534C44 // "DLST"
+
+// The region is the data partition of the partition table, split into equal slots
+static uint32 ICACHE_FLASH_ATTR slotSize(void) {
+  const Partition *p = partitionFind(PART_TYPE_DATA, 0);
+  return p != NULL ? p->size / DATA_SLOTS / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE : 0;
+}
+
+static uint32 ICACHE_FLASH_ATTR slotAddr(int slot) {
+  const Partition *p = partitionFind(PART_TYPE_DATA, 0);
+  return p != NULL ? p->address + slot*slotSize() : 0;
+}
+
+static uint32 ICACHE_FLASH_ATTR headerChecksum(const DataSlotHeader *hdr) {
+  const uint32 *w = (const uint32 *)hdr;
+  uint32 sum = 0;
+  for (int i = 0; i < offsetof(DataSlotHeader, checksum)/4; i++) sum = (sum << 1 | sum >> 31) ^ w[i];
+  return sum;
+}
+
+static bool ICACHE_FLASH_ATTR headerRead(int slot, DataSlotHeader *hdr) {
+  spi_flash_read(slotAddr(slot), (uint32 *)hdr, sizeof(*hdr));
+  return hdr->magic == DATA_SLOT_MAGIC && hdr->checksum == headerChecksum(hdr) &&
+    hdr->length <= dataRegionMaxSize();
+}
+
+bool ICACHE_FLASH_ATTR dataRegionAvailable(void) {
+  return slotSize() > SPI_FLASH_SEC_SIZE;
+}
+
+// Largest image a slot can hold
+uint32 ICACHE_FLASH_ATTR dataRegionMaxSize(void) {
+  if (!dataRegionAvailable()) return 0;
+  uint32 max = slotSize() - SPI_FLASH_SEC_SIZE;
+  return max < OTA_MAX_BLOCKS*OTA_BLOCK_SIZE ? max : OTA_MAX_BLOCKS*OTA_BLOCK_SIZE;
+}
+
+// Returns the active slot and fills in its header and the flash address of its image, or
+// returns -1 if neither slot holds a valid image
+int ICACHE_FLASH_ATTR dataRegionActive(DataSlotHeader *hdr, uint32 *address) {
+  DataSlotHeader h[DATA_SLOTS];
+  int active = -1;
+  if (!dataRegionAvailable()) return -1;
+  for (int slot = 0; slot < DATA_SLOTS; slot++) {
+    if (headerRead(slot, &h[slot]) && (active < 0 || h[slot].seq > h[active].seq)) active = slot;
+  }
+  if (active < 0) return -1;
+  if (hdr != NULL) *hdr = h[active];
+  if (address != NULL) *address = slotAddr(active) + SPI_FLASH_SEC_SIZE;
+  return active;
+}
+
+// The flash address the image of the next upload goes to, the one of the inactive slot
+const char* ICACHE_FLASH_ATTR dataRegionNext(uint32 *address) {
+  if (!dataRegionAvailable()) return "No data region";
+  *address = slotAddr(dataRegionActive(NULL, NULL) == 0 ? 1 : 0) + SPI_FLASH_SEC_SIZE;
+  return NULL;
+}
+
+// Prepare the slot of address for the first block of its image. The slot's header is erased
+// first, so a slot never becomes active with a partial image. The slot may have become active
+// since dataRegionNext returned it, its image stays then.
+const char* ICACHE_FLASH_ATTR dataRegionBegin(uint32 address) {
+  DataSlotHeader hdr;
+  if (!dataRegionAvailable()) return "No data region";
+  int slot = 0;
+  while (slot < DATA_SLOTS && address != slotAddr(slot) + SPI_FLASH_SEC_SIZE) slot++;
+  if (slot >= DATA_SLOTS) return "Not a data slot";
+  if (slot == dataRegionActive(NULL, NULL)) return "Data slot in use";
+  if (headerRead(slot, &hdr) || hdr.magic != 0xffffffff) {
+    DBG("Data slot %d: erasing header\n", slot);
+    if (spi_flash_erase_sector(slotAddr(slot)/SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+      return "Flash erase failed";
+  }
+  return NULL;
+}
+
+// Make the image uploaded to address the active one. It must have been completed and verified
+// by the upload session. Writing the header is the switch-over: until it's in the flash the
+// previous image stays active.
+const char* ICACHE_FLASH_ATTR dataRegionCommit(uint32 address) {
+  const OtaSession *session = otaSessionGet();
+  if (session == NULL || session->address != address || !otaSessionComplete() ||
+      !(session->flags & OTA_SESSION_VERIFIED)) return "Data image not verified";
+  if (!dataRegionAvailable()) return "No data region";
+
+  DataSlotHeader cur, hdr;
+  int slot = 0;
+  while (slot < DATA_SLOTS && address != slotAddr(slot) + SPI_FLASH_SEC_SIZE) slot++;
+  if (slot >= DATA_SLOTS) return "Not a data slot";
+  int active = dataRegionActive(&cur, NULL);
+  if (active == slot) return NULL; // committed by an earlier request
+
+  os_memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = DATA_SLOT_MAGIC;
+  hdr.seq = active < 0 ? 1 : cur.seq + 1;
+  hdr.length = session->length;
+  os_memcpy(hdr.digest, session->digest, OTA_DIGEST_LEN);
+  hdr.checksum = headerChecksum(&hdr);
+  if (spi_flash_write(slotAddr(slot), (uint32 *)&hdr, sizeof(hdr)) != SPI_FLASH_RESULT_OK)
+    return "Flash write failed";
+  DBG("Data slot %d active, seq %d, %d bytes\n", slot, hdr.seq, hdr.length);
+  return NULL;
+}
+
+// Read len bytes at offset of the image with sequence number seq, rounded up to 4 bytes. A reader
+// takes seq from dataRegionActive and sees the image it started with, or an error once that
+// image is no longer in the flash: an upload erases the header of a slot before its image.
+const char* ICACHE_FLASH_ATTR dataRegionRead(uint32 seq, uint32 offset, uint32 *buf, uint32 len) {
+  DataSlotHeader hdr;
+  int slot = 0;
+  while (slot < DATA_SLOTS && !(headerRead(slot, &hdr) && hdr.seq == seq)) slot++;
+  if (slot >= DATA_SLOTS) return "Data image replaced";
+  if (offset > hdr.length || len > hdr.length - offset) return "Read past the image";
+  if (spi_flash_read(slotAddr(slot) + SPI_FLASH_SEC_SIZE + offset, buf, (len + 3) & ~3) !=
+      SPI_FLASH_RESULT_OK) return "Flash read failed";
+  return NULL;
+}
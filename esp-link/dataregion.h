@@ -0,0 +1,37 @@
+#ifndef DATAREGION_H
+#define DATAREGION_H
+
+#include <esp8266.h>
+#include "otasession.h"
+
+// The data region holds an ESPFS or other data image outside of the firmware partitions. It is
+// double buffered: an upload goes into the inactive slot and switches over by writing the slot's
+// header once the image is verified, so the new image is used without a reboot. The region is
+// the data partition of the partition table, the Makefile only places it for the default
+// layout, DATA_SLOT_SIZE is 0 where the flash has no room for it.
+#ifndef DATA_REGION_ADDR
+#define DATA_REGION_ADDR  0
+#endif
+#ifndef DATA_SLOT_SIZE
+#define DATA_SLOT_SIZE    0
+#endif
+#define DATA_SLOTS        2
+
+// Header in the first sector of a slot, the image follows in the next sector
+typedef struct {
+  uint32 magic;
+  uint32 seq;                       // the valid slot with the highest sequence number is active
+  uint32 length;                    // length of the image in bytes
+  uint8  digest[OTA_DIGEST_LEN];    // MD5 of the image
+  uint32 checksum;
+} DataSlotHeader;
+
+bool dataRegionAvailable(void);
+uint32 dataRegionMaxSize(void);
+const char *dataRegionNext(uint32 *address);
+const char *dataRegionBegin(uint32 address);
+const char *dataRegionCommit(uint32 address);
+int dataRegionActive(DataSlotHeader *hdr, uint32 *address);
+const char *dataRegionRead(uint32 seq, uint32 offset, uint32 *buf, uint32 len);
+
+#endif // DATAREGION_H
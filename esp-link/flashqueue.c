@@ -0,0 +1,92 @@
+/*
+Deferred flash writes: an erase takes up to 400ms and a network callback that waits for it stalls
+the whole TCP stack, so uploads queue their blocks here and return. A low priority task writes one
+block per run, lwIP gets to acknowledge and receive in between. Completion callbacks run from
+that task only, never from within the writer's own call.
+*/
+
+#include <esp8266.h>
+#include "flashqueue.h"
+#include "otasession.h"
+
+#ifdef FLASH_QUEUE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define FLASH_QUEUE_PRIO  USER_TASK_PRIO_0
+
+typedef struct {
+  uint32 offset;
+  uint16 len;
+  FlashQueueCb cb;
+  void *arg;
+  uint8 data[OTA_BLOCK_SIZE];
+} FlashJob;
+
+static FlashJob jobs[FLASH_QUEUE_LEN];
+static uint8 head, count;
+static bool taskReady, posted;
+static os_event_t taskQueue[1];
+
+// Write the oldest block. The job is taken off the queue before its callback, which may queue
+// more into the slot it used.
+static void ICACHE_FLASH_ATTR runJob(void) {
+  FlashJob *job = &jobs[head];
+  const char *err = otaSessionWrite(job->offset, job->data, job->len);
+  if (err != NULL) DBG("Flash queue: block at 0x%x: %s\n", job->offset, err);
+  FlashQueueCb cb = job->cb;
+  void *arg = job->arg;
+  head = (head + 1) % FLASH_QUEUE_LEN;
+  count--;
+  if (cb != NULL) cb(arg, err);
+}
+
+static void ICACHE_FLASH_ATTR post(void) {
+  if (posted || count == 0) return;
+  posted = system_os_post(FLASH_QUEUE_PRIO, 0, 0);
+}
+
+static void ICACHE_FLASH_ATTR flashQueueTask(os_event_t *event) {
+  posted = false;
+  if (count > 0) runJob();
+  post();
+}
+
+const char* ICACHE_FLASH_ATTR flashQueueWrite(uint32 offset, const void *data, uint16 len,
+    FlashQueueCb cb, void *arg) {
+  if (len > OTA_BLOCK_SIZE) return "Block too large";
+  if (!taskReady) {
+    taskReady = system_os_task(flashQueueTask, FLASH_QUEUE_PRIO, taskQueue, 1);
+    if (!taskReady) return "No flash task";
+  }
+  // writers hold at FLASH_QUEUE_HIGH, one that gets here anyway has to try again later
+  if (count == FLASH_QUEUE_LEN) return "Flash busy";
+
+  FlashJob *job = &jobs[(head + count) % FLASH_QUEUE_LEN];
+  job->offset = offset;
+  job->len = len;
+  job->cb = cb;
+  job->arg = arg;
+  os_memcpy(job->data, data, len);
+  count++;
+  post();
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR flashQueueCancel(void *arg) {
+  uint8 kept = 0;
+  for (uint8 i = 0; i < count; i++) {
+    FlashJob *job = &jobs[(head + i) % FLASH_QUEUE_LEN];
+    if (job->arg == arg) continue;
+    if (i != kept) os_memcpy(&jobs[(head + kept) % FLASH_QUEUE_LEN], job, sizeof(FlashJob));
+    kept++;
+  }
+  if (kept != count) DBG("Flash queue: dropped %d blocks\n", count - kept);
+  count = kept;
+}
+
+int ICACHE_FLASH_ATTR flashQueuePending(void) {
+  return count;
+}
@@ -0,0 +1,27 @@
+#ifndef FLASHQUEUE_H
+#define FLASHQUEUE_H
+
+#include <esp8266.h>
+
+// Number of blocks that can wait for the flash, a sector's worth of upload
+#define FLASH_QUEUE_LEN   4
+// Writers stop receiving at the high mark and resume at the low mark. The high mark leaves room
+// for the data of a TCP segment that was already received.
+#define FLASH_QUEUE_HIGH  3
+#define FLASH_QUEUE_LOW   1
+
+// Called once a queued block is written, err is NULL on success
+typedef void (*FlashQueueCb)(void *arg, const char *err);
+
+// Queue a block of the current upload session for writing. The data is copied, so the caller's
+// buffer can be reused right away. The block is written by a low priority task after the
+// network callback returns, cb reports the outcome from that task. A full queue refuses the
+// block, writers that can't wait check flashQueuePending() against FLASH_QUEUE_LEN first.
+const char *flashQueueWrite(uint32 offset, const void *data, uint16 len, FlashQueueCb cb,
+    void *arg);
+// Drop the blocks queued with arg, their callbacks aren't called
+void flashQueueCancel(void *arg);
+// Number of blocks waiting for the flash
+int flashQueuePending(void);
+
+#endif // FLASHQUEUE_H
@@ -14,14 +14,34 @@
 #include "cgi.h"
 #include "cgiwifi.h"
 #include "cgiflash.h"
+#include "pullota.h"
+#include "partitions.h"
 #include "safeupgrade.h"
+#include "boottimeline.h"
+#include "announce.h"
+#include "mcastota.h"
+#ifdef TFTP_OTA
+#include "tftpota.h"
+#endif
+#ifdef BINARY_LOG
+#include "binlog.h"
+#endif
+#include "sectorhash.h"
+#include "serialota.h"
+#ifdef SERIAL_BRIDGE
+#include "serbridge.h"
+#endif
 #include "uart.h"
 #include "gpio.h"
 #include "stringdefs.h"
 
+#ifdef BINARY_LOG
+#define NOTICE(format, ...) LOG(format "\n", ## __VA_ARGS__)
+#else
 #define NOTICE(format, ...) do {	                                          \
 	os_printf(format "\n", ## __VA_ARGS__);                                   \
 } while ( 0 )
+#endif
 
 /*
 This is the main url->function dispatching data struct.
@@ -36,7 +56,24 @@ should be placed above the URLs they protect.
 HttpdBuiltInUrl builtInUrls[] = {
   { "/flash/next", cgiGetFirmwareNext, NULL },
   { "/flash/upload", cgiUploadFirmware, NULL },
+  { "/flash/status", cgiUploadStatus, NULL },
+  { "/flash/sectors", cgiSectorHashes, NULL },
+  { "/flash/stats", cgiUploadStats, NULL },
   { "/flash/reboot", cgiRebootFirmware, NULL },
+  { "/flash/bundle", cgiUploadBundle, NULL },
+  { "/flash/pull", cgiPullFirmware, NULL },
+  { "/flash/partitions", cgiPartitions, NULL },
+  { "/boot/health", cgiBootHealth, NULL },
+  { "/boot/timeline", cgiBootTimeline, NULL },
+  { "/data/upload", cgiUploadData, NULL },
+  { "/data/info", cgiDataInfo, NULL },
+  { "/data/image", cgiDataImage, NULL },
+#ifdef BINARY_LOG
+  { "/log", cgiLog, NULL },
+#endif
+#ifdef SERIAL_BRIDGE
+  { "/console/baud", cgiConsoleBaud, NULL },
+#endif
   { NULL, NULL, NULL }
 };
 
@@ -45,11 +82,39 @@ HttpdBuiltInUrl builtInUrls[] = {
 static const char* const esp_link_version = VERS_STR(VERSION);
 
 
+// Poll the wifi until it's up, it counts towards the boot health and the timeline
+#define WIFI_POLL_INTERVAL 20 // ms
+static ETSTimer wifiPollTimer;
+
+static void ICACHE_FLASH_ATTR wifiPollCb(void *arg) {
+  if (!wifiIsUp()) return;
+  os_timer_disarm(&wifiPollTimer);
+  bootTimelineMark(BOOT_PHASE_WIFI_UP);
+  bootHealthSignal(BOOT_SIGNAL_WIFI);
+  // the http listener is already up, tell flashing clients we're back
+  announceReady();
+  mcastOtaJoin();
+}
+
+static void ICACHE_FLASH_ATTR requestCb(HttpdConnData *connData, int code) {
+  if (code > 0 && code < 500) {
+    bootTimelineMark(BOOT_PHASE_FIRST_REQUEST);
+    bootHealthSignal(BOOT_SIGNAL_REQUEST);
+  }
+}
+
+static void ICACHE_FLASH_ATTR initDoneCb(void) {
+  bootTimelineMark(BOOT_PHASE_INIT_DONE);
+  wifiConnect();
+}
+
 void ICACHE_FLASH_ATTR user_rf_pre_init(void) {
+  bootTimelineMark(BOOT_PHASE_RF_PRE_INIT);
   /* undo upgrade, if the first boot failes
    * with an watchdog reset, soft watchdog reset or an exception
    */
   cgiFlashCheckUpgradeHealthy();
+  bootTimelineMark(BOOT_PHASE_HEALTH_CHECK);
 
   //default is enabled
   system_set_os_print(DEBUG_SDK);
@@ -57,19 +122,37 @@ void ICACHE_FLASH_ATTR user_rf_pre_init(void) {
 
 // Main routine to initialize esp-link.
 void ICACHE_FLASH_ATTR user_init(void) {
+  bootTimelineMark(BOOT_PHASE_USER_INIT);
+  system_init_done_cb(initDoneCb);
   // Init gpio pin registers
   gpio_init();
   gpio_output_set(0, 0, 0, (1<<15)); // some people tie it to GND, gotta ensure it's disabled
   // init UART
-  uart_init(115200);
+  uart_init(SERIAL_OTA_BAUD);
+  serialOtaInit();
+  bootTimelineMark(BOOT_PHASE_UART_INIT);
   // Say hello (leave some time to cause break in TX after boot loader's msg
   os_delay_us(10000L);
   NOTICE("\n\n** %s\n", esp_link_version);
   // Wifi
   wifiInit();
+  bootTimelineMark(BOOT_PHASE_WIFI_INIT);
+  os_timer_setfn(&wifiPollTimer, wifiPollCb, NULL);
+  os_timer_arm(&wifiPollTimer, WIFI_POLL_INTERVAL, true);
 
   // mount the http handlers
+  httpdSetRequestCb(requestCb);
   httpdInit(builtInUrls, 80);
+  bootTimelineMark(BOOT_PHASE_LISTENING);
+  bootHealthSignal(BOOT_SIGNAL_HTTPD);
+  announceInit();
+  mcastOtaInit();
+#ifdef TFTP_OTA
+  tftpOtaInit();
+#endif
+#ifdef SERIAL_BRIDGE
+  serialBridgeInit();
+#endif
 
   struct rst_info *rst_info = system_get_rst_info();
   NOTICE("Reset cause: %d=%s", rst_info->reason, rst_codes[rst_info->reason]);
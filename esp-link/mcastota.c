@@ -0,0 +1,232 @@
+/*
+Multicast OTA: one sender transmits an image once to all devices that need it, instead of one
+TCP stream per device. The sender offers the image, sends its blocks to the multicast group (or
+a broadcast address) and then polls. Each device writes the blocks it got through the flash
+queue into the same upload session an http upload uses, and answers a poll with the blocks it is
+still missing. The sender sends the union of the gaps again until every device has the image.
+A device that has it verifies the digest, answers done and reboots into it if the offer asked
+for that.
+
+Blocks that arrive while the flash queue is full are dropped, the next poll brings them again.
+*/
+
+#include <esp8266.h>
+#include "cgiflash.h"
+#include "flashqueue.h"
+#include "mcastota.h"
+#include "otasession.h"
+#include "partitions.h"
+
+#ifdef MCAST_OTA_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define MCAST_OTA_SPREAD    200   // ms, devices answer a poll after a random delay up to this
+#define MCAST_OTA_IDLE      30    // s without a packet before a transfer is given up
+#define MCAST_OTA_CHECK     5000  // ms between checks for an idle transfer
+
+static struct {
+  uint32 session;       // transfer we take part in, 0 if none
+  uint32 length;
+  uint8 image;
+  uint8 flags;
+  bool claimed;         // the image is claimed in the upload session
+  bool done;            // the image verified, or it was in the partition already
+  bool replying;        // an answer to a poll is scheduled
+  uint8 pending;        // blocks in the flash queue
+  const char *err;      // reported to the sender instead of the missing blocks
+  uint32 lastPacket;    // system_get_time() of the last packet of the transfer
+  uint8 senderIp[4];
+  int senderPort;
+} mcast;
+
+static struct espconn mcastConn;
+static esp_udp mcastUdp;
+static ETSTimer replyTimer, idleTimer;
+
+#define BIT_GET(map, i)   (((map)[(i)/32] >> ((i)%32)) & 1)
+
+// Image number of the partition we flash next, as in the packets
+static uint8 ICACHE_FLASH_ATTR nextImage(void) {
+  return partitionAppIndex(partitionNext()) + 1;
+}
+
+static void ICACHE_FLASH_ATTR mcastRelease(void) {
+  if (mcast.pending > 0) flashQueueCancel(&mcast);
+  if (mcast.claimed) otaSessionRelease(0, mcast.length);
+  os_timer_disarm(&replyTimer);
+  os_timer_disarm(&idleTimer);
+  os_memset(&mcast, 0, sizeof(mcast));
+}
+
+static void ICACHE_FLASH_ATTR mcastIdleCb(void *arg) {
+  if (system_get_time() - mcast.lastPacket < MCAST_OTA_IDLE*1000000UL) return;
+  DBG("Mcast OTA: transfer %08x idle, giving up\n", mcast.session);
+  mcastRelease();
+}
+
+static void ICACHE_FLASH_ATTR mcastOffer(const McastOtaHeader *h, const McastOtaOffer *o) {
+  if (h->session == mcast.session) return; // offers are repeated
+  mcastRelease();
+  mcast.session = h->session;
+  mcast.image = h->image;
+  mcast.flags = o->flags;
+  mcast.length = h->offset;
+  mcast.lastPacket = system_get_time();
+  os_timer_arm(&idleTimer, MCAST_OTA_CHECK, true);
+
+  // nothing to write if the partition holds the image already
+  const Partition *next = partitionNext();
+  if (next != NULL && next->state != PART_STATE_WRITING &&
+      os_memcmp(next->digest, o->digest, OTA_DIGEST_LEN) == 0) {
+    DBG("Mcast OTA: transfer %08x, image there already\n", mcast.session);
+    mcast.done = true;
+    return;
+  }
+
+  bool resumed;
+  mcast.err = otaSessionBegin(getNextSPIFlashAddr(), getNextFirmwareMaxSize(), o->digest,
+      mcast.length, &resumed);
+  if (mcast.err == NULL && !otaSessionClaim(0, mcast.length)) mcast.err = "Upload in progress";
+  mcast.claimed = mcast.err == NULL;
+  DBG("Mcast OTA: transfer %08x of %d bytes %s\n", mcast.session, mcast.length,
+      mcast.err != NULL ? mcast.err : resumed ? "resumed" : "started");
+}
+
+// A block of the transfer has been written by the flash queue
+static void ICACHE_FLASH_ATTR mcastWritten(void *arg, const char *err) {
+  mcast.pending--;
+  if (err != NULL && mcast.err == NULL) mcast.err = err;
+}
+
+static void ICACHE_FLASH_ATTR mcastData(const McastOtaHeader *h, const uint8 *data) {
+  if (mcast.done || mcast.err != NULL || !mcast.claimed) return;
+  if (h->offset % OTA_BLOCK_SIZE != 0 || h->count > OTA_BLOCK_SIZE ||
+      h->offset + h->count > mcast.length) return;
+  const OtaSession *s = otaSessionGet();
+  if (s == NULL || BIT_GET(s->done, h->offset / OTA_BLOCK_SIZE)) return;
+  // the flash is behind, the block comes again after the next poll
+  if (flashQueuePending() >= FLASH_QUEUE_LEN) return;
+  mcast.pending++;
+  if (flashQueueWrite(h->offset, data, h->count, mcastWritten, &mcast) != NULL) mcast.pending--;
+}
+
+// Answer a poll: done with the result, or the ranges of blocks that are still missing
+static void ICACHE_FLASH_ATTR mcastReplyCb(void *arg) {
+  // the blocks in the queue aren't missing, they just aren't written yet
+  if (mcast.pending > 0) {
+    os_timer_arm(&replyTimer, 20, false);
+    return;
+  }
+  mcast.replying = false;
+
+  if (!mcast.done && mcast.err == NULL && otaSessionComplete()) {
+    // a digest mismatch throws the blocks away, they are all reported missing below
+    const char *err = otaSessionFinish();
+    if (err == NULL) {
+      DBG("Mcast OTA: transfer %08x complete\n", mcast.session);
+      otaSessionRelease(0, mcast.length);
+      mcast.claimed = false;
+      mcast.done = true;
+    } else {
+      DBG("Mcast OTA: %s\n", err);
+    }
+  }
+  if (mcast.done && mcast.err == NULL && (mcast.flags & MCAST_OTA_REBOOT)) {
+    mcast.err = flashRebootIntoNext();
+    mcast.flags &= ~MCAST_OTA_REBOOT;
+  }
+
+  char buf[sizeof(McastOtaHeader) + sizeof(McastOtaDevice) +
+      MCAST_OTA_NACK_RANGES*sizeof(McastOtaRange)];
+  McastOtaHeader *h = (McastOtaHeader *)buf;
+  McastOtaDevice *dev = (McastOtaDevice *)(h + 1);
+  os_memset(buf, 0, sizeof(McastOtaHeader) + sizeof(McastOtaDevice));
+  h->magic = MCAST_OTA_MAGIC;
+  h->image = mcast.image;
+  h->session = mcast.session;
+  wifi_get_macaddr(STATION_IF, dev->id);
+  int len = sizeof(McastOtaHeader) + sizeof(McastOtaDevice);
+
+  if (mcast.done || mcast.err != NULL) {
+    h->type = MCAST_OTA_DONE;
+    if (mcast.err != NULL) {
+      h->count = 1;
+      os_strcpy(buf + len, mcast.err);
+      len += os_strlen(mcast.err) + 1;
+    }
+  } else {
+    h->type = MCAST_OTA_NACK;
+    McastOtaRange *r = (McastOtaRange *)(dev + 1);
+    uint32 start = 0, end;
+    while (h->count < MCAST_OTA_NACK_RANGES && otaSessionNextMissing(&start, &end)) {
+      r[h->count].first = start / OTA_BLOCK_SIZE;
+      r[h->count].count = (end - start + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+      h->count++;
+      start = end;
+    }
+    len += h->count*sizeof(McastOtaRange);
+  }
+
+  mcastUdp.remote_port = mcast.senderPort;
+  os_memcpy(mcastUdp.remote_ip, mcast.senderIp, 4);
+  if (espconn_sendto(&mcastConn, (uint8 *)buf, len) != ESPCONN_OK) DBG("Mcast OTA: send failed\n");
+}
+
+static void ICACHE_FLASH_ATTR mcastPoll(void) {
+  remot_info *remote = NULL;
+  if (mcast.replying) return;
+  if (espconn_get_connection_info(&mcastConn, &remote, 0) != ESPCONN_OK) return;
+  os_memcpy(mcast.senderIp, remote->remote_ip, 4);
+  mcast.senderPort = remote->remote_port;
+  // spread the answers of many devices over time, they share the air
+  mcast.replying = true;
+  os_timer_arm(&replyTimer, os_random() % MCAST_OTA_SPREAD + 1, false);
+}
+
+static void ICACHE_FLASH_ATTR mcastRecvCb(void *arg, char *data, unsigned short len) {
+  McastOtaHeader h;
+  if (len < sizeof(h)) return;
+  os_memcpy(&h, data, sizeof(h));
+  if (h.magic != MCAST_OTA_MAGIC || h.image != nextImage() || h.session == 0) return;
+
+  if (h.type == MCAST_OTA_OFFER && len >= sizeof(h) + sizeof(McastOtaOffer)) {
+    McastOtaOffer o;
+    os_memcpy(&o, data + sizeof(h), sizeof(o));
+    mcastOffer(&h, &o);
+    return;
+  }
+  if (h.session != mcast.session) return;
+  mcast.lastPacket = system_get_time();
+  if (h.type == MCAST_OTA_DATA && len >= sizeof(h) + h.count) mcastData(&h, (uint8 *)data + sizeof(h));
+  else if (h.type == MCAST_OTA_POLL) mcastPoll();
+}
+
+// Listen for multicast OTA on the broadcast address, mcastOtaJoin adds the group
+void ICACHE_FLASH_ATTR mcastOtaInit(void) {
+  os_timer_setfn(&replyTimer, mcastReplyCb, NULL);
+  os_timer_setfn(&idleTimer, mcastIdleCb, NULL);
+  mcastConn.type = ESPCONN_UDP;
+  mcastConn.proto.udp = &mcastUdp;
+  mcastUdp.local_port = MCAST_OTA_PORT;
+  espconn_regist_recvcb(&mcastConn, mcastRecvCb);
+  if (espconn_create(&mcastConn) != ESPCONN_OK) {
+    DBG("Mcast OTA: cannot create connection\n");
+    mcastConn.type = ESPCONN_INVALID;
+  }
+}
+
+// Join the multicast group on the interfaces that have an address, the wifi must be up
+void ICACHE_FLASH_ATTR mcastOtaJoin(void) {
+  static const uint8 group[4] = MCAST_OTA_GROUP;
+  if (mcastConn.type == ESPCONN_INVALID) return;
+  ip_addr_t groupIp;
+  os_memcpy(&groupIp.addr, group, 4);
+  for (uint8 i = STATION_IF; i <= SOFTAP_IF; i++) {
+    struct ip_info info;
+    if (!wifi_get_ip_info(i, &info) || info.ip.addr == 0) continue;
+    if (espconn_igmp_join(&info.ip, &groupIp) != ESPCONN_OK) DBG("Mcast OTA: join failed\n");
+  }
+}
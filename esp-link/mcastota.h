@@ -0,0 +1,55 @@
+#ifndef MCASTOTA_H
+#define MCASTOTA_H
+
+#include <esp8266.h>
+
+// UDP port and group of multicast OTA. A sender may also use a broadcast address instead of the
+// group, the device listens to both.
+#define MCAST_OTA_PORT      8268
+#define MCAST_OTA_GROUP     { 239, 255, 82, 68 }
+#define MCAST_OTA_MAGIC     0x41544f4d // "MOTA"
+
+// Sender to devices
+#define MCAST_OTA_OFFER     1   // an image follows, payload is McastOtaOffer
+#define MCAST_OTA_DATA      2   // a block of the image at offset, count bytes
+#define MCAST_OTA_POLL      3   // report what is missing
+// Devices to the sender, unicast
+#define MCAST_OTA_NACK      4   // blocks missing, count McastOtaRange after the device id
+#define MCAST_OTA_DONE      5   // image complete, count is 0 if it verified, else an error follows
+
+#define MCAST_OTA_REBOOT    0x01 // offer flag: boot the image once it verified
+
+// Largest number of ranges in a NACK, further gaps are reported in the next round
+#define MCAST_OTA_NACK_RANGES  64
+
+// All fields little endian, like the esp8266
+typedef struct {
+  uint32 magic;
+  uint8  type;
+  uint8  image;     // 1 for user1.bin, 2 for user2.bin
+  uint16 count;     // bytes of data, number of ranges or the result
+  uint32 session;   // picked by the sender for each transfer
+  uint32 offset;    // image offset of a block, or the length of the image in an offer
+} McastOtaHeader;
+
+typedef struct {
+  uint8  digest[16];
+  uint8  flags;
+  uint8  reserved[3];
+} McastOtaOffer;
+
+// Start of the payload of a NACK or DONE
+typedef struct {
+  uint8  id[6];     // station MAC, as in the readiness announcement
+  uint8  reserved[2];
+} McastOtaDevice;
+
+typedef struct {
+  uint16 first;     // block number
+  uint16 count;
+} McastOtaRange;
+
+void mcastOtaInit(void);
+void mcastOtaJoin(void);
+
+#endif // MCASTOTA_H
@@ -0,0 +1,367 @@
+/*
+Upload sessions: track which blocks of an image made it into the flash, so that an interrupted
+upload can be resumed instead of restarted from the beginning.
+*/
+
+#include <esp8266.h>
+#include "otasession.h"
+#include "partitions.h"
+#include "sectorhash.h"
+
+#ifdef OTA_SESSION_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define OTA_SESSION_MAGIC   0x5345534F // "OSES"
+#define OTA_MAX_SECTORS     (OTA_MAX_BLOCKS*OTA_BLOCK_SIZE/SPI_FLASH_SEC_SIZE)
+#define BLOCKS_PER_SECTOR   (SPI_FLASH_SEC_SIZE/OTA_BLOCK_SIZE)
+
+static OtaSession session;
+RTC_MEM_FITS(RTC_MEM_OTA_SESSION, sizeof(OtaSession), RTC_MEM_WIFI_CACHE);
+static bool sessionLoaded;
+// sectors that have been erased since boot, this is not persisted: after a reboot a sector is
+// only known to be erased if some of its blocks are done
+static uint32 erased[OTA_MAX_SECTORS/32];
+// byte ranges currently being written, end is exclusive and 0 marks a free slot
+static struct { uint32 start, end; } claims[OTA_MAX_CLAIMS];
+// timing of the current session and the few before it, kept in RAM only
+static OtaStats stats[OTA_STATS_HISTORY];
+static int statsCur;
+
+#define BIT_GET(map, i)   (((map)[(i)/32] >> ((i)%32)) & 1)
+#define BIT_SET(map, i)   ((map)[(i)/32] |= 1UL << ((i)%32))
+#define BIT_CLR(map, i)   ((map)[(i)/32] &= ~(1UL << ((i)%32)))
+
+static uint32 ICACHE_FLASH_ATTR sessionChecksum(void) {
+  uint32 *w = (uint32 *)&session;
+  uint32 sum = 0;
+  for (int i = 0; i < offsetof(OtaSession, checksum)/4; i++) sum = (sum << 1 | sum >> 31) ^ w[i];
+  return sum;
+}
+
+static void ICACHE_FLASH_ATTR sessionSave(void) {
+  session.checksum = sessionChecksum();
+  system_rtc_mem_write(RTC_MEM_OTA_SESSION, &session, sizeof(session));
+}
+
+static uint32 ICACHE_FLASH_ATTR sessionBlocks(void) {
+  return (session.length + OTA_BLOCK_SIZE - 1) / OTA_BLOCK_SIZE;
+}
+
+// Load the session from RTC memory the first time it is needed after a boot. A reboot may have
+// interrupted a flash write, so blocks of partially written sectors are dropped: the sector gets
+// erased and rewritten from scratch when the upload is resumed.
+static void ICACHE_FLASH_ATTR sessionLoad(void) {
+  if (sessionLoaded) return;
+  sessionLoaded = true;
+  os_memset(erased, 0, sizeof(erased));
+
+  system_rtc_mem_read(RTC_MEM_OTA_SESSION, &session, sizeof(session));
+  if (session.magic != OTA_SESSION_MAGIC || session.checksum != sessionChecksum() ||
+      session.length > OTA_MAX_BLOCKS*OTA_BLOCK_SIZE) {
+    os_memset(&session, 0, sizeof(session));
+    return;
+  }
+
+  uint32 blocks = sessionBlocks();
+  for (uint32 b = 0; b < blocks; b += BLOCKS_PER_SECTOR) {
+    uint32 n = 0, e = b + BLOCKS_PER_SECTOR > blocks ? blocks : b + BLOCKS_PER_SECTOR;
+    for (uint32 i = b; i < e; i++) n += BIT_GET(session.done, i);
+    if (n == e - b) continue;
+    for (uint32 i = b; i < e; i++) BIT_CLR(session.done, i);
+  }
+  sessionSave();
+  DBG("OTA session for 0x%05x, %d bytes missing\n", session.address, otaSessionMissingBytes());
+}
+
+static bool ICACHE_FLASH_ATTR digestIsSet(const uint8 *digest) {
+  for (int i = 0; i < OTA_DIGEST_LEN; i++) if (digest[i] != 0) return true;
+  return false;
+}
+
+// Start a new session or resume the current one if it is for the same image and flash address.
+// Anonymous sessions (no digest) cannot be resumed.
+const char* ICACHE_FLASH_ATTR otaSessionBegin(uint32 address, uint32 maxLen, const uint8 *digest,
+    uint32 length, bool *resumed) {
+  if (length > maxLen || length > OTA_MAX_BLOCKS*OTA_BLOCK_SIZE) return "Firmware image too large";
+  if (address % SPI_FLASH_SEC_SIZE != 0) return "Unaligned flash address";
+  sessionLoad();
+
+  if (digest != NULL && session.magic == OTA_SESSION_MAGIC && session.address == address &&
+      session.length == length && os_memcmp(session.digest, digest, OTA_DIGEST_LEN) == 0) {
+    DBG("OTA session resumed, %d bytes missing\n", otaSessionMissingBytes());
+    if (resumed != NULL) *resumed = true;
+    return NULL;
+  }
+
+  for (int i = 0; i < OTA_MAX_CLAIMS; i++) {
+    if (claims[i].end != 0) return "Upload in progress";
+  }
+  os_memset(&session, 0, sizeof(session));
+  os_memset(erased, 0, sizeof(erased));
+  session.magic = OTA_SESSION_MAGIC;
+  session.address = address;
+  session.length = length;
+  if (digest != NULL) os_memcpy(session.digest, digest, OTA_DIGEST_LEN);
+  sessionSave();
+  // the partition's old image is about to be overwritten, it's not bootable from here on
+  const char *err = partitionImageWriting(address);
+  if (err != NULL) DBG("Partition table: %s\n", err);
+
+  if (stats[statsCur].blocks != 0) statsCur = (statsCur + 1) % OTA_STATS_HISTORY;
+  os_memset(&stats[statsCur], 0, sizeof(OtaStats));
+  stats[statsCur].start = system_get_time();
+  DBG("OTA session started for %d bytes at 0x%05x\n", length, address);
+  if (resumed != NULL) *resumed = false;
+  return NULL;
+}
+
+// Write one block of the image. Blocks that are already done are skipped, the flash sector is
+// erased the first time one of its blocks gets written.
+const char* ICACHE_FLASH_ATTR otaSessionWrite(uint32 offset, const void *data, uint16 len) {
+  sessionLoad();
+  if (session.magic != OTA_SESSION_MAGIC) return "No upload session";
+  if (offset % OTA_BLOCK_SIZE != 0 || offset + len > session.length ||
+      (len != OTA_BLOCK_SIZE && offset + len != session.length)) return "Buffering problem";
+
+  uint32 block = offset / OTA_BLOCK_SIZE;
+  if (BIT_GET(session.done, block)) return NULL;
+
+  OtaStats *st = &stats[statsCur];
+  uint32 address = session.address + offset;
+  uint32 sector = offset / SPI_FLASH_SEC_SIZE;
+  sectorHashInvalidate(address);
+  if (!BIT_GET(erased, sector)) {
+    bool partial = false;
+    uint32 first = sector * BLOCKS_PER_SECTOR;
+    for (uint32 i = first; i < first + BLOCKS_PER_SECTOR && i < OTA_MAX_BLOCKS; i++)
+      partial |= BIT_GET(session.done, i);
+    if (!partial) {
+      DBG("Erasing 0x%05x\n", address & ~(SPI_FLASH_SEC_SIZE - 1));
+      uint32 t0 = system_get_time();
+      if (spi_flash_erase_sector(address / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+        return "Flash erase failed";
+      uint32 dt = system_get_time() - t0;
+      st->erases++;
+      st->eraseTime += dt;
+      if (dt > st->eraseMax) st->eraseMax = dt;
+    }
+    BIT_SET(erased, sector);
+  }
+
+  uint32 t0 = system_get_time();
+  if (spi_flash_write(address, (uint32 *)data, len) != SPI_FLASH_RESULT_OK)
+    return "Flash write failed";
+  uint32 dt = system_get_time() - t0;
+  st->blocks++;
+  st->bytes += len;
+  st->writeTime += dt;
+  if (dt > st->writeMax) st->writeMax = dt;
+
+  BIT_SET(session.done, block);
+  session.flags &= ~OTA_SESSION_VERIFIED;
+  sessionSave();
+  return NULL;
+}
+
+// Take a sector of the image as being in the flash already, e.g. because a client found its hash
+// to match. Only sessions with a digest can do this: the digest check at the end catches a sector
+// that isn't what the client thought. Sectors this session erased are left missing.
+const char* ICACHE_FLASH_ATTR otaSessionKeep(uint32 offset) {
+  sessionLoad();
+  if (session.magic != OTA_SESSION_MAGIC) return "No upload session";
+  if (!digestIsSet(session.digest)) return "Sector map requires digest";
+  if (offset % SPI_FLASH_SEC_SIZE != 0 || offset >= session.length) return "Invalid sector map";
+
+  uint32 sector = offset / SPI_FLASH_SEC_SIZE;
+  if (BIT_GET(erased, sector)) return NULL;
+  uint32 first = sector * BLOCKS_PER_SECTOR, blocks = sessionBlocks();
+  for (uint32 i = first; i < first + BLOCKS_PER_SECTOR && i < blocks; i++) {
+    if (BIT_GET(session.done, i)) continue;
+    BIT_SET(session.done, i);
+    stats[statsCur].kept += i == blocks - 1 ? session.length - i*OTA_BLOCK_SIZE : OTA_BLOCK_SIZE;
+  }
+  session.flags &= ~OTA_SESSION_VERIFIED;
+  sessionSave();
+  return NULL;
+}
+
+// Shorten an anonymous session to the length of the image, for writers that learn it only at the
+// end (a TFTP transfer without tsize). The blocks from the new last one on must not have been
+// written yet.
+const char* ICACHE_FLASH_ATTR otaSessionTruncate(uint32 length) {
+  sessionLoad();
+  if (session.magic != OTA_SESSION_MAGIC) return "No upload session";
+  if (digestIsSet(session.digest) || length == 0 || length > session.length) return "Invalid length";
+  uint32 blocks = sessionBlocks();
+  for (uint32 i = length / OTA_BLOCK_SIZE; i < blocks; i++) {
+    if (BIT_GET(session.done, i)) return "Invalid length";
+  }
+  session.length = length;
+  sessionSave();
+  return NULL;
+}
+
+bool ICACHE_FLASH_ATTR otaSessionComplete(void) {
+  sessionLoad();
+  if (session.magic != OTA_SESSION_MAGIC) return false;
+  uint32 blocks = sessionBlocks();
+  for (uint32 i = 0; i < blocks; i++) if (!BIT_GET(session.done, i)) return false;
+  return true;
+}
+
+// Claim a byte range of the image for one writer, so that concurrent writers (e.g. parallel
+// range uploads) own disjoint pieces. Fails if the range overlaps one that is being written.
+bool ICACHE_FLASH_ATTR otaSessionClaim(uint32 start, uint32 end) {
+  int free = -1;
+  for (int i = 0; i < OTA_MAX_CLAIMS; i++) {
+    if (claims[i].end == 0) {
+      if (free < 0) free = i;
+    } else if (start < claims[i].end && claims[i].start < end) {
+      DBG("OTA range %d-%d overlaps %d-%d\n", start, end, claims[i].start, claims[i].end);
+      return false;
+    }
+  }
+  if (free < 0 || end <= start) return false;
+  claims[free].start = start;
+  claims[free].end = end;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR otaSessionRelease(uint32 start, uint32 end) {
+  for (int i = 0; i < OTA_MAX_CLAIMS; i++) {
+    if (claims[i].start == start && claims[i].end == end) {
+      claims[i].end = 0;
+      return;
+    }
+  }
+}
+
+// Whether there is an unfinished session that writes into the flash at address
+bool ICACHE_FLASH_ATTR otaSessionIncomplete(uint32 address) {
+  sessionLoad();
+  return session.magic == OTA_SESSION_MAGIC && session.address == address &&
+    !otaSessionComplete();
+}
+
+// Compute the MD5 digest of a region of the flash
+void ICACHE_FLASH_ATTR otaFlashDigest(uint32 address, uint32 length, uint8 *digest) {
+  md5_context_t ctx;
+  uint32 buf[64];
+  MD5Init(&ctx);
+  for (uint32 off = 0; off < length; off += sizeof(buf)) {
+    uint32 n = length - off < sizeof(buf) ? length - off : sizeof(buf);
+    spi_flash_read(address + off, buf, sizeof(buf));
+    MD5Update(&ctx, (uint8 *)buf, n);
+    if (off % SPI_FLASH_SEC_SIZE == 0) system_soft_wdt_feed();
+  }
+  MD5Final(digest, &ctx);
+}
+
+// Check that all blocks are there and, if the session has a digest, that the flash content
+// matches it. A digest mismatch throws the session away since there is no telling which of the
+// blocks is bad.
+const char* ICACHE_FLASH_ATTR otaSessionFinish(void) {
+  if (!otaSessionComplete()) return "Image incomplete";
+  if (session.flags & OTA_SESSION_VERIFIED) return NULL;
+
+  OtaStats *st = &stats[statsCur];
+  if (digestIsSet(session.digest)) {
+    uint8 digest[OTA_DIGEST_LEN];
+    uint32 t0 = system_get_time();
+    otaFlashDigest(session.address, session.length, digest);
+    st->verifyTime = system_get_time() - t0;
+
+    if (os_memcmp(digest, session.digest, OTA_DIGEST_LEN) != 0) {
+      DBG("OTA session digest mismatch\n");
+      os_memset(session.done, 0, sizeof(session.done));
+      os_memset(erased, 0, sizeof(erased));
+      sessionSave();
+      return "Digest mismatch";
+    }
+    session.flags |= OTA_SESSION_VERIFIED;
+    sessionSave();
+  }
+  if (st->elapsed == 0) st->elapsed = system_get_time() - st->start;
+  const char *err = partitionImageWritten(session.address,
+      digestIsSet(session.digest) ? session.digest : NULL);
+  if (err != NULL) DBG("Partition table: %s\n", err);
+  return NULL;
+}
+
+// Account time a writer spent waiting for data to arrive
+void ICACHE_FLASH_ATTR otaStatsNetWait(uint32 us) {
+  OtaStats *st = &stats[statsCur];
+  st->netTime += us;
+  if (us > st->netMax) st->netMax = us;
+}
+
+// Stats of the current session (age 0) or of earlier ones, NULL if there is no such session
+const OtaStats* ICACHE_FLASH_ATTR otaStatsGet(int age) {
+  if (age < 0 || age >= OTA_STATS_HISTORY) return NULL;
+  const OtaStats *st = &stats[(statsCur + OTA_STATS_HISTORY - age) % OTA_STATS_HISTORY];
+  return st->start != 0 ? st : NULL;
+}
+
+// Format stats as a JSON object with times in milliseconds (totals) and microseconds (per block
+// maxima), buf must hold 320 chars
+int ICACHE_FLASH_ATTR otaStatsFormat(const OtaStats *st, char *buf) {
+  return os_sprintf(buf, "{\"bytes\":%d,\"kept\":%d,\"blocks\":%d,\"erases\":%d,\"elapsed_ms\":%d,"
+      "\"net_ms\":%d,\"net_max_us\":%d,\"erase_ms\":%d,\"erase_max_us\":%d,"
+      "\"write_ms\":%d,\"write_max_us\":%d,\"verify_ms\":%d}",
+      st->bytes, st->kept, st->blocks, st->erases, st->elapsed/1000, st->netTime/1000, st->netMax,
+      st->eraseTime/1000, st->eraseMax, st->writeTime/1000, st->writeMax, st->verifyTime/1000);
+}
+
+// Find the next range of missing bytes at or after *start, end is exclusive
+bool ICACHE_FLASH_ATTR otaSessionNextMissing(uint32 *start, uint32 *end) {
+  sessionLoad();
+  if (session.magic != OTA_SESSION_MAGIC || *start >= session.length) return false;
+  uint32 blocks = sessionBlocks();
+  uint32 b = *start / OTA_BLOCK_SIZE;
+  while (b < blocks && BIT_GET(session.done, b)) b++;
+  if (b >= blocks) return false;
+  uint32 e = b;
+  while (e < blocks && !BIT_GET(session.done, e)) e++;
+  *start = b * OTA_BLOCK_SIZE;
+  *end = e == blocks ? session.length : e * OTA_BLOCK_SIZE;
+  return true;
+}
+
+uint32 ICACHE_FLASH_ATTR otaSessionMissingBytes(void) {
+  uint32 start = 0, end, missing = 0;
+  while (otaSessionNextMissing(&start, &end)) {
+    missing += end - start;
+    start = end;
+  }
+  return missing;
+}
+
+const OtaSession* ICACHE_FLASH_ATTR otaSessionGet(void) {
+  sessionLoad();
+  return session.magic == OTA_SESSION_MAGIC ? &session : NULL;
+}
+
+static int ICACHE_FLASH_ATTR hexVal(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Parse a hex MD5 digest, returns false if it is malformed
+bool ICACHE_FLASH_ATTR otaParseDigest(const char *hex, uint8 *digest) {
+  for (int i = 0; i < OTA_DIGEST_LEN; i++) {
+    int h = hexVal(hex[2*i]), l = h < 0 ? -1 : hexVal(hex[2*i+1]);
+    if (l < 0) return false;
+    digest[i] = h << 4 | l;
+  }
+  return hex[OTA_DIGEST_HEX_LEN] == 0 || hex[OTA_DIGEST_HEX_LEN] == '"';
+}
+
+// Format a digest as hex, hex must hold OTA_DIGEST_HEX_LEN+1 chars
+void ICACHE_FLASH_ATTR otaFormatDigest(const uint8 *digest, char *hex) {
+  for (int i = 0; i < OTA_DIGEST_LEN; i++) os_sprintf(hex + 2*i, "%02x", digest[i]);
+}
@@ -0,0 +1,69 @@
+#ifndef OTASESSION_H
+#define OTASESSION_H
+
+#include <esp8266.h>
+
+// An image is written in blocks of this size, it matches the httpd POST buffer
+#define OTA_BLOCK_SIZE      1024
+// Largest image a session can track (1MB), one completion bit per block
+#define OTA_MAX_BLOCKS      1024
+#define OTA_DIGEST_LEN      16
+#define OTA_DIGEST_HEX_LEN  (2*OTA_DIGEST_LEN)
+// Number of byte ranges that can be written concurrently, e.g. by parallel uploads
+#define OTA_MAX_CLAIMS      6
+
+#define OTA_SESSION_VERIFIED  0x01 // the digest of the whole image has been checked
+
+// An upload session describes one image that is being written into a flash region. The
+// session is identified by the MD5 digest of the image and is kept in RTC memory, so that an
+// interrupted upload can be resumed with the blocks that are still missing.
+typedef struct {
+  uint32 magic;
+  uint32 address;                   // flash address the image is written to
+  uint32 length;                    // total length of the image in bytes
+  uint32 flags;
+  uint8  digest[OTA_DIGEST_LEN];    // MD5 of the image, all zero for anonymous sessions
+  uint32 done[OTA_MAX_BLOCKS/32];   // one bit per block that made it into the flash
+  uint32 checksum;
+} OtaSession;
+
+// Where the time of an upload goes, all times in microseconds. Network wait is the time a writer
+// spent waiting for the next block to arrive, summed over all writers.
+typedef struct {
+  uint32 start;                   // system_get_time() when the session started
+  uint32 elapsed;                 // wall time until the session finished
+  uint32 bytes, blocks, erases;
+  uint32 kept;                    // bytes that were in the flash already, see otaSessionKeep
+  uint32 netTime, netMax;
+  uint32 eraseTime, eraseMax;
+  uint32 writeTime, writeMax;
+  uint32 verifyTime;
+} OtaStats;
+
+// Number of sessions whose stats are kept, including the current one
+#define OTA_STATS_HISTORY   4
+
+const char *otaSessionBegin(uint32 address, uint32 maxLen, const uint8 *digest, uint32 length,
+    bool *resumed);
+const char *otaSessionWrite(uint32 offset, const void *data, uint16 len);
+const char *otaSessionKeep(uint32 offset);
+const char *otaSessionTruncate(uint32 length);
+const char *otaSessionFinish(void);
+bool otaSessionClaim(uint32 start, uint32 end);
+void otaSessionRelease(uint32 start, uint32 end);
+bool otaSessionComplete(void);
+bool otaSessionIncomplete(uint32 address);
+bool otaSessionNextMissing(uint32 *start, uint32 *end);
+uint32 otaSessionMissingBytes(void);
+const OtaSession *otaSessionGet(void);
+
+void otaFlashDigest(uint32 address, uint32 length, uint8 *digest);
+
+void otaStatsNetWait(uint32 us);
+const OtaStats *otaStatsGet(int age);
+int otaStatsFormat(const OtaStats *stats, char *buf);
+
+bool otaParseDigest(const char *hex, uint8 *digest);
+void otaFormatDigest(const uint8 *digest, char *hex);
+
+#endif // OTASESSION_H
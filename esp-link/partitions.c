@@ -0,0 +1,375 @@
+/*
+Partition table: where the firmware slots and the data region live, and what is known about the
+images in them. With 2MB of flash or more the table is kept in a sector of its own in front of
+the SDK parameters, so the layout can change without a rebuild. Smaller flash has no room for
+it and uses the layout the firmware was built for, kept in RAM.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "partitions.h"
+#include "dataregion.h"
+
+#ifdef PARTITIONS_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define SPI_FLASH_MEM_EMU_START_ADDR    0x40200000
+#define USER1_BIN_SPI_FLASH_ADDR        (4*1024)                                      // either start after 4KB boot partition
+
+#ifdef USER2_BIN_SPI_FLASH_ADDR
+/* an unsymetric partition table is used */
+#define FIRMWARE_SIZE_PARTITION1        (USER2_BIN_SPI_FLASH_ADDR - USER1_BIN_SPI_FLASH_ADDR)
+#else
+#define USER2_BIN_SPI_FLASH_ADDR        (4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024)   // 4KB boot, fw1, 16KB user param, 4KB reserved
+#define FIRMWARE_SIZE_PARTITION1        FIRMWARE_SIZE
+#endif
+
+#define PART_TABLE_MAGIC    0x54504557 // "WEPT"
+// the table is rewritten into the next free slot of its sector, the sector only gets erased
+// when all slots are used
+#define PART_TABLE_SLOT     160
+#define PART_TABLE_SLOTS    (SPI_FLASH_SEC_SIZE / PART_TABLE_SLOT)
+
+typedef struct {
+  uint32 magic;
+  uint32 seq;                 // the valid copy with the highest sequence number is current
+  uint8  count;
+  uint8  reserved[3];
+  uint32 uploads;             // number of images written, for the image version
+  Partition parts[PART_MAX];
+  uint32 checksum;
+} PartitionTable;
+
+static PartitionTable table;
+static bool tableLoaded;
+static int tableSlot = -1;    // slot of the current copy on flash, -1 if there is none
+static const Partition *running;
+
+extern uint32 _irom0_text_start;
+
+static void tableLoad(void);
+
+// Size of the flash in bytes that is there and that the SDK lets us address. The map comes from
+// the image header and may claim more than the chip has, the 2MB build declares a 4MB map, and
+// past its end the chip wraps around onto its start. The JEDEC id has the chip's size as the
+// log2 of the bytes in its top byte.
+uint32 ICACHE_FLASH_ATTR flashSize(void) {
+  static const uint8 mbits[] = { 4, 2, 8, 16, 32, 16, 32 };
+  static uint32 size;
+  if (size != 0) return size;
+  enum flash_size_map map = system_get_flash_size_map();
+  size = map < sizeof(mbits) ? mbits[map] * 128 * 1024 : 512 * 1024;
+  uint8 capacity = spi_flash_get_id() >> 16;
+  if (capacity >= 19 && capacity <= 24 && (1UL << capacity) < size) size = 1UL << capacity;
+  DBG("Flash size %dKB\n", size / 1024);
+  return size;
+}
+
+// Address of the partition table sector, 0 if the flash has no room for it
+static uint32 ICACHE_FLASH_ATTR tableAddr(void) {
+  return flashSize() >= 2*1024*1024 ? flashSize() - 5*SPI_FLASH_SEC_SIZE : 0;
+}
+
+// Address of the boot journal's sectors in front of the partition table, 0 if the flash has no
+// room for them or a partition laid out before they were moved there reaches into them
+uint32 ICACHE_FLASH_ATTR flashJournalAddr(void) {
+  if (tableAddr() == 0) return 0;
+  uint32 addr = tableAddr() - BOOT_JOURNAL_SECTORS*SPI_FLASH_SEC_SIZE;
+  tableLoad();
+  for (int i = 0; i < table.count; i++) {
+    if (table.parts[i].address + table.parts[i].size > addr) return 0;
+  }
+  return addr;
+}
+
+// Start of the area at the end of the flash that belongs to the boot journal, the partition
+// table and the SDK
+uint32 ICACHE_FLASH_ATTR flashReservedStart(void) {
+  if (tableAddr() == 0) return flashSize() - 4*SPI_FLASH_SEC_SIZE;
+  return flashJournalAddr() != 0 ? flashJournalAddr() : tableAddr();
+}
+
+static uint32 ICACHE_FLASH_ATTR tableChecksum(const PartitionTable *t) {
+  const uint32 *w = (const uint32 *)t;
+  uint32 sum = 0;
+  for (int i = 0; i < offsetof(PartitionTable, checksum)/4; i++) sum = (sum << 1 | sum >> 31) ^ w[i];
+  return sum;
+}
+
+// The layout the firmware was built for
+static void ICACHE_FLASH_ATTR tableDefaults(PartitionTable *t) {
+  os_memset(t, 0, sizeof(*t));
+  t->magic = PART_TABLE_MAGIC;
+  t->parts[0].type = PART_TYPE_APP;
+  t->parts[0].address = USER1_BIN_SPI_FLASH_ADDR;
+  t->parts[0].size = FIRMWARE_SIZE_PARTITION1;
+  t->parts[1].type = PART_TYPE_APP;
+  t->parts[1].address = USER2_BIN_SPI_FLASH_ADDR;
+  t->parts[1].size = FIRMWARE_SIZE;
+  t->count = 2;
+  // clear of the boot journal's sectors
+  uint32 reserved = tableAddr() != 0 ? tableAddr() - BOOT_JOURNAL_SECTORS*SPI_FLASH_SEC_SIZE :
+    flashReservedStart();
+  if (DATA_SLOT_SIZE > 0 && DATA_REGION_ADDR + DATA_SLOTS*DATA_SLOT_SIZE <= reserved) {
+    t->parts[2].type = PART_TYPE_DATA;
+    t->parts[2].address = DATA_REGION_ADDR;
+    t->parts[2].size = DATA_SLOTS*DATA_SLOT_SIZE;
+    t->count = 3;
+  }
+}
+
+static void ICACHE_FLASH_ATTR tableLoad(void) {
+  if (tableLoaded) return;
+  tableLoaded = true;
+  tableDefaults(&table);
+
+  uint32 addr = tableAddr();
+  if (addr == 0) return;
+  PartitionTable t;
+  for (int slot = 0; slot < PART_TABLE_SLOTS; slot++) {
+    spi_flash_read(addr + slot*PART_TABLE_SLOT, (uint32 *)&t, sizeof(t));
+    if (t.magic == 0xffffffff) break; // copies are written without gaps
+    if (t.magic != PART_TABLE_MAGIC || t.checksum != tableChecksum(&t) || t.count > PART_MAX ||
+        (tableSlot >= 0 && t.seq <= table.seq)) continue;
+    table = t;
+    tableSlot = slot;
+  }
+  DBG("Partition table: %s, %d partitions\n", tableSlot >= 0 ? "flash" : "defaults", table.count);
+}
+
+// Write the table into the next free slot of its sector, erasing it when all slots are used
+static const char* ICACHE_FLASH_ATTR tableSave(void) {
+  uint32 addr = tableAddr();
+  table.seq++;
+  table.checksum = tableChecksum(&table);
+  if (addr == 0) return NULL; // kept in RAM only
+
+  int slot = tableSlot + 1;
+  if (slot >= PART_TABLE_SLOTS) {
+    if (spi_flash_erase_sector(addr / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+      return "Flash erase failed";
+    slot = 0;
+  }
+  if (spi_flash_write(addr + slot*PART_TABLE_SLOT, (uint32 *)&table, sizeof(table)) !=
+      SPI_FLASH_RESULT_OK)
+    return "Flash write failed";
+  tableSlot = slot;
+  DBG("Partition table: saved seq %d in slot %d\n", table.seq, slot);
+  return NULL;
+}
+
+int ICACHE_FLASH_ATTR partitionCount(void) {
+  tableLoad();
+  return table.count;
+}
+
+const Partition* ICACHE_FLASH_ATTR partitionGet(int index) {
+  tableLoad();
+  return index >= 0 && index < table.count ? &table.parts[index] : NULL;
+}
+
+// The nth partition of a type
+const Partition* ICACHE_FLASH_ATTR partitionFind(uint8 type, int nth) {
+  tableLoad();
+  for (int i = 0; i < table.count; i++) {
+    if (table.parts[i].type == type && nth-- == 0) return &table.parts[i];
+  }
+  return NULL;
+}
+
+// Index of an app partition among the app partitions, i.e. 0 for user1.bin, 1 for user2.bin
+int ICACHE_FLASH_ATTR partitionAppIndex(const Partition *part) {
+  for (int i = 0; i < 2; i++) {
+    if (part != NULL && partitionFind(PART_TYPE_APP, i) == part) return i;
+  }
+  return -1;
+}
+
+// The app partition the code is running from
+const Partition* ICACHE_FLASH_ATTR partitionRunning(void) {
+  if (running == NULL) {
+    const uint32 addr = (uint32)&_irom0_text_start - SPI_FLASH_MEM_EMU_START_ADDR;
+    for (int i = 0; i < 2; i++) {
+      const Partition *p = partitionFind(PART_TYPE_APP, i);
+      if (p != NULL && addr >= p->address && addr < p->address + p->size) running = p;
+    }
+  }
+  return running;
+}
+
+// The app partition to flash next, NULL if OTA isn't possible with this layout
+const Partition* ICACHE_FLASH_ATTR partitionNext(void) {
+  int running = partitionAppIndex(partitionRunning());
+  return running < 0 ? NULL : partitionFind(PART_TYPE_APP, 1 - running);
+}
+
+bool ICACHE_FLASH_ATTR partitionOverlapsApp(uint32 address, uint32 size) {
+  const Partition *p;
+  for (int i = 0; (p = partitionFind(PART_TYPE_APP, i)) != NULL; i++) {
+    if (address < p->address + p->size && p->address < address + size) return true;
+  }
+  return false;
+}
+
+static Partition* ICACHE_FLASH_ATTR partitionMutable(const Partition *part) {
+  tableLoad();
+  return part >= table.parts && part < table.parts + table.count ? (Partition *)part : NULL;
+}
+
+// The app partition that starts at address, NULL if there is none
+static Partition* ICACHE_FLASH_ATTR appAt(uint32 address) {
+  tableLoad();
+  for (int i = 0; i < table.count; i++) {
+    Partition *p = &table.parts[i];
+    if (p->type == PART_TYPE_APP && p->address == address) return p;
+  }
+  return NULL;
+}
+
+// Record that an upload into the app partition at address started. Whatever image was in it is
+// gone, and until the upload finishes there is none to boot or roll back to.
+const char* ICACHE_FLASH_ATTR partitionImageWriting(uint32 address) {
+  static const uint8 none[OTA_DIGEST_LEN];
+  Partition *p = appAt(address);
+  if (p == NULL) return NULL;
+  if (p->state == PART_STATE_WRITING && os_memcmp(p->digest, none, OTA_DIGEST_LEN) == 0)
+    return NULL;
+  p->state = PART_STATE_WRITING;
+  p->boots = 0;
+  os_memset(p->digest, 0, OTA_DIGEST_LEN);
+  return tableSave();
+}
+
+// Record that the upload into the app partition at address is complete, with the digest the
+// image was verified against, NULL if it wasn't
+const char* ICACHE_FLASH_ATTR partitionImageWritten(uint32 address, const uint8 *digest) {
+  static const uint8 none[OTA_DIGEST_LEN];
+  Partition *p = appAt(address);
+  if (p == NULL) return NULL;
+  if (digest == NULL) digest = none;
+  if (p->state == PART_STATE_UNKNOWN && os_memcmp(p->digest, digest, OTA_DIGEST_LEN) == 0)
+    return NULL;
+  p->state = PART_STATE_UNKNOWN;
+  os_memcpy(p->digest, digest, OTA_DIGEST_LEN);
+  return tableSave();
+}
+
+// Record that we're about to boot the image in a partition for the first time
+const char* ICACHE_FLASH_ATTR partitionSetImage(const Partition *part) {
+  Partition *p = partitionMutable(part);
+  if (p == NULL) return "No such partition";
+  p->state = PART_STATE_PENDING;
+  p->boots = 0;
+  p->version = ++table.uploads;
+  return tableSave();
+}
+
+// Record the outcome of booting the image in a partition
+const char* ICACHE_FLASH_ATTR partitionSetState(const Partition *part, uint8 state, uint8 boots) {
+  Partition *p = partitionMutable(part);
+  if (p == NULL) return "No such partition";
+  if (p->state == state && p->boots == boots) return NULL;
+  p->state = state;
+  p->boots = boots;
+  return tableSave();
+}
+
+// Parse a layout, one "<app|data> <address> <size>" line per partition, into t and check that
+// it fits the flash and keeps the partition we're running from as it is
+static const char* ICACHE_FLASH_ATTR partitionParse(char *p, PartitionTable *t) {
+  const Partition *running = partitionRunning();
+  int apps = 0, data = 0;
+  os_memset(t->parts, 0, sizeof(t->parts));
+  t->count = 0;
+  while (*p != 0) {
+    while (*p == ' ' || *p == '\r' || *p == '\n') p++;
+    if (*p == 0) break;
+    if (t->count >= PART_MAX) return "Too many partitions";
+    Partition *part = &t->parts[t->count++];
+    if (os_strncmp(p, "app ", 4) == 0) {
+      part->type = PART_TYPE_APP;
+      p += 4;
+      apps++;
+    } else if (os_strncmp(p, "data ", 5) == 0) {
+      part->type = PART_TYPE_DATA;
+      p += 5;
+      data++;
+    } else {
+      return "Unknown partition type";
+    }
+    part->address = strtoul(p, &p, 0);
+    part->size = strtoul(p, &p, 0);
+    if (part->address % SPI_FLASH_SEC_SIZE != 0 || part->size % SPI_FLASH_SEC_SIZE != 0 ||
+        part->size == 0) return "Unaligned partition";
+    if (part->address < USER1_BIN_SPI_FLASH_ADDR || part->size > flashReservedStart() ||
+        part->address > flashReservedStart() - part->size)
+      return "Partition out of range";
+    for (Partition *o = t->parts; o < part; o++) {
+      if (part->address < o->address + o->size && o->address < part->address + part->size)
+        return "Partitions overlap";
+    }
+    // keep what's known about images that stay where they are
+    for (int i = 0; i < table.count; i++) {
+      const Partition *old = &table.parts[i];
+      if (old->type == part->type && old->address == part->address && old->size == part->size)
+        *part = *old;
+    }
+  }
+  if (apps != 2 || data > 1) return "Need two app partitions and at most one data partition";
+  int idx = partitionAppIndex(running);
+  if (idx < 0) return "Running partition unknown";
+  int n = 0;
+  for (int i = 0; i < t->count; i++) {
+    if (t->parts[i].type != PART_TYPE_APP || n++ != idx) continue;
+    // the image we run from must stay whole, and what is known about it with it
+    if (t->parts[i].address != running->address || t->parts[i].size != running->size)
+      return "Running partition can't change";
+  }
+  return NULL;
+}
+
+//===== Cgi that returns the partition table, or replaces the layout with the one POSTed
+int ICACHE_FLASH_ATTR cgiPartitions(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  tableLoad();
+  if (connData->requestType == HTTPD_METHOD_POST) {
+    const char *err = NULL;
+    PartitionTable t = table;
+    if (tableAddr() == 0) err = "No partition table on this flash";
+    else if (connData->post->buff == NULL || connData->post->len != connData->post->buffLen)
+      err = "Invalid request";
+    else err = partitionParse(connData->post->buff, &t);
+    if (err == NULL) {
+      table = t;
+      running = NULL; // may have moved within the table
+      err = tableSave();
+    }
+    if (err != NULL) {
+      errorResponse(connData, 400, (char *)err);
+      return HTTPD_CGI_DONE;
+    }
+  }
+
+  static const char *types[] = { "", "app", "data" };
+  static const char *states[] = { "unknown", "pending", "valid", "bad", "writing" };
+  char buf[200], digest[OTA_DIGEST_HEX_LEN+1];
+  jsonHeader(connData, 200);
+  os_sprintf(buf, "{\"stored\":%s,\"seq\":%d,\"partitions\":[", tableSlot >= 0 ? "true" : "false",
+      table.seq);
+  httpdSend(connData, buf, -1);
+  for (int i = 0; i < table.count; i++) {
+    const Partition *p = &table.parts[i];
+    otaFormatDigest(p->digest, digest);
+    os_sprintf(buf, "%s{\"type\":\"%s\",\"address\":%d,\"size\":%d,\"state\":\"%s\",\"boots\":%d,"
+        "\"version\":%d,\"digest\":\"%s\",\"running\":%s}", i > 0 ? "," : "",
+        types[p->type < 3 ? p->type : 0], p->address, p->size, states[p->state <= PART_STATE_WRITING ? p->state : 0], p->boots,
+        p->version, digest, p == partitionRunning() ? "true" : "false");
+    httpdSend(connData, buf, -1);
+  }
+  httpdSend(connData, "]}", 2);
+  return HTTPD_CGI_DONE;
+}
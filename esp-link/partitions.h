@@ -0,0 +1,50 @@
+#ifndef PARTITIONS_H
+#define PARTITIONS_H
+
+#include "httpd.h"
+#include "otasession.h"
+
+#define PART_MAX            4
+// The boot journal alternates between two sectors in front of the partition table
+#define BOOT_JOURNAL_SECTORS 2
+
+#define PART_TYPE_APP       1   // firmware, user1.bin goes into the first one, user2.bin into the second
+#define PART_TYPE_DATA      2   // the double buffered ESPFS/data region
+
+#define PART_STATE_UNKNOWN  0   // nothing is known about the content
+#define PART_STATE_PENDING  1   // a new image has been written, it didn't confirm a boot yet
+#define PART_STATE_VALID    2   // the image booted and confirmed its health
+#define PART_STATE_BAD      3   // the image failed to boot and was rolled back
+#define PART_STATE_WRITING  4   // an upload into it started and didn't finish, don't boot it
+
+typedef struct {
+  uint8  type;
+  uint8  state;
+  uint8  boots;                   // boots it took to confirm or give up on the image
+  uint8  reserved;
+  uint32 address;
+  uint32 size;
+  uint32 version;                 // sequence number of the upload that wrote the image
+  uint8  digest[OTA_DIGEST_LEN];  // MD5 of the image, all zero if unknown
+} Partition;
+
+uint32 flashSize(void);
+uint32 flashReservedStart(void);
+uint32 flashJournalAddr(void);
+
+int partitionCount(void);
+const Partition *partitionGet(int index);
+const Partition *partitionFind(uint8 type, int nth);
+const Partition *partitionRunning(void);
+const Partition *partitionNext(void);
+int partitionAppIndex(const Partition *part);
+bool partitionOverlapsApp(uint32 address, uint32 size);
+
+const char *partitionImageWriting(uint32 address);
+const char *partitionImageWritten(uint32 address, const uint8 *digest);
+const char *partitionSetImage(const Partition *part);
+const char *partitionSetState(const Partition *part, uint8 state, uint8 boots);
+
+int cgiPartitions(HttpdConnData *connData);
+
+#endif // PARTITIONS_H
@@ -0,0 +1,602 @@
+/*
+Pull OTA: fetch a manifest from an HTTP server and pull the firmware for the partition we flash
+next from it, so that a fleet of devices updates at the pace the server hands out images instead
+of having each one pushed from a laptop.
+
+The manifest is plain text with one line per image: "<name> <size> <md5 hex> [path]", where name
+is user1.bin or user2.bin and path defaults to the name, relative to the manifest's directory.
+The server paces the devices by answering 503 or 429, optionally with Retry-After, to the
+manifest or image request of a device whose turn hasn't come yet.
+
+The image goes through the flash queue, receiving is on hold while the queue is behind. Whether
+the partition already holds the image of the manifest is checked a sector per timer tick, not
+within the callback of the manifest request.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "cgiflash.h"
+#include "flashqueue.h"
+#include "otasession.h"
+#include "partitions.h"
+#include "pullota.h"
+
+#ifdef PULL_OTA_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define PULL_TIMEOUT        15000 // ms without data before a request is given up
+#define PULL_RETRY_DELAY    10    // s to wait after a failure or when the server asks us to wait
+#define PULL_MAX_RETRIES    5     // failures in a row before giving up
+#define PULL_PATH_LEN       128
+#define PULL_MANIFEST_LEN   512
+#define PULL_CHECK_TICK     5     // ms between the sectors of the partition check
+
+// checking: hashing the partition we flash next, done: the image has been flashed and the
+// reboot is scheduled, current: we run or the partition already holds the image of the manifest
+typedef enum {
+  PULL_IDLE, PULL_WAITING, PULL_MANIFEST, PULL_CHECKING, PULL_IMAGE, PULL_DONE, PULL_CURRENT,
+  PULL_FAILED
+} PullPhase;
+static const char *pullPhases[] = {
+  "idle", "waiting", "manifest", "checking", "image", "done", "current", "failed"
+};
+
+static struct {
+  PullPhase phase;
+  PullPhase next;               // request to make when the wait is over
+  char host[64];
+  uint16 port;
+  char path[PULL_PATH_LEN];     // of the manifest
+  char image[PULL_PATH_LEN];    // path of the image for the partition we flash next
+  uint32 interval;              // s between manifest polls while up to date, 0 to poll once
+  uint32 retries;               // failures in a row
+  const char *err;              // error of the current request or the reason we gave up
+  bool busy;                    // a request is in flight
+  bool resolving;               // waiting for DNS
+  bool claimed;                 // the image is claimed in the upload session
+  bool held;                    // receiving is on hold until the flash queue drains
+  bool draining;                // the response is over, waiting for the flash queue to write it
+  uint8 pending;                // blocks in the flash queue
+  // response parsing
+  char line[96];
+  uint8 lineLen;
+  bool inBody;
+  int status;
+  uint32 retryAfter;            // s, from the Retry-After header
+  uint32 rangeStart;            // image offset of the first byte of the body
+  // image
+  uint32 length;
+  uint8 digest[OTA_DIGEST_LEN];
+  uint32 offset;                // image offset of the first byte in body
+  char *body;                   // manifest text or the image block being received
+  uint16 bodyLen;
+  // partition check
+  md5_context_t md5;
+  uint32 checked;               // bytes of the partition hashed so far
+} pull;
+
+static struct espconn pullConn;
+static esp_tcp pullTcp;
+static ip_addr_t pullIp;
+static ETSTimer pullTimer;
+
+static void pullConnect(void);
+static void pullResponse(void);
+
+static void ICACHE_FLASH_ATTR pullRelease(void) {
+  // blocks must not be written once the claim is gone
+  if (pull.pending > 0) flashQueueCancel(&pull);
+  pull.pending = 0;
+  if (pull.claimed) otaSessionRelease(0, pull.length);
+  pull.claimed = false;
+}
+
+// Run the next step after ms milliseconds, or give up a request after ms without data
+static void ICACHE_FLASH_ATTR pullSchedule(uint32 ms) {
+  os_timer_disarm(&pullTimer);
+  os_timer_arm(&pullTimer, ms, 0);
+}
+
+// Wait for the server's go-ahead or for the next poll, then make the request for phase
+static void ICACHE_FLASH_ATTR pullWait(PullPhase next, uint32 s) {
+  DBG("Pull OTA: waiting %ds\n", s);
+  pull.phase = PULL_WAITING;
+  pull.next = next;
+  pullSchedule(s * 1000);
+}
+
+static void ICACHE_FLASH_ATTR pullEnd(PullPhase phase, const char *err) {
+  DBG("Pull OTA: %s %s\n", pullPhases[phase], err != NULL ? err : "");
+  os_timer_disarm(&pullTimer);
+  pullRelease();
+  pull.phase = phase;
+  pull.err = err;
+  if (pull.body != NULL) os_free(pull.body);
+  pull.body = NULL;
+}
+
+// Case-insensitive check whether a header line starts with name
+static bool ICACHE_FLASH_ATTR headerIs(const char *line, const char *name) {
+  for (; *name != 0; line++, name++) {
+    if (*line == 0 || tolower((int)*line) != tolower((int)*name)) return false;
+  }
+  return true;
+}
+
+static const char* ICACHE_FLASH_ATTR pullParseLine(void) {
+  pull.line[pull.lineLen] = 0;
+  if (pull.status == 0) {
+    if (os_strncmp(pull.line, "HTTP/1.", 7) != 0 || pull.lineLen < 12) return "Bad response";
+    pull.status = atoi(pull.line + 9);
+  } else if (headerIs(pull.line, "Retry-After:")) {
+    pull.retryAfter = atoi(pull.line + 12);
+  } else if (headerIs(pull.line, "Content-Range: bytes ")) {
+    pull.rangeStart = atoi(pull.line + 21);
+  }
+  return NULL;
+}
+
+// A block of the image has been written by the flash queue
+static void ICACHE_FLASH_ATTR pullWritten(void *arg, const char *err) {
+  pull.pending--;
+  if (err != NULL && pull.err == NULL) {
+    pull.err = err;
+    if (!pull.draining) espconn_disconnect(&pullConn);
+  }
+  // resume receiving once the queue drained, or our own blocks are all written
+  if (pull.held && (flashQueuePending() <= FLASH_QUEUE_LOW || pull.pending == 0)) {
+    pull.held = false;
+    if (!pull.draining) espconn_recv_unhold(&pullConn);
+  }
+  if (pull.pending == 0 && pull.draining) {
+    pull.draining = false;
+    pullResponse();
+  }
+}
+
+// Queue the image block that has been received for the flash
+static const char* ICACHE_FLASH_ATTR pullFlush(void) {
+  const char *err = NULL;
+  if (pull.offset == 0) err = check_header(pull.body);
+  // the hold came too late for what the server had sent, the retry resumes with it
+  if (err == NULL && flashQueuePending() >= FLASH_QUEUE_LEN) err = "Flash busy";
+  if (err == NULL) {
+    pull.pending++;
+    err = flashQueueWrite(pull.offset, pull.body, pull.bodyLen, pullWritten, &pull);
+    if (err != NULL) pull.pending--;
+  }
+  pull.offset += pull.bodyLen;
+  pull.bodyLen = 0;
+  // the server is ahead of the flash, let the TCP window close
+  if (err == NULL && !pull.held && flashQueuePending() >= FLASH_QUEUE_HIGH) {
+    espconn_recv_hold(&pullConn);
+    pull.held = true;
+  }
+  return err;
+}
+
+static const char* ICACHE_FLASH_ATTR pullBody(char *data, unsigned short len) {
+  if (pull.phase == PULL_MANIFEST) {
+    if (pull.bodyLen + len >= PULL_MANIFEST_LEN) return "Manifest too large";
+    os_memcpy(pull.body + pull.bodyLen, data, len);
+    pull.bodyLen += len;
+    return NULL;
+  }
+  if (pull.status != 200 && pull.status != 206) return NULL; // evaluated once we're done
+  while (len > 0) {
+    uint32 want = pull.length - pull.offset < OTA_BLOCK_SIZE ?
+      pull.length - pull.offset : OTA_BLOCK_SIZE;
+    uint16 n = want - pull.bodyLen < len ? want - pull.bodyLen : len;
+    if (n == 0) return "Image too long";
+    os_memcpy(pull.body + pull.bodyLen, data, n);
+    pull.bodyLen += n;
+    data += n;
+    len -= n;
+    if (pull.bodyLen == want) {
+      const char *err = pullFlush();
+      if (err != NULL) return err;
+    }
+  }
+  return NULL;
+}
+
+static void ICACHE_FLASH_ATTR pullRecvCb(void *arg, char *data, unsigned short len) {
+  const char *err = NULL;
+  pullSchedule(PULL_TIMEOUT);
+  while (len > 0 && !pull.inBody && err == NULL) {
+    char c = *data++;
+    len--;
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (pull.lineLen < sizeof(pull.line) - 1) pull.line[pull.lineLen++] = c;
+      continue;
+    }
+    if (pull.lineLen == 0) {
+      pull.inBody = true;
+      // a server that ignores our Range header sends the whole image
+      pull.offset = pull.status == 206 ? pull.rangeStart : 0;
+      if (pull.offset % OTA_BLOCK_SIZE != 0) err = "Unaligned range";
+      DBG("Pull OTA: HTTP %d, body at %d\n", pull.status, pull.offset);
+    } else {
+      err = pullParseLine();
+    }
+    pull.lineLen = 0;
+  }
+  if (err == NULL && len > 0) err = pullBody(data, len);
+  if (err != NULL && pull.err == NULL) {
+    pull.err = err;
+    espconn_disconnect(&pullConn);
+  }
+}
+
+static void ICACHE_FLASH_ATTR pullConnectCb(void *arg) {
+  char buf[PULL_PATH_LEN + 160];
+  int n = os_sprintf(buf, "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: wifi-boot\r\n"
+      "X-Next-Image: %s\r\n", pull.phase == PULL_MANIFEST ? pull.path : pull.image, pull.host,
+      flashNextImageName());
+  if (pull.phase == PULL_IMAGE && pull.rangeStart != 0)
+    n += os_sprintf(buf + n, "Range: bytes=%d-\r\n", pull.rangeStart);
+  n += os_sprintf(buf + n, "\r\n");
+  // the request is on the stack, the SDK has to take a copy
+  espconn_set_opt(&pullConn, ESPCONN_COPY);
+  espconn_send(&pullConn, (uint8 *)buf, n);
+}
+
+// The line of the manifest for the image name, just past the name, NULL if there is none
+static char* ICACHE_FLASH_ATTR manifestFind(const char *name) {
+  uint32 nameLen = os_strlen(name);
+  char *p = pull.body;
+  while (p != NULL && !(os_strncmp(p, name, nameLen) == 0 && p[nameLen] == ' ')) {
+    p = os_strchr(p, '\n');
+    if (p != NULL) p++;
+  }
+  return p != NULL ? p + nameLen + 1 : NULL;
+}
+
+// Parse the size and digest of a manifest line, returns what follows them or NULL if they are bad
+static char* ICACHE_FLASH_ATTR manifestParse(char *p, uint32 *length, uint8 *digest) {
+  *length = strtoul(p, &p, 10);
+  while (*p == ' ') p++;
+  char hex[OTA_DIGEST_HEX_LEN+1];
+  os_strncpy(hex, p, OTA_DIGEST_HEX_LEN);
+  hex[OTA_DIGEST_HEX_LEN] = 0;
+  if (*length == 0 || !otaParseDigest(hex, digest)) return NULL;
+  p += os_strlen(hex);
+  while (*p == ' ') p++;
+  return p;
+}
+
+// Whether a partition is known to hold an image with digest
+static bool ICACHE_FLASH_ATTR partitionHolds(const Partition *part, const uint8 *digest) {
+  return part != NULL && (part->state == PART_STATE_PENDING || part->state == PART_STATE_VALID) &&
+    os_memcmp(part->digest, digest, OTA_DIGEST_LEN) == 0;
+}
+
+// Pick the line of the manifest for the partition we flash next and check that partition, unless
+// the image we run is the one of the manifest
+static const char* ICACHE_FLASH_ATTR pullManifest(void) {
+  pull.body[pull.bodyLen] = 0;
+  char running[12];
+  uint32 length;
+  uint8 digest[OTA_DIGEST_LEN];
+  os_sprintf(running, "user%d.bin", flashRunningPartition());
+  char *p = manifestFind(running);
+  if (p != NULL && manifestParse(p, &length, digest) != NULL &&
+      partitionHolds(partitionRunning(), digest)) {
+    DBG("Pull OTA: running %s already\n", running);
+    return NULL;
+  }
+
+  const char *name = flashNextImageName();
+  p = manifestFind(name);
+  if (p == NULL) return "No image in manifest";
+  char *e = os_strchr(p, '\n');
+  if (e != NULL) *e = 0;
+  if (e != NULL && e > p && e[-1] == '\r') e[-1] = 0;
+  p = manifestParse(p, &pull.length, pull.digest);
+  if (p == NULL) return "Bad manifest";
+  const char *file = *p != 0 ? p : name;
+
+  if (*file == '/') {
+    if (os_strlen(file) >= PULL_PATH_LEN) return "Image path too long";
+    os_strcpy(pull.image, file);
+  } else {
+    char *slash = pull.path;
+    for (char *s = pull.path; *s != 0; s++) if (*s == '/') slash = s;
+    uint32 dirLen = slash - pull.path + 1;
+    if (dirLen + os_strlen(file) >= PULL_PATH_LEN) return "Image path too long";
+    os_memcpy(pull.image, pull.path, dirLen);
+    os_strcpy(pull.image + dirLen, file);
+  }
+  if (pull.length > getNextFirmwareMaxSize()) return "Firmware image too large";
+
+  // nothing to do if the partition already holds the image, the table may know without hashing
+  if (partitionHolds(partitionNext(), pull.digest)) {
+    DBG("Pull OTA: %s is up to date\n", name);
+    return NULL;
+  }
+  MD5Init(&pull.md5);
+  pull.checked = 0;
+  pull.phase = PULL_CHECKING;
+  return NULL;
+}
+
+// Start the session for the image of the manifest and request it
+static const char* ICACHE_FLASH_ATTR pullStartImage(void) {
+  const char *err = otaSessionBegin(getNextSPIFlashAddr(), getNextFirmwareMaxSize(), pull.digest,
+      pull.length, NULL);
+  if (err != NULL) return err;
+  if (!otaSessionClaim(0, pull.length)) return "Upload in progress";
+  pull.claimed = true;
+  DBG("Pull OTA: fetching %s, %d bytes\n", pull.image, pull.length);
+  pull.phase = PULL_IMAGE;
+  pullSchedule(1);
+  return NULL;
+}
+
+static const char* ICACHE_FLASH_ATTR pullImage(void) {
+  if (pull.status != 200 && pull.status != 206) return "Image request failed";
+  if (pull.bodyLen != 0 || pull.offset != pull.length) return "Image truncated";
+  pullRelease();
+  const char *err = otaSessionFinish();
+  if (err == NULL) err = flashRebootIntoNext();
+  if (err != NULL) return err;
+  pullEnd(PULL_DONE, NULL);
+  return NULL;
+}
+
+// The manifest has nothing for us: poll it again later or stop
+static void ICACHE_FLASH_ATTR pullUpToDate(void) {
+  pull.retries = 0;
+  if (pull.interval > 0) pullWait(PULL_MANIFEST, pull.interval);
+  else pullEnd(PULL_CURRENT, NULL);
+}
+
+// A step failed, try again a while later unless it failed too often
+static void ICACHE_FLASH_ATTR pullFailed(const char *err) {
+  DBG("Pull OTA: %s\n", err);
+  if (++pull.retries >= PULL_MAX_RETRIES) {
+    pullEnd(PULL_FAILED, err);
+  } else {
+    pull.err = err; // reported until the retry succeeds
+    pullWait(pull.claimed ? PULL_IMAGE : PULL_MANIFEST, PULL_RETRY_DELAY);
+  }
+}
+
+// Hash the next sector of the partition we flash next, and once all of the image length is
+// hashed decide whether to fetch it
+static void ICACHE_FLASH_ATTR pullCheck(void) {
+  uint32 buf[64];
+  uint32 end = pull.checked + SPI_FLASH_SEC_SIZE < pull.length ?
+    pull.checked + SPI_FLASH_SEC_SIZE : pull.length;
+  for (; pull.checked < end; pull.checked += sizeof(buf)) {
+    uint32 n = end - pull.checked < sizeof(buf) ? end - pull.checked : sizeof(buf);
+    spi_flash_read(getNextSPIFlashAddr() + pull.checked, buf, sizeof(buf));
+    MD5Update(&pull.md5, (uint8 *)buf, n);
+  }
+  if (pull.checked < pull.length) {
+    pullSchedule(PULL_CHECK_TICK);
+    return;
+  }
+  uint8 digest[OTA_DIGEST_LEN];
+  MD5Final(digest, &pull.md5);
+  if (os_memcmp(digest, pull.digest, OTA_DIGEST_LEN) == 0) {
+    DBG("Pull OTA: %s is up to date\n", flashNextImageName());
+    pullUpToDate();
+    return;
+  }
+  const char *err = pullStartImage();
+  if (err != NULL) pullFailed(err);
+}
+
+// A request is over, figure out what comes next
+static void ICACHE_FLASH_ATTR pullResponse(void) {
+  if (!pull.busy) return;
+  if (pull.pending > 0) {
+    // the blocks we received go into the flash first, the retry resumes after them
+    pull.draining = true;
+    os_timer_disarm(&pullTimer);
+    return;
+  }
+  pull.busy = false;
+  os_timer_disarm(&pullTimer);
+  if (pull.phase != PULL_MANIFEST && pull.phase != PULL_IMAGE) return; // stopped
+
+  const char *err = pull.err;
+  if (err == NULL && (pull.status == 503 || pull.status == 429)) {
+    // the server paces the rollout
+    pullWait(pull.phase, pull.retryAfter > 0 ? pull.retryAfter : PULL_RETRY_DELAY);
+    return;
+  }
+  if (err == NULL && pull.phase == PULL_MANIFEST) {
+    if (pull.status == 204) {
+      // nothing to flash right now
+    } else if (pull.status != 200) {
+      err = "Manifest request failed";
+    } else {
+      err = pullManifest();
+    }
+    if (err == NULL && pull.phase == PULL_MANIFEST) {
+      pullUpToDate();
+      return;
+    }
+  } else if (err == NULL) {
+    err = pullImage();
+  }
+
+  if (err == NULL) {
+    pull.retries = 0;
+    if (pull.phase == PULL_CHECKING || pull.phase == PULL_IMAGE) pullSchedule(1);
+    return;
+  }
+  pullFailed(err);
+}
+
+static void ICACHE_FLASH_ATTR pullDisconCb(void *arg) {
+  pullResponse();
+}
+
+static void ICACHE_FLASH_ATTR pullReconCb(void *arg, sint8 err) {
+  DBG("Pull OTA: connection error %d\n", err);
+  if (pull.err == NULL) pull.err = "Connection failed";
+  pullResponse();
+}
+
+static void ICACHE_FLASH_ATTR pullDnsCb(const char *name, ip_addr_t *ip, void *arg) {
+  if (!pull.resolving) return; // timed out
+  pull.resolving = false;
+  if (ip == NULL) {
+    pull.err = "Host not found";
+    pullResponse();
+    return;
+  }
+  pullIp = *ip;
+  pullConnect();
+}
+
+// Open the connection for the request of the current phase
+static void ICACHE_FLASH_ATTR pullConnect(void) {
+  if (!pull.busy) {
+    pull.busy = true;
+    pull.held = false;
+    pull.err = NULL;
+    pull.status = 0;
+    pull.lineLen = 0;
+    pull.inBody = false;
+    pull.retryAfter = 0;
+    pull.bodyLen = 0;
+    pull.rangeStart = 0;
+    // resume with the first block that is missing, written blocks are skipped anyway
+    uint32 end;
+    if (pull.phase == PULL_IMAGE && !otaSessionNextMissing(&pull.rangeStart, &end))
+      pull.rangeStart = 0;
+    pullSchedule(PULL_TIMEOUT);
+
+    uint32 ip = ipaddr_addr(pull.host);
+    if (ip == IPADDR_NONE) {
+      DBG("Pull OTA: resolving %s\n", pull.host);
+      sint8 res = espconn_gethostbyname(&pullConn, pull.host, &pullIp, pullDnsCb);
+      if (res == ESPCONN_INPROGRESS) {
+        pull.resolving = true;
+        return;
+      }
+      if (res != ESPCONN_OK) {
+        pull.err = "Host not found";
+        pullResponse();
+        return;
+      }
+    } else {
+      pullIp.addr = ip;
+    }
+  }
+
+  os_memset(&pullTcp, 0, sizeof(pullTcp));
+  pullConn.type = ESPCONN_TCP;
+  pullConn.state = ESPCONN_NONE;
+  pullConn.proto.tcp = &pullTcp;
+  pullTcp.local_port = espconn_port();
+  pullTcp.remote_port = pull.port;
+  os_memcpy(pullTcp.remote_ip, &pullIp.addr, 4);
+  espconn_regist_connectcb(&pullConn, pullConnectCb);
+  espconn_regist_recvcb(&pullConn, pullRecvCb);
+  espconn_regist_disconcb(&pullConn, pullDisconCb);
+  espconn_regist_reconcb(&pullConn, pullReconCb);
+  DBG("Pull OTA: GET http://" IPSTR ":%d%s\n", IP2STR(&pullIp), pull.port,
+      pull.phase == PULL_MANIFEST ? pull.path : pull.image);
+  if (espconn_connect(&pullConn) != ESPCONN_OK) {
+    pull.err = "Connect failed";
+    pullResponse();
+  }
+}
+
+static void ICACHE_FLASH_ATTR pullTimerCb(void *arg) {
+  if (pull.busy) {
+    pull.err = "Timeout";
+    if (pull.resolving) {
+      pull.resolving = false;
+      pullResponse();
+    } else {
+      // no data for too long, the disconnect callback takes it from here
+      espconn_disconnect(&pullConn);
+    }
+    return;
+  }
+  if (pull.phase == PULL_WAITING) pull.phase = pull.next;
+  if (pull.phase == PULL_CHECKING) pullCheck();
+  else if (pull.phase == PULL_MANIFEST || pull.phase == PULL_IMAGE) pullConnect();
+}
+
+// Start pulling the firmware using the manifest at url, "http://host[:port]/path". With an
+// interval the manifest is polled every so many seconds until there is something to flash.
+const char* ICACHE_FLASH_ATTR pullOtaStart(const char *url, uint32 interval) {
+  if (pull.busy || pull.phase == PULL_MANIFEST || pull.phase == PULL_CHECKING ||
+      pull.phase == PULL_IMAGE)
+    return "Pull in progress";
+  if (os_strncmp(url, "http://", 7) != 0) return "Only http:// URLs are supported";
+  const char *host = url + 7;
+  const char *path = os_strchr(host, '/');
+  if (path == NULL) return "URL has no path";
+  const char *colon = os_strchr(host, ':');
+  uint32 hostLen = (colon != NULL && colon < path ? colon : path) - host;
+  if (hostLen == 0 || hostLen >= sizeof(pull.host)) return "Bad host";
+  if (os_strlen(path) >= PULL_PATH_LEN) return "URL too long";
+  uint16 port = colon != NULL && colon < path ? atoi(colon + 1) : 80;
+  if (port == 0) return "Bad port";
+
+  pullOtaStop();
+  pull.body = os_malloc(OTA_BLOCK_SIZE > PULL_MANIFEST_LEN ? OTA_BLOCK_SIZE : PULL_MANIFEST_LEN);
+  if (pull.body == NULL) return "Out of memory";
+  os_memcpy(pull.host, host, hostLen);
+  pull.host[hostLen] = 0;
+  os_strcpy(pull.path, path);
+  pull.port = port;
+  pull.interval = interval;
+  pull.retries = 0;
+  pull.err = NULL;
+  pull.phase = PULL_MANIFEST;
+  os_timer_setfn(&pullTimer, pullTimerCb, NULL);
+  pullSchedule(1);
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR pullOtaStop(void) {
+  if (pull.busy && !pull.resolving && !pull.draining) espconn_disconnect(&pullConn);
+  if (pull.resolving || pull.draining) pull.busy = pull.resolving = pull.draining = false;
+  pullEnd(PULL_IDLE, NULL);
+}
+
+// Describe the state of the pull as JSON, buf must hold 400 chars
+int ICACHE_FLASH_ATTR pullOtaStatus(char *buf) {
+  return os_sprintf(buf, "{\"phase\":\"%s\",\"url\":\"http://%s:%d%s\",\"image\":\"%s\","
+      "\"received\":%d,\"length\":%d,\"retries\":%d,\"error\":\"%s\"}",
+      pullPhases[pull.phase], pull.host, pull.port, pull.path, pull.image,
+      pull.phase == PULL_IMAGE ? pull.offset : 0, pull.length, pull.retries,
+      pull.err != NULL ? pull.err : "");
+}
+
+//===== Cgi to start (url=...&interval=...) or stop (stop=1) pulling the firmware from a server,
+// returns the state of the pull
+int ICACHE_FLASH_ATTR cgiPullFirmware(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char url[PULL_PATH_LEN + 80], arg[12];
+  if (httpdFindArg(connData->getArgs, "stop", arg, sizeof(arg)) > 0) pullOtaStop();
+  if (httpdFindArg(connData->getArgs, "url", url, sizeof(url)) > 0) {
+    uint32 interval = 0;
+    if (httpdFindArg(connData->getArgs, "interval", arg, sizeof(arg)) > 0) interval = atoi(arg);
+    const char *err = pullOtaStart(url, interval);
+    if (err != NULL) {
+      errorResponse(connData, 400, (char *)err);
+      return HTTPD_CGI_DONE;
+    }
+  }
+
+  char buf[400];
+  pullOtaStatus(buf);
+  jsonHeader(connData, 200);
+  httpdSend(connData, buf, -1);
+  return HTTPD_CGI_DONE;
+}
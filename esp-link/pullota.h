@@ -0,0 +1,12 @@
+#ifndef PULLOTA_H
+#define PULLOTA_H
+
+#include "httpd.h"
+
+const char *pullOtaStart(const char *url, uint32 interval);
+void pullOtaStop(void);
+int pullOtaStatus(char *buf);
+
+int cgiPullFirmware(HttpdConnData *connData);
+
+#endif // PULLOTA_H
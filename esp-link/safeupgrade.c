@@ -1,6 +1,9 @@
 #include <esp8266.h>
+#include "cgi.h"
 #include "cgiflash.h"
 #include "safeupgrade.h"
+#include "bootjournal.h"
+#include "partitions.h"
 
 #ifdef SAFE_UPGRADE_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -8,56 +11,87 @@
 #define DBG(format, ...) do { } while(0)
 #endif
 
-/* the timeout which will wait for the wifi flasher response
- * until the upgrade will be undone (in seconds)
+/* Boot health policy: an upgrade is confirmed as soon as every required readiness signal
+ * has been seen within its deadline (in ms after boot, 0 if the signal isn't required).
+ * A missed deadline, a crash or too many unconfirmed boots undo the upgrade.
  */
-#define UPGRADE_FAILED_TIMEOUT          30
-
+#ifndef BOOT_DEADLINE_WIFI
+#define BOOT_DEADLINE_WIFI              20000
+#endif
+#ifndef BOOT_DEADLINE_HTTPD
+#define BOOT_DEADLINE_HTTPD             5000
+#endif
+#ifndef BOOT_DEADLINE_REQUEST
+#define BOOT_DEADLINE_REQUEST           0
+#endif
+#ifndef BOOT_DEADLINE_HEARTBEAT
+#define BOOT_DEADLINE_HEARTBEAT         0
+#endif
 
-#ifndef BOOTLOADER_CONFIG_ADDR
-#warning Use default bootloader config address for 512KB flash
-/* defaults to 512KB flash */
-#define BOOTLOADER_CONFIG_ADDR  0x7F000
+/* unconfirmed boots of an upgrade before it will be undone */
+#ifndef BOOT_MAX_ATTEMPTS
+#define BOOT_MAX_ATTEMPTS               3
 #endif
 
+/* how often the signals are checked (in ms) */
+#define BOOT_HEALTH_INTERVAL            100
 
-/* Should be a position which is not used by the 2nd stage bootloader.
- * But it has to be in the same flash block as the bootloader config
- */
-#define BOOTLOADER_CONFIG_SUCCESS_BYTE_POS  0x2F
-#define BOOTLOADER_CONFIG_SUCCESS_MAGIC     0xA5
+static const char *signalNames[BOOT_SIGNALS] = { "wifi", "httpd", "request", "heartbeat" };
+static uint32 signalDeadlines[BOOT_SIGNALS] = {
+    BOOT_DEADLINE_WIFI, BOOT_DEADLINE_HTTPD, BOOT_DEADLINE_REQUEST, BOOT_DEADLINE_HEARTBEAT
+};
+/* when the signals have been seen (in ms after boot) */
+static uint32 signalTimes[BOOT_SIGNALS];
+static uint8 signalsSeen;
 
-void ICACHE_FLASH_ATTR cgiFlashSetUpgradeSuccessful(void) {
-    uint8 bootloaderConfig[BOOTLOADER_CONFIG_SUCCESS_BYTE_POS + 1];
-    spi_flash_read(BOOTLOADER_CONFIG_ADDR, (uint32*)bootloaderConfig, sizeof(bootloaderConfig));
+static uint32 bootAttempts;
+static bool policyActive;
+static ETSTimer healthTimer;
 
-    /* cancle, if already set */
-    if (bootloaderConfig[BOOTLOADER_CONFIG_SUCCESS_BYTE_POS] == BOOTLOADER_CONFIG_SUCCESS_MAGIC) {
-        return;
-    }
 
-    /* set the upgrade successful byte */
-    bootloaderConfig[BOOTLOADER_CONFIG_SUCCESS_BYTE_POS] = BOOTLOADER_CONFIG_SUCCESS_MAGIC;
+/* the success state is kept in the boot journal,
+ * it is cached here so that marking a boot again costs nothing
+ */
+static bool upgradeSuccessful;
 
-    spi_flash_erase_sector(BOOTLOADER_CONFIG_ADDR / SPI_FLASH_SEC_SIZE);
-    spi_flash_write(BOOTLOADER_CONFIG_ADDR, (uint32*)bootloaderConfig, sizeof(bootloaderConfig));
+// Version of the running image, a journal of its own outlives the images in a partition
+static uint32 ICACHE_FLASH_ATTR runningVersion(void) {
+    const Partition *running = partitionRunning();
+    return running != NULL ? running->version : 0;
 }
 
 static bool ICACHE_FLASH_ATTR cgiFlashIsUpgradeSuccessful(void) {
-    uint8 bootloaderConfig[BOOTLOADER_CONFIG_SUCCESS_BYTE_POS + 1];
-    spi_flash_read(BOOTLOADER_CONFIG_ADDR, (uint32*)bootloaderConfig, sizeof(bootloaderConfig));
+    if (upgradeSuccessful) {
+        return true;
+    }
 
-    const bool successfull = (bootloaderConfig[BOOTLOADER_CONFIG_SUCCESS_BYTE_POS] == BOOTLOADER_CONFIG_SUCCESS_MAGIC);
-    DBG("Upgrade successful: %u\n", successfull);
-    return successfull;
+    /* a success record only counts for the partition it was written from and the image in it,
+     * so that one left behind by the previous firmware does not confirm an upgrade
+     */
+    BootRecord rec;
+    upgradeSuccessful = bootJournalLatest(BOOT_RECORD_SUCCESS, &rec) >= 0 &&
+        rec.partition == flashRunningPartition() && rec.value == runningVersion();
+    DBG("Upgrade successful: %u\n", upgradeSuccessful);
+    return upgradeSuccessful;
 }
 
-static void ICACHE_FLASH_ATTR undoUpgradeIfPossible(void* const timer) {
-  /* remove timer, if called from timer */
-  if (timer != NULL) {
-    os_timer_disarm(timer);
-  }
+void ICACHE_FLASH_ATTR cgiFlashSetUpgradeSuccessful(void) {
+    /* cancle, if already set */
+    if (cgiFlashIsUpgradeSuccessful()) {
+        return;
+    }
+
+    const char *err = bootJournalAppend(BOOT_RECORD_SUCCESS, flashRunningPartition(),
+        runningVersion());
+    if (err != NULL) {
+        DBG("Marking upgrade successful failed: %s\n", err);
+        return;
+    }
+    upgradeSuccessful = true;
+    partitionSetState(partitionRunning(), PART_STATE_VALID, bootAttempts);
+}
 
+static void ICACHE_FLASH_ATTR undoUpgradeIfPossible(void) {
   /* Do not undo the upgrade, if it boots successfully ones */
   if (cgiFlashIsUpgradeSuccessful()) {
       return;
@@ -70,10 +104,87 @@ static void ICACHE_FLASH_ATTR undoUpgradeIfPossible(void* const timer) {
       return;
   }
 
+  /* Nor if an upload into it started, it holds a mix of two images */
+  const Partition *old = partitionNext();
+  if (old != NULL && old->state == PART_STATE_WRITING) {
+      DBG("Not undoing the upgrade, the old firmware is being overwritten\n");
+      return;
+  }
+
+  /* Nor if the old firmware was rolled back from itself, going back would only ping-pong
+   * between the two images. Stay on this one.
+   */
+  if (old != NULL && old->state == PART_STATE_BAD) {
+      DBG("Not undoing the upgrade, the old firmware was rolled back from\n");
+      return;
+  }
+
+  partitionSetState(partitionRunning(), PART_STATE_BAD, bootAttempts);
   system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
   system_upgrade_reboot();
 }
 
+static void ICACHE_FLASH_ATTR bootHealthCheck(void) {
+    if (!policyActive) {
+        return;
+    }
+
+    /* confirmed some other way, e.g. by the flasher polling /flash/next */
+    if (upgradeSuccessful) {
+        policyActive = false;
+        os_timer_disarm(&healthTimer);
+        return;
+    }
+
+    const uint32 now = system_get_time() / 1000;
+    bool healthy = true;
+    for (int i = 0; i < BOOT_SIGNALS; i++) {
+        if (signalDeadlines[i] == 0 || (signalsSeen & (1 << i))) {
+            continue;
+        }
+        healthy = false;
+
+        if (now > signalDeadlines[i]) {
+            DBG("Boot health: no %s signal within %dms, undoing upgrade\n", signalNames[i],
+                signalDeadlines[i]);
+            policyActive = false;
+            os_timer_disarm(&healthTimer);
+            undoUpgradeIfPossible();
+            return;
+        }
+    }
+
+    if (healthy) {
+        DBG("Boot health: confirmed after %dms\n", now);
+        policyActive = false;
+        os_timer_disarm(&healthTimer);
+        cgiFlashSetUpgradeSuccessful();
+    }
+}
+
+static void ICACHE_FLASH_ATTR bootHealthTimerCb(void *arg) {
+    bootHealthCheck();
+}
+
+/* report a readiness signal, only the first one of each kind counts */
+void ICACHE_FLASH_ATTR bootHealthSignal(BootSignal signal) {
+    if (signal >= BOOT_SIGNALS || (signalsSeen & (1 << signal))) {
+        return;
+    }
+
+    signalsSeen |= 1 << signal;
+    signalTimes[signal] = system_get_time() / 1000;
+    DBG("Boot health: %s after %dms\n", signalNames[signal], signalTimes[signal]);
+    bootHealthCheck();
+}
+
+/* change the deadline of a signal (in ms after boot), 0 makes the signal optional */
+void ICACHE_FLASH_ATTR bootHealthSetDeadline(BootSignal signal, uint32 ms) {
+    if (signal < BOOT_SIGNALS) {
+        signalDeadlines[signal] = ms;
+    }
+}
+
 /**
   -1 downgrade done. Do not execute any user code after this call
    0 Possibly downgrade needed in the future
@@ -85,20 +196,63 @@ int ICACHE_FLASH_ATTR cgiFlashCheckUpgradeHealthy() {
         return 1;
     }
 
+    /* count the unconfirmed boots since the last confirmed one */
+    BootRecord attempt, success;
+    const int attemptSlot = bootJournalLatest(BOOT_RECORD_ATTEMPT, &attempt);
+    const int successSlot = bootJournalLatest(BOOT_RECORD_SUCCESS, &success);
+    bootAttempts = 1;
+    if (attemptSlot > successSlot && attempt.partition == flashRunningPartition()) {
+        bootAttempts = attempt.value + 1;
+    }
+    bootJournalAppend(BOOT_RECORD_ATTEMPT, flashRunningPartition(), bootAttempts);
+    DBG("Boot health: attempt %d of %d\n", bootAttempts, BOOT_MAX_ATTEMPTS);
+
     /* undo upgrade, if the first boot failes
      * with an watchdog reset, soft watchdog reset or an exception
      */
     struct rst_info *rst_info = system_get_rst_info();
-    if (rst_info->reason >= 1 && rst_info->reason <= 3) {
-        undoUpgradeIfPossible(NULL);
+    if ((rst_info->reason >= 1 && rst_info->reason <= 3) || bootAttempts > BOOT_MAX_ATTEMPTS) {
+        undoUpgradeIfPossible();
         return -1;
     }
 
-    /* if the system do not boot vital in 20sec,
-     * try to undo the upgrade
-     */
-    static ETSTimer upgradeFailedTimeout;
-    os_timer_setfn(&upgradeFailedTimeout, undoUpgradeIfPossible, &upgradeFailedTimeout);
-    os_timer_arm(&upgradeFailedTimeout, UPGRADE_FAILED_TIMEOUT * 1000, false);
+    /* wait for the readiness signals */
+    policyActive = true;
+    os_timer_disarm(&healthTimer);
+    os_timer_setfn(&healthTimer, bootHealthTimerCb, NULL);
+    os_timer_arm(&healthTimer, BOOT_HEALTH_INTERVAL, true);
     return 0;
 }
+
+/* state of the boot health policy, e.g. for the readiness announcement */
+bool ICACHE_FLASH_ATTR bootHealthConfirmed(void) {
+    return cgiFlashIsUpgradeSuccessful();
+}
+
+bool ICACHE_FLASH_ATTR bootHealthPending(void) {
+    return policyActive;
+}
+
+uint32 ICACHE_FLASH_ATTR bootHealthAttempts(void) {
+    return bootAttempts;
+}
+
+// Cgi that reports the state of the boot health policy
+int ICACHE_FLASH_ATTR cgiBootHealth(HttpdConnData *connData) {
+    if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+    char buf[96];
+    jsonHeader(connData, 200);
+    os_sprintf(buf, "{\"confirmed\":%s,\"pending\":%s,\"attempts\":%d,\"signals\":{",
+        cgiFlashIsUpgradeSuccessful() ? "true" : "false", policyActive ? "true" : "false",
+        bootAttempts);
+    httpdSend(connData, buf, -1);
+    for (int i = 0; i < BOOT_SIGNALS; i++) {
+        os_sprintf(buf, "%s\"%s\":{\"at\":%d,\"deadline\":%d}", i > 0 ? "," : "",
+            signalNames[i], (signalsSeen & (1 << i)) ? (int)signalTimes[i] : -1,
+            signalDeadlines[i]);
+        httpdSend(connData, buf, -1);
+    }
+    httpdSend(connData, "}}", 2);
+    return HTTPD_CGI_DONE;
+}
@@ -1,7 +1,24 @@
 #ifndef SAFEUPGRADE_H
 #define SAFEUPGRADE_H
 
+#include "httpd.h"
+
+// Readiness signals the boot health policy waits for before it confirms an upgrade
+typedef enum {
+  BOOT_SIGNAL_WIFI,       // the station got an IP or the soft-AP is up
+  BOOT_SIGNAL_HTTPD,      // the http listener accepts connections
+  BOOT_SIGNAL_REQUEST,    // the first http request has been served
+  BOOT_SIGNAL_HEARTBEAT,  // the application reports that it runs
+  BOOT_SIGNALS
+} BootSignal;
+
 int cgiFlashCheckUpgradeHealthy(void);
 void cgiFlashSetUpgradeSuccessful(void);
+void bootHealthSignal(BootSignal signal);
+void bootHealthSetDeadline(BootSignal signal, uint32 ms);
+bool bootHealthConfirmed(void);
+bool bootHealthPending(void);
+uint32 bootHealthAttempts(void);
+int cgiBootHealth(HttpdConnData *connData);
 
 #endif // SAFEUPGRADE_H
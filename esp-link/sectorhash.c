@@ -0,0 +1,84 @@
+/*
+Sector hashes of the partition we flash next, so that a client can compare them with its image
+and upload only the sectors that differ. Hashing a partition takes a while, so the hashes are
+cached until the sector is written again and computed a few sectors per cgi call.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "cgiflash.h"
+#include "otasession.h"
+#include "sectorhash.h"
+
+#ifdef SECTOR_HASH_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define MAX_SECTORS   (OTA_MAX_BLOCKS*OTA_BLOCK_SIZE/SPI_FLASH_SEC_SIZE)
+
+static uint32 cacheAddr;                      // partition the cache is for
+static uint8 hashes[MAX_SECTORS][SECTOR_HASH_LEN];
+static uint32 valid[MAX_SECTORS/32];
+
+#define BIT_GET(map, i)   (((map)[(i)/32] >> ((i)%32)) & 1)
+#define BIT_SET(map, i)   ((map)[(i)/32] |= 1UL << ((i)%32))
+#define BIT_CLR(map, i)   ((map)[(i)/32] &= ~(1UL << ((i)%32)))
+
+// The sector at address is about to change
+void ICACHE_FLASH_ATTR sectorHashInvalidate(uint32 address) {
+  if (address < cacheAddr || address >= cacheAddr + MAX_SECTORS*SPI_FLASH_SEC_SIZE) return;
+  BIT_CLR(valid, (address - cacheAddr) / SPI_FLASH_SEC_SIZE);
+}
+
+static const uint8* ICACHE_FLASH_ATTR sectorHash(uint32 sector) {
+  if (!BIT_GET(valid, sector)) {
+    uint8 digest[OTA_DIGEST_LEN];
+    otaFlashDigest(cacheAddr + sector*SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, digest);
+    os_memcpy(hashes[sector], digest, SECTOR_HASH_LEN);
+    BIT_SET(valid, sector);
+  }
+  return hashes[sector];
+}
+
+// Cgi that returns the sector hashes of the partition we flash next:
+// {"address":..,"size":..,"sector_size":4096,"hashes":"<8 hex digits per sector>"}
+int ICACHE_FLASH_ATTR cgiSectorHashes(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  uint32 address = getNextSPIFlashAddr();
+  uint32 sectors = getNextFirmwareMaxSize() / SPI_FLASH_SEC_SIZE;
+  if (sectors > MAX_SECTORS) sectors = MAX_SECTORS;
+  if (address != cacheAddr) {
+    cacheAddr = address;
+    os_memset(valid, 0, sizeof(valid));
+  }
+
+  // cgiData is the next sector to send, plus one
+  uint32 next = (uint32)connData->cgiData;
+  char buf[SECTOR_HASH_PER_CALL*2*SECTOR_HASH_LEN + 64];
+  if (next == 0) {
+    jsonHeader(connData, 200);
+    os_sprintf(buf, "{\"address\":%d,\"size\":%d,\"sector_size\":%d,\"hashes\":\"",
+        address, sectors*SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    httpdSend(connData, buf, -1);
+    next = 1;
+  }
+
+  char *p = buf;
+  uint32 end = next - 1 + SECTOR_HASH_PER_CALL;
+  for (uint32 s = next - 1; s < end && s < sectors; s++) {
+    const uint8 *h = sectorHash(s);
+    for (int i = 0; i < SECTOR_HASH_LEN; i++) p += os_sprintf(p, "%02x", h[i]);
+  }
+  if (end >= sectors) {
+    p += os_sprintf(p, "\"}");
+    httpdSend(connData, buf, p - buf);
+    connData->cgiData = NULL;
+    return HTTPD_CGI_DONE;
+  }
+  httpdSend(connData, buf, p - buf);
+  connData->cgiData = (void *)(end + 1);
+  return HTTPD_CGI_MORE;
+}
@@ -0,0 +1,14 @@
+#ifndef SECTORHASH_H
+#define SECTORHASH_H
+
+#include "httpd.h"
+
+// Each sector is summarized by the first bytes of its MD5, as hex in /flash/sectors
+#define SECTOR_HASH_LEN       4
+// Sectors hashed per cgi call, keeps each call short
+#define SECTOR_HASH_PER_CALL  16
+
+void sectorHashInvalidate(uint32 address);
+int cgiSectorHashes(HttpdConnData *connData);
+
+#endif // SECTORHASH_H
@@ -0,0 +1,239 @@
+/*
+Serial bridge: a TCP port (23) that is the console of the MCU on UART0, for when the ESP is in the
+bootloader and the MCU still needs a terminal. The bytes go through as they are, there is no
+telnet option processing.
+
+UART to TCP: espconn_sent gets pointers into the RX ring, there is no buffer of our own. The
+connections have ESPCONN_COPY set, so the SDK has its copy of the bytes when espconn_sent
+returns. Without it the SDK would read them out of the ring until they are acknowledged,
+retransmissions included, while the UART keeps writing to it. The bytes leave the ring once
+every client has sent them. Each client has its own place in the stream, so a client that waits
+for its acknowledgement doesn't stop the others until it holds the ring up. Bytes are sent once
+SERIAL_BRIDGE_COALESCE of them are waiting, or at the next tick otherwise, and whatever came in
+while a send was out goes in one piece after it.
+
+TCP to UART goes into the TX ring as it arrives. Receiving stops on all clients while the ring
+couldn't take a window from each client that can be connected, the TCP window does the flow
+control. That is also what a client that connects while the others are stopped can send.
+
+The bridge takes over the UART from the serial upload while a client is connected and turns the
+console output off, both come back when the last one is gone. The serial upload is suspended
+meanwhile, so it doesn't reset the rate or turn the console back on. The baud rate is set with
+/console/baud?rate=N. There is no RFC 2217, it would mean escaping 0xFF in both directions, and
+with that copying every byte.
+*/
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "uart.h"
+#include "serialota.h"
+#include "serbridge.h"
+
+#ifdef SERIAL_BRIDGE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#if defined(SERIAL_BRIDGE) && UART_TX_RING_SIZE - 1 < \
+    SERIAL_BRIDGE_MAX_CONN * SERIAL_BRIDGE_TX_HEADROOM + SERIAL_BRIDGE_TX_LOW
+#error "The TX ring is too small for the serial bridge"
+#endif
+
+typedef struct {
+  struct espconn *conn;     // NULL if the slot is free
+  uint32 sent;              // stream offset of the next byte to send it
+  bool sending;             // a send waits for its sent callback
+} BridgeClient;
+
+static struct {
+  BridgeClient clients[SERIAL_BRIDGE_MAX_CONN];
+  uint8 count;
+  uint32 tail;              // stream offset of the oldest byte in the RX ring
+  UartRecvCb uartOwner;     // receive callback to give the UART back to
+  uint8 osPrint;
+  bool held;                // receiving from the clients is stopped
+  uint32 switchBaud;        // rate to switch to once the TX ring is out, 0 if none
+} bridge;
+
+static struct espconn bridgeConn;
+static esp_tcp bridgeTcp;
+static ETSTimer bridgeTimer;
+
+// Release the bytes every client has sent, the SDK has its copy of them
+static void ICACHE_FLASH_ATTR bridgeRelease(void) {
+  uint32 oldest = bridge.tail + uart0_rx_available();
+  for (int i = 0; i < SERIAL_BRIDGE_MAX_CONN; i++) {
+    BridgeClient *c = bridge.clients + i;
+    if (c->conn != NULL && c->sent - bridge.tail < oldest - bridge.tail) oldest = c->sent;
+  }
+  uart0_rx_consume(oldest - bridge.tail);
+  bridge.tail = oldest;
+}
+
+// Hand the waiting bytes to the clients that have no send out, at least SERIAL_BRIDGE_COALESCE of
+// them unless flushing
+static void ICACHE_FLASH_ATTR bridgePump(bool flush) {
+  uint32 head = bridge.tail + uart0_rx_available();
+  for (int i = 0; i < SERIAL_BRIDGE_MAX_CONN; i++) {
+    BridgeClient *c = bridge.clients + i;
+    if (c->conn == NULL || c->sending) continue;
+    uint32 waiting = head - c->sent;
+    if (waiting == 0 || (waiting < SERIAL_BRIDGE_COALESCE && !flush)) continue;
+    const uint8 *data;
+    uint16 len = uart0_rx_peek(c->sent - bridge.tail, &data);
+    if (len > SERIAL_BRIDGE_SEND_MAX) len = SERIAL_BRIDGE_SEND_MAX;
+    // the SDK may be out of buffers, the next tick tries again
+    sint8 status = espconn_sent(c->conn, (uint8 *)data, len);
+    if (status != 0) {
+      DBG("Bridge: send to client %d failed, %d\n", i, status);
+      continue;
+    }
+    c->sent += len;
+    c->sending = true;
+  }
+  bridgeRelease();
+}
+
+static void ICACHE_FLASH_ATTR bridgeHold(bool hold) {
+  if (bridge.held == hold) return;
+  for (int i = 0; i < SERIAL_BRIDGE_MAX_CONN; i++) {
+    struct espconn *conn = bridge.clients[i].conn;
+    if (conn != NULL) hold ? espconn_recv_hold(conn) : espconn_recv_unhold(conn);
+  }
+  bridge.held = hold;
+}
+
+// The UART has data
+static void ICACHE_FLASH_ATTR bridgeUartRecvCb(void) {
+  bridgePump(false);
+}
+
+static void ICACHE_FLASH_ATTR bridgeTimerCb(void *arg) {
+  if (bridge.switchBaud != 0 && uart0_tx_idle()) {
+    DBG("Bridge: %d baud\n", bridge.switchBaud);
+    uart0_set_baud(bridge.switchBaud);
+    bridge.switchBaud = 0;
+  }
+  if (bridge.held && uart0_tx_free() >= UART_TX_RING_SIZE - 1 - SERIAL_BRIDGE_TX_LOW) {
+    bridgeHold(false);
+  }
+  bridgePump(true);
+  if (bridge.count == 0 && bridge.switchBaud == 0) os_timer_disarm(&bridgeTimer);
+}
+
+static void ICACHE_FLASH_ATTR bridgeTimerStart(void) {
+  os_timer_disarm(&bridgeTimer);
+  os_timer_setfn(&bridgeTimer, bridgeTimerCb, NULL);
+  os_timer_arm(&bridgeTimer, SERIAL_BRIDGE_TICK, true);
+}
+
+static void ICACHE_FLASH_ATTR bridgeSentCb(void *arg) {
+  BridgeClient *c = ((struct espconn *)arg)->reverse;
+  if (c == NULL) return;
+  c->sending = false;
+  // what came in meanwhile waited long enough
+  bridgePump(true);
+}
+
+static void ICACHE_FLASH_ATTR bridgeRecvCb(void *arg, char *data, unsigned short len) {
+  uart0_write(data, len);
+  if (uart0_tx_free() < SERIAL_BRIDGE_MAX_CONN * SERIAL_BRIDGE_TX_HEADROOM) bridgeHold(true);
+}
+
+static void ICACHE_FLASH_ATTR bridgeClose(struct espconn *conn) {
+  BridgeClient *c = conn->reverse;
+  if (c == NULL) return;
+  conn->reverse = NULL;
+  c->conn = NULL;
+  bridge.count--;
+  DBG("Bridge: client %d gone, %d left\n", c - bridge.clients, bridge.count);
+  if (bridge.count > 0) {
+    bridgeRelease();
+    return;
+  }
+  // hand the UART back
+  uart0_rx_consume(uart0_rx_available());
+  uart0_set_recv_cb(bridge.uartOwner);
+  system_set_os_print(bridge.osPrint);
+  serialOtaResume();
+  bridge.held = false;
+}
+
+static void ICACHE_FLASH_ATTR bridgeDisconCb(void *arg) {
+  bridgeClose(arg);
+}
+
+static void ICACHE_FLASH_ATTR bridgeReconCb(void *arg, sint8 err) {
+  DBG("Bridge: reset, err=%d\n", err);
+  bridgeClose(arg);
+}
+
+static void ICACHE_FLASH_ATTR bridgeConnectCb(void *arg) {
+  struct espconn *conn = arg;
+  int i;
+  for (i = 0; i < SERIAL_BRIDGE_MAX_CONN; i++) if (bridge.clients[i].conn == NULL) break;
+  if (i == SERIAL_BRIDGE_MAX_CONN) {
+    os_printf("Bridge: too many clients\n");
+    espconn_disconnect(conn);
+    return;
+  }
+
+  if (bridge.count++ == 0) {
+    // take the UART, what's in the RX ring was for the serial upload
+    serialOtaSuspend();
+    bridge.uartOwner = uart0_set_recv_cb(bridgeUartRecvCb);
+    uart0_rx_consume(uart0_rx_available());
+    bridge.tail = 0;
+    bridge.osPrint = system_get_os_print();
+    system_set_os_print(0);
+    bridgeTimerStart();
+  }
+  BridgeClient *c = bridge.clients + i;
+  c->conn = conn;
+  c->sent = bridge.tail + uart0_rx_available();
+  c->sending = false;
+  conn->reverse = c;
+  DBG("Bridge: client %d connected\n", i);
+
+  espconn_regist_recvcb(conn, bridgeRecvCb);
+  espconn_regist_reconcb(conn, bridgeReconCb);
+  espconn_regist_disconcb(conn, bridgeDisconCb);
+  espconn_regist_sentcb(conn, bridgeSentCb);
+  espconn_set_opt(conn, ESPCONN_REUSEADDR | ESPCONN_NODELAY | ESPCONN_COPY);
+  if (bridge.held) espconn_recv_hold(conn);
+}
+
+// GET /console/baud: {"rate":N}, with ?rate=N it switches to that rate once the bytes that are
+// on their way to the MCU are out
+int ICACHE_FLASH_ATTR cgiConsoleBaud(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char arg[16];
+  uint32 rate = bridge.switchBaud != 0 ? bridge.switchBaud : uart0_get_baud();
+  if (httpdFindArg(connData->getArgs, "rate", arg, sizeof(arg)) > 0) {
+    rate = atoi(arg);
+    if (rate < 300 || rate > 4000000) {
+      errorResponse(connData, 400, "Invalid baud rate");
+      return HTTPD_CGI_DONE;
+    }
+    bridge.switchBaud = rate;
+    bridgeTimerStart();
+  }
+  jsonHeader(connData, 200);
+  char buf[32];
+  os_sprintf(buf, "{\"rate\":%d}", rate);
+  httpdSend(connData, buf, -1);
+  return HTTPD_CGI_DONE;
+}
+
+void ICACHE_FLASH_ATTR serialBridgeInit(void) {
+  bridgeConn.type = ESPCONN_TCP;
+  bridgeConn.state = ESPCONN_NONE;
+  bridgeTcp.local_port = SERIAL_BRIDGE_PORT;
+  bridgeConn.proto.tcp = &bridgeTcp;
+  espconn_regist_connectcb(&bridgeConn, bridgeConnectCb);
+  espconn_accept(&bridgeConn);
+  espconn_tcp_set_max_con_allow(&bridgeConn, SERIAL_BRIDGE_MAX_CONN);
+  espconn_regist_time(&bridgeConn, SERIAL_BRIDGE_TIMEOUT, 0);
+}
@@ -0,0 +1,32 @@
+#ifndef SERBRIDGE_H
+#define SERBRIDGE_H
+
+#include <esp8266.h>
+#include "httpd.h"
+
+// Telnet style port of the console, the bytes go through as they are
+#ifndef SERIAL_BRIDGE_PORT
+#define SERIAL_BRIDGE_PORT        23
+#endif
+// Each client takes SERIAL_BRIDGE_TX_HEADROOM of the TX ring, see below
+#define SERIAL_BRIDGE_MAX_CONN    2
+// Seconds without traffic before the SDK closes a connection
+#define SERIAL_BRIDGE_TIMEOUT     600
+
+// Received bytes are sent once this many are waiting, or at the next tick
+#define SERIAL_BRIDGE_COALESCE    512
+// Most bytes passed to one espconn_sent, two segments
+#define SERIAL_BRIDGE_SEND_MAX    2920
+// ms, how often waiting bytes are flushed, held connections resumed and a baud rate change is
+// checked for
+#define SERIAL_BRIDGE_TICK        2
+// Receiving from the clients stops while the TX ring has less room than this for each client that
+// can be connected, the segments already on their way still fit. It resumes once the ring is down
+// to SERIAL_BRIDGE_TX_LOW bytes.
+#define SERIAL_BRIDGE_TX_HEADROOM 2920
+#define SERIAL_BRIDGE_TX_LOW      512
+
+void serialBridgeInit(void);
+int cgiConsoleBaud(HttpdConnData *connData);
+
+#endif // SERBRIDGE_H
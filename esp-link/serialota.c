@@ -0,0 +1,362 @@
+/*
+Serial firmware upload, for when there is no wifi: frames on UART0 carry the image into the
+partition we flash next, through the flash queue and the upload session like an http upload. It
+is verified with its digest and booted the way /flash/reboot does it, so bench and factory
+recovery keep the A/B safety of OTA instead of going through the ROM loader.
+
+Each request gets one reply, and a request that comes again (the reply got lost) gets the same
+reply again. A client starts at 115200 baud and may switch to up to 2Mbaud with SYNC. A client
+that starts at another rate sends a preamble of 'U's. At our rate that is a run of one byte value
+with framing errors, which starts the UART's baud rate detection. Other framing errors, line
+noise or a console at another rate, don't. The measured rate is kept until SERIAL_OTA_IDLE
+passes without a SYNC.
+
+DATA is answered once the block is in the flash, so the line is quiet while the flash is busy
+and nothing arrives while an erase keeps the chip from reading the UART. Console output is off
+while a client talks to us and comes back after SERIAL_OTA_IDLE without a frame, as does the
+baud rate. The serial bridge suspends all of this while it has the UART.
+*/
+
+#include <esp8266.h>
+#include "uart.h"
+#include "cgiflash.h"
+#include "flashqueue.h"
+#include "otasession.h"
+#include "serialota.h"
+
+#ifdef SERIAL_OTA_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define SERIAL_OTA_FRAME_MAX  (SERIAL_OTA_HEADER + 4 + SERIAL_OTA_MAX_DATA + 2)
+#define SERIAL_OTA_REPLY_MAX  (SERIAL_OTA_HEADER + 1 + 48 + 2)
+#define SERIAL_OTA_IDLE       5000  // ms without a frame before the session ends
+#define SERIAL_OTA_TICK       10    // ms, checks for a baud rate change and the idle time
+#define SERIAL_OTA_PREAMBLE   8     // same bytes in a row that, with framing errors, are a preamble
+
+static struct {
+  bool active;          // a client talks to us, console output is off
+  uint8 osPrint;        // console output setting before
+  uint32 switchBaud;    // rate to switch to once the reply went out, 0 if none
+  bool autobaud;        // measuring the rate of a client
+  bool measured;        // the rate was measured, it is kept while a SYNC may come
+  uint32 frameErrors;   // of the UART when we last looked
+  uint8 runByte;        // value of the last bytes received and how many of them in a row
+  uint8 runLen;
+  uint32 idle;          // ms since the last frame
+  bool claimed;         // the image is claimed in the upload session
+  uint32 length;
+  uint8 flags;
+  bool writing;         // a DATA reply waits for the flash
+  uint8 writeSeq;
+  uint32 writeOffset;
+  // receiver
+  uint8 rx[SERIAL_OTA_FRAME_MAX];
+  uint16 rxLen;
+  bool escaped, overrun;
+  // the last reply, sent again if its request comes again
+  uint8 reply[SERIAL_OTA_REPLY_MAX];
+  uint16 replyLen;
+} ser;
+
+static ETSTimer serialTimer;
+
+uint16 ICACHE_FLASH_ATTR serialOtaCrc(const uint8 *data, uint16 len) {
+  uint16 crc = 0xffff;
+  while (len-- > 0) {
+    crc ^= *data++ << 8;
+    for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static void ICACHE_FLASH_ATTR sendReplyAgain(void) {
+  uint8 buf[2*SERIAL_OTA_REPLY_MAX + 2];
+  uint16 n = 0;
+  buf[n++] = SERIAL_OTA_END;
+  for (uint16 i = 0; i < ser.replyLen; i++) {
+    uint8 c = ser.reply[i];
+    if (c == SERIAL_OTA_END || c == SERIAL_OTA_ESC) {
+      buf[n++] = SERIAL_OTA_ESC;
+      buf[n++] = c == SERIAL_OTA_END ? SERIAL_OTA_ESC_END : SERIAL_OTA_ESC_ESC;
+    } else {
+      buf[n++] = c;
+    }
+  }
+  buf[n++] = SERIAL_OTA_END;
+  if (uart0_write(buf, n) != n) DBG("Serial OTA: reply truncated\n");
+}
+
+// Reply to request cmd/seq with an error message, or with status 0 and data
+static void ICACHE_FLASH_ATTR sendReply(uint8 cmd, uint8 seq, const char *err, const void *data,
+    uint16 len) {
+  uint8 *r = ser.reply;
+  if (err != NULL) {
+    len = os_strlen(err) < 47 ? os_strlen(err) : 47;
+    data = err;
+  }
+  r[0] = cmd | SERIAL_OTA_REPLY;
+  r[1] = seq;
+  r[2] = len + 1;
+  r[3] = 0;
+  r[4] = err != NULL;
+  os_memcpy(r + 5, data, len);
+  uint16 crc = serialOtaCrc(r, 5 + len);
+  r[5 + len] = crc;
+  r[6 + len] = crc >> 8;
+  ser.replyLen = 7 + len;
+  sendReplyAgain();
+  if (err != NULL) DBG("Serial OTA: %s\n", err);
+}
+
+static void ICACHE_FLASH_ATTR releaseImage(void) {
+  if (ser.writing) flashQueueCancel(&ser);
+  ser.writing = false;
+  if (ser.claimed) otaSessionRelease(0, ser.length);
+  ser.claimed = false;
+}
+
+// A client starts talking to us
+static void ICACHE_FLASH_ATTR sessionStart(void) {
+  ser.idle = 0;
+  ser.measured = false;
+  if (ser.active) return;
+  ser.active = true;
+  ser.osPrint = system_get_os_print();
+  system_set_os_print(0);
+}
+
+// Nothing from the client for a while: back to the console at its rate
+static void ICACHE_FLASH_ATTR sessionEnd(void) {
+  releaseImage();
+  ser.switchBaud = 0;
+  ser.autobaud = ser.measured = false;
+  if (uart0_get_baud() != SERIAL_OTA_BAUD) uart0_set_baud(SERIAL_OTA_BAUD);
+  if (ser.active) system_set_os_print(ser.osPrint);
+  ser.active = false;
+  ser.replyLen = 0;
+}
+
+static void ICACHE_FLASH_ATTR cmdSync(uint8 seq, const uint8 *p, uint16 len) {
+  uint32 baud = 0;
+  if (len >= 4) os_memcpy(&baud, p, 4);
+  if (baud != 0 && (baud < 9600 || baud > SERIAL_OTA_MAX_BAUD)) {
+    sendReply(SERIAL_OTA_SYNC, seq, "Unsupported baud rate", NULL, 0);
+    return;
+  }
+  sessionStart();
+  SerialOtaInfo info;
+  os_memset(&info, 0, sizeof(info));
+  info.maxLen = getNextFirmwareMaxSize();
+  info.baud = baud != 0 ? baud : uart0_get_baud();
+  os_strncpy(info.next, flashNextImageName(), sizeof(info.next) - 1);
+  sendReply(SERIAL_OTA_SYNC, seq, NULL, &info, sizeof(info));
+  // the reply goes out at the old rate, the timer switches once it's on the wire
+  if (baud != 0 && baud != uart0_get_baud()) ser.switchBaud = baud;
+}
+
+// Offset of the first block from offset on that isn't in the flash yet
+static uint32 ICACHE_FLASH_ATTR nextMissing(uint32 offset) {
+  uint32 end;
+  return otaSessionNextMissing(&offset, &end) ? offset : ser.length;
+}
+
+static void ICACHE_FLASH_ATTR cmdBegin(uint8 seq, const uint8 *p, uint16 len) {
+  SerialOtaBegin b;
+  static const uint8 zero[OTA_DIGEST_LEN];
+  if (len < sizeof(b)) {
+    sendReply(SERIAL_OTA_BEGIN, seq, "Invalid request", NULL, 0);
+    return;
+  }
+  os_memcpy(&b, p, sizeof(b));
+  releaseImage();
+  bool resumed;
+  bool haveDigest = os_memcmp(b.digest, zero, OTA_DIGEST_LEN) != 0;
+  const char *err = otaSessionBegin(getNextSPIFlashAddr(), getNextFirmwareMaxSize(),
+      haveDigest ? b.digest : NULL, b.length, &resumed);
+  if (err == NULL && !otaSessionClaim(0, b.length)) err = "Upload in progress";
+  if (err != NULL) {
+    sendReply(SERIAL_OTA_BEGIN, seq, err, NULL, 0);
+    return;
+  }
+  ser.claimed = true;
+  ser.length = b.length;
+  ser.flags = b.flags;
+  uint32 reply[2] = { otaSessionMissingBytes(), nextMissing(0) };
+  DBG("Serial OTA: %d bytes %s, %d missing\n", b.length, resumed ? "resumed" : "started", reply[0]);
+  sendReply(SERIAL_OTA_BEGIN, seq, NULL, reply, sizeof(reply));
+}
+
+// A block of the image has been written by the flash queue
+static void ICACHE_FLASH_ATTR serialWritten(void *arg, const char *err) {
+  ser.writing = false;
+  uint32 next = nextMissing(ser.writeOffset);
+  sendReply(SERIAL_OTA_DATA, ser.writeSeq, err, &next, 4);
+}
+
+static void ICACHE_FLASH_ATTR cmdData(uint8 seq, const uint8 *p, uint16 len) {
+  uint32 offset;
+  if (len < 4) {
+    sendReply(SERIAL_OTA_DATA, seq, "Invalid request", NULL, 0);
+    return;
+  }
+  os_memcpy(&offset, p, 4);
+  if (!ser.claimed) {
+    sendReply(SERIAL_OTA_DATA, seq, "No upload session", NULL, 0);
+    return;
+  }
+  if (offset == 0) {
+    char *err = check_header((void *)(p + 4));
+    if (err != NULL) {
+      sendReply(SERIAL_OTA_DATA, seq, err, NULL, 0);
+      return;
+    }
+  }
+  // other uploads filled the flash queue, without a reply the client sends the block again
+  if (flashQueuePending() >= FLASH_QUEUE_LEN) return;
+  ser.writing = true;
+  ser.writeSeq = seq;
+  ser.writeOffset = offset;
+  const char *err = flashQueueWrite(offset, p + 4, len - 4, serialWritten, &ser);
+  if (err != NULL) serialWritten(&ser, err);
+}
+
+static void ICACHE_FLASH_ATTR cmdFinish(uint8 seq) {
+  const char *err = ser.claimed ? otaSessionFinish() : "No upload session";
+  if (err == NULL) {
+    DBG("Serial OTA: image verified\n");
+    releaseImage();
+    if (ser.flags & SERIAL_OTA_REBOOT) err = flashRebootIntoNext();
+  }
+  sendReply(SERIAL_OTA_FINISH, seq, err, NULL, 0);
+}
+
+static void ICACHE_FLASH_ATTR handleFrame(void) {
+  uint8 *f = ser.rx;
+  uint16 len = ser.rxLen;
+  if (len < SERIAL_OTA_HEADER + 2) return;
+  uint16 crc = f[len - 2] | f[len - 1] << 8, plen = f[2] | f[3] << 8;
+  if (serialOtaCrc(f, len - 2) != crc || plen != len - SERIAL_OTA_HEADER - 2) {
+    DBG("Serial OTA: bad frame\n");
+    return;
+  }
+  ser.idle = 0;
+  uint8 cmd = f[0], seq = f[1];
+  if (ser.writing) return; // the client waits for the reply, this is a repeat
+  if (ser.replyLen > 0 && ser.reply[0] == (cmd | SERIAL_OTA_REPLY) && ser.reply[1] == seq) {
+    sendReplyAgain();
+    return;
+  }
+  const uint8 *p = f + SERIAL_OTA_HEADER;
+  if (cmd == SERIAL_OTA_SYNC) cmdSync(seq, p, plen);
+  else if (!ser.active) return; // SYNC first, the rest may be line noise
+  else if (cmd == SERIAL_OTA_BEGIN) cmdBegin(seq, p, plen);
+  else if (cmd == SERIAL_OTA_DATA) cmdData(seq, p, plen);
+  else if (cmd == SERIAL_OTA_FINISH) cmdFinish(seq);
+  else sendReply(cmd, seq, "Unknown command", NULL, 0);
+}
+
+// The UART has data: decode frames, and notice a client that talks at another rate
+static void ICACHE_FLASH_ATTR serialRecvCb(void) {
+  uint32 frameErrors = uart0_stats()->frameErrors;
+  bool preamble = false;
+  uint8 buf[64];
+  uint16 n;
+  while ((n = uart0_read(buf, sizeof(buf))) > 0) {
+    for (uint16 i = 0; i < n; i++) {
+      uint8 c = buf[i];
+      if (c != ser.runByte) ser.runLen = 0;
+      ser.runByte = c;
+      if (ser.runLen < SERIAL_OTA_PREAMBLE) ser.runLen++;
+      // a 'U' flips the line every bit, at another rate each one is read as the same byte
+      if (ser.runLen == SERIAL_OTA_PREAMBLE && c != 'U' && frameErrors != ser.frameErrors)
+        preamble = true;
+      if (c == SERIAL_OTA_END) {
+        if (ser.rxLen > 0 && !ser.overrun) handleFrame();
+        ser.rxLen = 0;
+        ser.escaped = ser.overrun = false;
+        continue;
+      }
+      if (c == SERIAL_OTA_ESC) {
+        ser.escaped = true;
+        continue;
+      }
+      if (ser.escaped) {
+        c = c == SERIAL_OTA_ESC_END ? SERIAL_OTA_END : SERIAL_OTA_ESC;
+        ser.escaped = false;
+      }
+      if (ser.rxLen == sizeof(ser.rx)) ser.overrun = true;
+      else ser.rx[ser.rxLen++] = c;
+    }
+  }
+  ser.frameErrors = frameErrors;
+  if (preamble && !ser.autobaud && !ser.claimed) {
+    DBG("Serial OTA: preamble at another rate, measuring the baud rate\n");
+    uart0_autobaud_start();
+    ser.autobaud = true;
+    ser.idle = 0;
+  }
+}
+
+// Round a measured rate to the standard one it is within 5% of, 0 if none
+static uint32 ICACHE_FLASH_ATTR standardBaud(uint32 measured) {
+  static const uint32 rates[] = { 9600, 19200, 38400, 57600, 74880, 115200, 230400, 460800,
+    921600, 1500000, 2000000 };
+  for (int i = 0; i < sizeof(rates)/sizeof(rates[0]); i++) {
+    if (measured > rates[i] - rates[i]/20 && measured < rates[i] + rates[i]/20) return rates[i];
+  }
+  return 0;
+}
+
+static void ICACHE_FLASH_ATTR serialTimerCb(void *arg) {
+  if (ser.switchBaud != 0 && uart0_tx_idle()) {
+    DBG("Serial OTA: %d baud\n", ser.switchBaud);
+    uart0_set_baud(ser.switchBaud);
+    ser.switchBaud = 0;
+    ser.rxLen = 0;
+  }
+  if (ser.autobaud) {
+    uint32 baud = standardBaud(uart0_autobaud_result());
+    if (baud != 0) {
+      // the console stays on until the client's SYNC
+      ser.autobaud = false;
+      ser.measured = true;
+      ser.idle = 0;
+      ser.rxLen = 0;
+      if (baud != uart0_get_baud()) uart0_set_baud(baud);
+    }
+  }
+  if (!ser.active && !ser.autobaud && !ser.measured) return;
+  ser.idle += SERIAL_OTA_TICK;
+  if (ser.idle >= SERIAL_OTA_IDLE && !ser.writing) {
+    DBG("Serial OTA: client gone\n");
+    sessionEnd();
+  }
+}
+
+void ICACHE_FLASH_ATTR serialOtaInit(void) {
+  ser.frameErrors = uart0_stats()->frameErrors;
+  os_timer_setfn(&serialTimer, serialTimerCb, NULL);
+  os_timer_arm(&serialTimer, SERIAL_OTA_TICK, true);
+  uart0_set_recv_cb(serialRecvCb);
+}
+
+// Someone else takes the UART: end a session, which puts the rate and the console output back,
+// and stop watching the line. Without a session or a measurement of ours the rate stays, it may
+// be the one the new owner chose.
+void ICACHE_FLASH_ATTR serialOtaSuspend(void) {
+  if (ser.active || ser.autobaud || ser.measured) sessionEnd();
+  os_timer_disarm(&serialTimer);
+}
+
+// The UART is ours again, at whatever rate it was left, the caller gives the receive callback
+// back
+void ICACHE_FLASH_ATTR serialOtaResume(void) {
+  ser.frameErrors = uart0_stats()->frameErrors;
+  ser.rxLen = 0;
+  ser.runLen = 0;
+  ser.escaped = ser.overrun = false;
+  os_timer_arm(&serialTimer, SERIAL_OTA_TICK, true);
+}
@@ -0,0 +1,49 @@
+#ifndef SERIALOTA_H
+#define SERIALOTA_H
+
+#include <esp8266.h>
+
+// Rate the console and serial uploads start at, and the fastest a client may switch to
+#define SERIAL_OTA_BAUD       115200
+#define SERIAL_OTA_MAX_BAUD   2000000
+
+// A frame is SLIP encoded and holds: cmd, seq, payload length (2 bytes), payload and the
+// CRC-16/CCITT of all of that (2 bytes). Multi-byte fields are little endian.
+#define SERIAL_OTA_END        0xC0
+#define SERIAL_OTA_ESC        0xDB
+#define SERIAL_OTA_ESC_END    0xDC
+#define SERIAL_OTA_ESC_ESC    0xDD
+#define SERIAL_OTA_HEADER     4
+#define SERIAL_OTA_MAX_DATA   1024  // OTA_BLOCK_SIZE
+
+// Requests, the reply has cmd | SERIAL_OTA_REPLY and the same seq. Its payload starts with a
+// status byte, 0 for success, else an error message follows. Next is the offset of the first
+// block from there on the device is still missing, the image length if it has them all, so a
+// resumed upload skips what made it into the flash before.
+#define SERIAL_OTA_SYNC       0x01  // uint32 baud rate to switch to or 0, reply SerialOtaInfo
+#define SERIAL_OTA_BEGIN      0x02  // SerialOtaBegin, reply uint32 bytes missing, uint32 next
+#define SERIAL_OTA_DATA       0x03  // uint32 offset and up to 1KB, reply uint32 next once in flash
+#define SERIAL_OTA_FINISH     0x04  // verify the image and boot it if BEGIN asked for that
+#define SERIAL_OTA_REPLY      0x80
+
+#define SERIAL_OTA_REBOOT     0x01  // BEGIN flag
+
+typedef struct {
+  uint32 maxLen;        // largest image the partition takes
+  uint32 baud;          // rate the device talks at after this reply
+  char   next[12];      // image it needs, as /flash/next
+} SerialOtaInfo;
+
+typedef struct {
+  uint32 length;
+  uint8  digest[16];    // MD5 of the image, all zero if the client doesn't know it
+  uint8  flags;
+  uint8  reserved[3];
+} SerialOtaBegin;
+
+uint16 serialOtaCrc(const uint8 *data, uint16 len);
+void serialOtaInit(void);
+void serialOtaSuspend(void);
+void serialOtaResume(void);
+
+#endif // SERIALOTA_H
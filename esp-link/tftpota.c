@@ -0,0 +1,402 @@
+/*
+TFTP firmware receiver (RFC 1350 with the blksize, tsize and windowsize options of RFC 2348, 2349
+and 7440), built with TFTP_OTA=yes. A write request for the image /flash/next names writes it
+into the partition we flash next through the flash queue and the upload session, like an http
+upload does, but without a connection's header and send buffers: the receiver needs one 1KB
+block buffer. Booting the image is left to /flash/reboot.
+
+  curl -T user2.bin --tftp-blksize 1024 tftp://192.168.4.1/user2.bin
+
+One transfer at a time. Data blocks are assembled into the 1KB blocks of the upload session. The
+acknowledgement of a window is held back while the flash queue is full, which is all the flow
+control TFTP has, and a block the queue has no room for is dropped and sent again after it. Errors end the transfer with an error packet that names the block.
+*/
+
+#include <esp8266.h>
+#include "cgiflash.h"
+#include "flashqueue.h"
+#include "otasession.h"
+#include "tftpota.h"
+
+#ifdef TFTP_OTA_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define TFTP_RRQ    1
+#define TFTP_WRQ    2
+#define TFTP_DATA   3
+#define TFTP_ACK    4
+#define TFTP_ERROR  5
+#define TFTP_OACK   6
+
+#define TFTP_ERR_UNDEF    0
+#define TFTP_ERR_ACCESS   2
+#define TFTP_ERR_FULL     3
+#define TFTP_ERR_ILLEGAL  4
+#define TFTP_ERR_TID      5
+
+#define TFTP_BLKSIZE      512   // without the blksize option
+#define TFTP_TIMEOUT      1000  // ms, the last acknowledgement is repeated after a whole one without data
+#define TFTP_RETRIES      6     // timeouts before the transfer is given up
+#define TFTP_DALLY        3     // timeouts the final acknowledgement is repeated for a lost one
+// An OACK with each option we agree to once, values of up to 10 digits
+#define TFTP_OACK_MAX     (2 + sizeof("blksize") + sizeof("windowsize") + sizeof("tsize") + 3*11)
+
+static struct {
+  bool active;
+  uint8 peerIp[4];
+  int peerPort;
+  uint16 blksize;
+  uint16 window;
+  uint32 tsize;         // image length from the tsize option, 0 if the client didn't send it
+  uint32 maxLen;        // length of the session
+  uint16 block;         // last data block received in order
+  uint16 acked;         // last block acknowledged
+  bool repeated;        // acknowledged again since the last block in order, for a gap
+  bool held;            // an acknowledgement waits for the flash queue
+  bool last;            // the short block that ends the transfer arrived
+  bool finished;        // the image verified, only a lost final acknowledgement is answered
+  uint8 idle;           // timer ticks since the last packet
+  uint32 received;      // image bytes received
+  uint8 pending;        // blocks in the flash queue
+  uint32 queued[FLASH_QUEUE_LEN]; // image offsets of these, oldest first
+  uint8 queueHead;
+  uint16 fill;          // bytes in buf
+  uint8 buf[OTA_BLOCK_SIZE];
+} tftp;
+
+static struct espconn listenConn, xferConn;
+static esp_udp listenUdp, xferUdp;
+static bool xferOpen;
+static ETSTimer tftpTimer;
+
+static void ICACHE_FLASH_ATTR tftpSend(struct espconn *conn, const uint8 *ip, int port,
+    const uint8 *data, uint16 len) {
+  conn->proto.udp->remote_port = port;
+  os_memcpy(conn->proto.udp->remote_ip, ip, 4);
+  if (espconn_sendto(conn, (uint8 *)data, len) != ESPCONN_OK) DBG("TFTP: send failed\n");
+}
+
+static void ICACHE_FLASH_ATTR tftpSendError(struct espconn *conn, const uint8 *ip, int port,
+    uint16 code, const char *msg) {
+  uint8 buf[4 + 64];
+  int n = os_strlen(msg) < 63 ? os_strlen(msg) : 63;
+  buf[0] = 0;
+  buf[1] = TFTP_ERROR;
+  buf[2] = code >> 8;
+  buf[3] = code;
+  os_memcpy(buf + 4, msg, n);
+  buf[4 + n] = 0;
+  tftpSend(conn, ip, port, buf, 4 + n + 1);
+}
+
+static void ICACHE_FLASH_ATTR tftpAck(uint16 block) {
+  uint8 buf[4] = { 0, TFTP_ACK, block >> 8, block };
+  tftp.acked = block;
+  tftpSend(&xferConn, tftp.peerIp, tftp.peerPort, buf, sizeof(buf));
+}
+
+// The connection goes away from the timer, not from within its own receive callback
+static void ICACHE_FLASH_ATTR tftpClose(void) {
+  if (tftp.pending > 0) flashQueueCancel(&tftp);
+  otaSessionRelease(0, tftp.maxLen);
+  os_memset(&tftp, 0, sizeof(tftp));
+  os_timer_disarm(&tftpTimer);
+  os_timer_arm(&tftpTimer, 10, false);
+}
+
+// End the transfer with an error, blocks are numbered as in the transfer
+static void ICACHE_FLASH_ATTR tftpFail(uint16 code, uint16 block, const char *err) {
+  char msg[64];
+  os_sprintf(msg, "Block %d: %s", block, err);
+  DBG("TFTP: %s\n", msg);
+  tftpSendError(&xferConn, tftp.peerIp, tftp.peerPort, code, msg);
+  tftpClose();
+}
+
+// The block of the transfer in which an image offset lies
+static uint16 ICACHE_FLASH_ATTR blockAt(uint32 offset) {
+  return offset / tftp.blksize + 1;
+}
+
+// All of the image is in the flash, verify it and acknowledge the last block
+static void ICACHE_FLASH_ATTR tftpFinish(void) {
+  const char *err = otaSessionFinish();
+  if (err != NULL) {
+    tftpFail(TFTP_ERR_UNDEF, tftp.block, err);
+    return;
+  }
+  DBG("TFTP: %d bytes written and verified\n", tftp.received);
+  otaSessionRelease(0, tftp.maxLen);
+  tftp.finished = true;
+  tftp.idle = 0;
+  tftpAck(tftp.block);
+}
+
+// Acknowledge what arrived once the flash has room for the next window, or at the end once
+// all of it is written
+static void ICACHE_FLASH_ATTR tftpAckWhenWritten(void) {
+  if (tftp.last ? tftp.pending > 0 : flashQueuePending() >= FLASH_QUEUE_HIGH) {
+    tftp.held = true;
+    return;
+  }
+  tftp.held = false;
+  if (tftp.last) tftpFinish();
+  else tftpAck(tftp.block);
+}
+
+static void ICACHE_FLASH_ATTR tftpWritten(void *arg, const char *err) {
+  uint32 offset = tftp.queued[tftp.queueHead];
+  tftp.queueHead = (tftp.queueHead + 1) % FLASH_QUEUE_LEN;
+  tftp.pending--;
+  if (err != NULL) {
+    tftpFail(TFTP_ERR_UNDEF, blockAt(offset), err);
+    return;
+  }
+  if (tftp.held && (tftp.pending == 0 || flashQueuePending() <= FLASH_QUEUE_LOW))
+    tftpAckWhenWritten();
+}
+
+// Queue the assembled block for the flash
+static const char* ICACHE_FLASH_ATTR tftpFlush(void) {
+  uint32 offset = tftp.received - tftp.fill;
+  if (offset == 0) {
+    const char *err = check_header(tftp.buf);
+    if (err != NULL) return err;
+  }
+  tftp.queued[(tftp.queueHead + tftp.pending) % FLASH_QUEUE_LEN] = offset;
+  tftp.pending++;
+  const char *err = flashQueueWrite(offset, tftp.buf, tftp.fill, tftpWritten, &tftp);
+  if (err != NULL) tftp.pending--;
+  tftp.fill = 0;
+  return err;
+}
+
+static void ICACHE_FLASH_ATTR tftpData(uint16 block, const uint8 *data, uint16 len) {
+  if (tftp.finished) {
+    // our final acknowledgement got lost
+    if (block == tftp.block) tftpAck(tftp.block);
+    return;
+  }
+  if (block != (uint16)(tftp.block + 1)) {
+    // a gap in the window or a repeated window: ask for the blocks after the last one in order,
+    // once, and not while the flash holds the acknowledgement back
+    if (!tftp.repeated && !tftp.held) tftpAck(tftp.block);
+    tftp.repeated = true;
+    return;
+  }
+  if (tftp.last || tftp.held) return;
+  if (len > tftp.blksize) {
+    tftpFail(TFTP_ERR_ILLEGAL, block, "Block too large");
+    return;
+  }
+  if (tftp.received + len > tftp.maxLen) {
+    tftpFail(TFTP_ERR_FULL, block, "Firmware image too large");
+    return;
+  }
+  bool last = len < tftp.blksize;
+  int flushes = (tftp.fill + len) / OTA_BLOCK_SIZE + (last && (tftp.fill + len) % OTA_BLOCK_SIZE);
+  if (flashQueuePending() + flushes > FLASH_QUEUE_LEN) {
+    // no room for this block, the acknowledgement once there is asks for it again
+    DBG("TFTP: flash busy, dropping block %d\n", block);
+    tftp.held = true;
+    return;
+  }
+  tftp.block = block;
+  tftp.repeated = false;
+  tftp.last = last;
+
+  const char *err = NULL;
+  while (len > 0 && err == NULL) {
+    uint16 n = OTA_BLOCK_SIZE - tftp.fill < len ? OTA_BLOCK_SIZE - tftp.fill : len;
+    os_memcpy(tftp.buf + tftp.fill, data, n);
+    tftp.fill += n;
+    tftp.received += n;
+    data += n;
+    len -= n;
+    if (tftp.fill == OTA_BLOCK_SIZE) err = tftpFlush();
+  }
+  if (err == NULL && tftp.last) {
+    if (tftp.tsize == 0) err = otaSessionTruncate(tftp.received);
+    else if (tftp.received != tftp.tsize) err = "Length differs from tsize";
+    if (err == NULL && tftp.fill > 0) err = tftpFlush();
+  }
+  if (err != NULL) {
+    tftpFail(TFTP_ERR_UNDEF, block, err);
+    return;
+  }
+  if (tftp.last || (uint16)(tftp.block - tftp.acked) >= tftp.window) tftpAckWhenWritten();
+}
+
+static void ICACHE_FLASH_ATTR tftpTimerCb(void *arg) {
+  if (!tftp.active) {
+    if (xferOpen) espconn_delete(&xferConn);
+    xferOpen = false;
+    return;
+  }
+  if (tftp.held) {
+    // the queue is full of the blocks of other uploads, none of ours will call back
+    if (tftp.pending == 0) tftpAckWhenWritten();
+    return;
+  }
+  tftp.idle++;
+  if (tftp.finished) {
+    if (tftp.idle >= TFTP_DALLY) tftpClose();
+  } else if (tftp.idle > TFTP_RETRIES) {
+    tftpFail(TFTP_ERR_UNDEF, tftp.block + 1, "Timeout");
+  } else if (tftp.idle > 1) {
+    // the acknowledgement or the rest of the window got lost
+    tftpAck(tftp.block);
+  }
+}
+
+static void ICACHE_FLASH_ATTR xferRecvCb(void *arg, char *data, unsigned short len) {
+  remot_info *remote = NULL;
+  if (espconn_get_connection_info(&xferConn, &remote, 0) != ESPCONN_OK) return;
+  if (remote->remote_port != tftp.peerPort || os_memcmp(remote->remote_ip, tftp.peerIp, 4) != 0) {
+    tftpSendError(&xferConn, remote->remote_ip, remote->remote_port, TFTP_ERR_TID,
+        "Unknown transfer ID");
+    return;
+  }
+  if (len < 4 || !tftp.active) return;
+  uint16 op = (uint8)data[0] << 8 | (uint8)data[1];
+  uint16 block = (uint8)data[2] << 8 | (uint8)data[3];
+  tftp.idle = 0;
+  if (op == TFTP_DATA) tftpData(block, (uint8 *)data + 4, len - 4);
+  else if (op == TFTP_ERROR) tftpClose();
+  else tftpFail(TFTP_ERR_ILLEGAL, tftp.block + 1, "Illegal operation");
+}
+
+static bool ICACHE_FLASH_ATTR equalsIgnoreCase(const char *a, const char *b) {
+  for (; *a != 0 && *b != 0; a++, b++) {
+    if ((*a | 0x20) != (*b | 0x20)) return false;
+  }
+  return *a == *b;
+}
+
+// Append an option and its value to the OACK if it fits in size, returns the new length
+static int ICACHE_FLASH_ATTR tftpOackAppend(char *oack, int n, int size, const char *name,
+    uint32 v) {
+  char entry[sizeof("windowsize") + 11];
+  int len = os_sprintf(entry, "%s%c%u", name, 0, v) + 1;
+  if (n + len > size) return n;
+  os_memcpy(oack + n, entry, len);
+  return n + len;
+}
+
+// Take the options of a write request and format those we agree to into oack of size bytes,
+// returns the length of the OACK or 0 if there were none. An option that comes again is ignored.
+static int ICACHE_FLASH_ATTR tftpOptions(const char *opt, const char *end, char *oack, int size) {
+  enum { SEEN_BLKSIZE = 1, SEEN_WINDOW = 2, SEEN_TSIZE = 4 };
+  uint8 seen = 0;
+  int n = 2;
+  oack[0] = 0;
+  oack[1] = TFTP_OACK;
+  while (opt < end) {
+    const char *val = opt + os_strlen(opt) + 1;
+    if (val >= end) break;
+    uint32 v = atoi(val);
+    if (!(seen & SEEN_BLKSIZE) && equalsIgnoreCase(opt, "blksize") && v >= 8) {
+      seen |= SEEN_BLKSIZE;
+      tftp.blksize = v < TFTP_OTA_MAX_BLKSIZE ? v : TFTP_OTA_MAX_BLKSIZE;
+      n = tftpOackAppend(oack, n, size, "blksize", tftp.blksize);
+    } else if (!(seen & SEEN_WINDOW) && equalsIgnoreCase(opt, "windowsize") && v >= 1) {
+      seen |= SEEN_WINDOW;
+      tftp.window = v < TFTP_OTA_MAX_WINDOW ? v : TFTP_OTA_MAX_WINDOW;
+      n = tftpOackAppend(oack, n, size, "windowsize", tftp.window);
+    } else if (!(seen & SEEN_TSIZE) && equalsIgnoreCase(opt, "tsize")) {
+      seen |= SEEN_TSIZE;
+      tftp.tsize = v;
+      n = tftpOackAppend(oack, n, size, "tsize", v);
+    }
+    opt = val + os_strlen(val) + 1;
+  }
+  return n > 2 ? n : 0;
+}
+
+// A write request: start a transfer on a port of its own
+static void ICACHE_FLASH_ATTR listenRecvCb(void *arg, char *data, unsigned short len) {
+  remot_info *remote = NULL;
+  if (espconn_get_connection_info(&listenConn, &remote, 0) != ESPCONN_OK) return;
+  uint8 ip[4];
+  int port = remote->remote_port;
+  os_memcpy(ip, remote->remote_ip, 4);
+  if (len < 4 || data[len - 1] != 0) return;
+  uint16 op = (uint8)data[0] << 8 | (uint8)data[1];
+  if (op != TFTP_WRQ) {
+    tftpSendError(&listenConn, ip, port, op == TFTP_RRQ ? TFTP_ERR_ACCESS : TFTP_ERR_ILLEGAL,
+        "Firmware can only be written");
+    return;
+  }
+  // the client didn't get our answer and asks again
+  if (tftp.active && port == tftp.peerPort && os_memcmp(ip, tftp.peerIp, 4) == 0) return;
+  // a new transfer ends the wait for a lost final acknowledgement of the last one
+  if (tftp.finished) {
+    tftpClose();
+    espconn_delete(&xferConn);
+    xferOpen = false;
+  }
+  if (tftp.active || xferOpen) {
+    tftpSendError(&listenConn, ip, port, TFTP_ERR_UNDEF, "Upload in progress");
+    return;
+  }
+
+  const char *name = data + 2, *mode = name + os_strlen(name) + 1, *end = data + len;
+  if (mode >= end || !equalsIgnoreCase(mode, "octet")) {
+    tftpSendError(&listenConn, ip, port, TFTP_ERR_ILLEGAL, "Binary mode only");
+    return;
+  }
+  if (os_strcmp(name, flashNextImageName()) != 0) {
+    char msg[40];
+    os_sprintf(msg, "Next image is %s", flashNextImageName());
+    tftpSendError(&listenConn, ip, port, TFTP_ERR_ACCESS, msg);
+    return;
+  }
+
+  os_memset(&tftp, 0, sizeof(tftp));
+  tftp.blksize = TFTP_BLKSIZE;
+  tftp.window = 1;
+  char oack[TFTP_OACK_MAX];
+  int oackLen = tftpOptions(mode + os_strlen(mode) + 1, end, oack, sizeof(oack));
+  uint32 maxLen = getNextFirmwareMaxSize();
+  tftp.maxLen = tftp.tsize != 0 ? tftp.tsize : maxLen;
+  const char *err = otaSessionBegin(getNextSPIFlashAddr(), maxLen, NULL, tftp.maxLen, NULL);
+  if (err == NULL && !otaSessionClaim(0, tftp.maxLen)) err = "Upload in progress";
+  if (err != NULL) {
+    tftpSendError(&listenConn, ip, port,
+        tftp.tsize > maxLen ? TFTP_ERR_FULL : TFTP_ERR_UNDEF, err);
+    return;
+  }
+
+  // a transfer ID of its own, the request port stays free for others to be turned down
+  xferUdp.local_port = 1024 + os_random() % 60000;
+  if (espconn_create(&xferConn) != ESPCONN_OK) {
+    otaSessionRelease(0, tftp.maxLen);
+    tftpSendError(&listenConn, ip, port, TFTP_ERR_UNDEF, "No connection");
+    return;
+  }
+  xferOpen = true;
+  tftp.active = true;
+  tftp.peerPort = port;
+  os_memcpy(tftp.peerIp, ip, 4);
+  os_timer_arm(&tftpTimer, TFTP_TIMEOUT, true);
+  DBG("TFTP: %s from %d.%d.%d.%d:%d, blksize %d, window %d, tsize %d\n", name, ip[0], ip[1],
+      ip[2], ip[3], port, tftp.blksize, tftp.window, tftp.tsize);
+  if (oackLen > 0) tftpSend(&xferConn, ip, port, (uint8 *)oack, oackLen);
+  else tftpAck(0);
+}
+
+void ICACHE_FLASH_ATTR tftpOtaInit(void) {
+  os_timer_setfn(&tftpTimer, tftpTimerCb, NULL);
+  xferConn.type = ESPCONN_UDP;
+  xferConn.proto.udp = &xferUdp;
+  espconn_regist_recvcb(&xferConn, xferRecvCb);
+
+  listenConn.type = ESPCONN_UDP;
+  listenConn.proto.udp = &listenUdp;
+  listenUdp.local_port = TFTP_OTA_PORT;
+  espconn_regist_recvcb(&listenConn, listenRecvCb);
+  if (espconn_create(&listenConn) != ESPCONN_OK) DBG("TFTP: cannot listen\n");
+}
@@ -0,0 +1,18 @@
+#ifndef TFTPOTA_H
+#define TFTPOTA_H
+
+#include <esp8266.h>
+
+// Port of write requests, each transfer continues on a port of its own
+#ifndef TFTP_OTA_PORT
+#define TFTP_OTA_PORT       69
+#endif
+
+// Largest block size and window the receiver agrees to. Blocks are assembled into the 1KB blocks
+// of the upload session, larger ones would need a larger receive buffer.
+#define TFTP_OTA_MAX_BLKSIZE  1024
+#define TFTP_OTA_MAX_WINDOW   8
+
+void tftpOtaInit(void);
+
+#endif // TFTPOTA_H
@@ -0,0 +1,104 @@
+/*
+Wifi cache: the access point the station joined last, its channel and the DHCP lease it got. With
+them the station associates without scanning the channels and is reachable without waiting for
+DHCP, which is most of the time between a reboot into new firmware and the device answering.
+
+The whole cache is kept in RTC memory, which survives the reboots of an upgrade. The access
+point also goes into the boot journal, only when it changes, so that after a power loss the
+scan is saved at least: the lease may have run out while the device was off, so it isn't kept
+there. On flash under 2MB the SDK rewrites the journal's sector when it switches partitions,
+that loses the flash copy but not the RTC one.
+*/
+
+#include <esp8266.h>
+#include "bootjournal.h"
+#include "cgiflash.h"
+#include "wificache.h"
+
+#ifdef WIFI_CACHE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define WIFI_CACHE_MAGIC  0x48434657 // "WFCH"
+
+RTC_MEM_FITS(RTC_MEM_WIFI_CACHE, sizeof(WifiCache), RTC_MEM_BOOT_JOURNAL);
+
+static uint32 ICACHE_FLASH_ATTR cacheChecksum(const WifiCache *cache) {
+  const uint32 *w = (const uint32 *)cache;
+  uint32 sum = 0;
+  for (int i = 0; i < offsetof(WifiCache, checksum)/4; i++) sum = (sum << 1 | sum >> 31) ^ w[i];
+  return sum;
+}
+
+// Ties the two journal records together, a pair torn by a power loss doesn't pass
+static uint8 ICACHE_FLASH_ATTR journalCheck(uint32 ap) {
+  return ~(ap ^ ap >> 8 ^ ap >> 16 ^ ap >> 24);
+}
+
+// The access point in the boot journal, false if there is none
+static bool ICACHE_FLASH_ATTR journalLoad(WifiCache *cache) {
+  BootRecord ap, chan;
+  if (bootJournalLatest(BOOT_RECORD_WIFI_AP, &ap) < 0 ||
+      bootJournalLatest(BOOT_RECORD_WIFI_CHAN, &chan) < 0 ||
+      (uint8)(chan.value >> 24) != journalCheck(ap.value))
+    return false;
+  os_memcpy(cache->bssid, &ap.value, 4);
+  cache->bssid[4] = chan.value;
+  cache->bssid[5] = chan.value >> 8;
+  cache->channel = chan.value >> 16;
+  return true;
+}
+
+// Fill in cache from RTC memory or else the boot journal, false if neither has an access point
+bool ICACHE_FLASH_ATTR wifiCacheLoad(WifiCache *cache) {
+  system_rtc_mem_read(RTC_MEM_WIFI_CACHE, cache, sizeof(*cache));
+  if (cache->magic == WIFI_CACHE_MAGIC && cache->checksum == cacheChecksum(cache)) {
+    DBG("Wifi cache: ch %d, lease %s\n", cache->channel,
+        cache->flags & WIFI_CACHE_LEASE ? "yes" : "no");
+    return true;
+  }
+  os_memset(cache, 0, sizeof(*cache));
+  if (!journalLoad(cache)) return false;
+  DBG("Wifi cache: ch %d from flash\n", cache->channel);
+  return true;
+}
+
+// Remember the access point the station joined, and the lease it got if it uses DHCP
+void ICACHE_FLASH_ATTR wifiCacheSave(const uint8 *bssid, uint8 channel,
+    const struct ip_info *lease) {
+  WifiCache cache;
+  os_memset(&cache, 0, sizeof(cache));
+  cache.magic = WIFI_CACHE_MAGIC;
+  os_memcpy(cache.bssid, bssid, 6);
+  cache.channel = channel;
+  if (lease != NULL) {
+    cache.flags |= WIFI_CACHE_LEASE;
+    cache.ip = lease->ip.addr;
+    cache.netmask = lease->netmask.addr;
+    cache.gw = lease->gw.addr;
+  }
+  cache.checksum = cacheChecksum(&cache);
+  system_rtc_mem_write(RTC_MEM_WIFI_CACHE, &cache, sizeof(cache));
+
+  // flash only if the access point changed, most boots join the one they left
+  WifiCache stored;
+  if (journalLoad(&stored) && os_memcmp(stored.bssid, bssid, 6) == 0 && stored.channel == channel)
+    return;
+  uint32 ap;
+  os_memcpy(&ap, bssid, 4);
+  const char *err = bootJournalAppend(BOOT_RECORD_WIFI_AP, flashRunningPartition(), ap);
+  if (err == NULL) err = bootJournalAppend(BOOT_RECORD_WIFI_CHAN, flashRunningPartition(),
+      bssid[4] | bssid[5] << 8 | channel << 16 | (uint32)journalCheck(ap) << 24);
+  if (err != NULL) DBG("Wifi cache: %s\n", err);
+  else DBG("Wifi cache: ch %d saved to flash\n", channel);
+}
+
+// The cached access point didn't answer. Only the RTC copy goes, the flash copy is replaced once
+// the station joins another access point or channel.
+void ICACHE_FLASH_ATTR wifiCacheForget(void) {
+  WifiCache cache;
+  os_memset(&cache, 0, sizeof(cache));
+  system_rtc_mem_write(RTC_MEM_WIFI_CACHE, &cache, sizeof(cache));
+}
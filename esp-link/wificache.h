@@ -0,0 +1,23 @@
+#ifndef WIFICACHE_H
+#define WIFICACHE_H
+
+#include <esp8266.h>
+
+// What the station needs to rejoin its access point without a scan and without DHCP. It is kept
+// in RTC memory, the access point also in the boot journal for after a power loss.
+typedef struct {
+  uint32 magic;
+  uint8  bssid[6];
+  uint8  channel;
+  uint8  flags;
+  uint32 ip, netmask, gw;           // the DHCP lease, 0 if there is none
+  uint32 checksum;
+} WifiCache;
+
+#define WIFI_CACHE_LEASE    0x01    // ip, netmask and gw hold a lease
+
+bool wifiCacheLoad(WifiCache *cache);
+void wifiCacheSave(const uint8 *bssid, uint8 channel, const struct ip_info *lease);
+void wifiCacheForget(void);
+
+#endif // WIFICACHE_H
@@ -0,0 +1,316 @@
+/*
+Runs a script of OTA steps against the firmware's flash code on the emulated esp8266. The
+script continues across the reboots it causes, so an upgrade, the boot into the new image and
+a rollback are one run. See FLASH.md for the commands.
+*/
+
+#include <esp8266.h>
+#include <getopt.h>
+#include "flashemu.h"
+#include "httpdemu.h"
+#include "cgiflash.h"
+#include "safeupgrade.h"
+#include "partitions.h"
+#include "otasession.h"
+#include "sectorhash.h"
+#include "announce.h"
+#include "mcastota.h"
+#include "tftpota.h"
+#include "serialota.h"
+#include "pullota.h"
+#include "serbridge.h"
+#include "uart.h"
+
+static const struct {
+  const char *url;
+  cgiSendCallback cgi;
+} urls[] = {
+  { "/flash/next", cgiGetFirmwareNext },
+  { "/flash/status", cgiUploadStatus },
+  { "/flash/sectors", cgiSectorHashes },
+  { "/flash/stats", cgiUploadStats },
+  { "/flash/partitions", cgiPartitions },
+  { "/flash/reboot", cgiRebootFirmware },
+  { "/flash/pull", cgiPullFirmware },
+  { "/data/info", cgiDataInfo },
+  { "/data/image", cgiDataImage },
+  { "/boot/health", cgiBootHealth },
+  { "/console/baud", cgiConsoleBaud },
+};
+
+static const char *signals[] = { "wifi", "httpd", "request", "heartbeat" };
+
+static uint32 rate;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: flashemu-user1 [-s state] [-r bytes/s] [-l loss%%] [-u pty] [-w] command...\n"
+      "  load <addr> <image>     write an image like esptool does\n"
+      "  upload <image>          POST firmware to /flash/upload\n"
+      "  update <image>          POST only the sectors /flash/sectors says differ\n"
+      "  data <image>            POST a data image to /data/upload\n"
+      "  bundle <file>[?args]    POST a bundle made by mkbundle to /flash/bundle\n"
+      "  reboot                  reboot into the uploaded firmware\n"
+      "  get <url>               GET one of the flash and boot urls\n"
+      "  post <url> <body>       POST to one of them\n"
+      "  signal <name>           report a boot health signal\n"
+      "  wait <ms>               let time pass\n"
+      "  listen <ms>             bring up the network and let real time pass, receiving UDP and TCP\n"
+      "  crash                   reset like the watchdog does\n"
+      "  cut <n>                 lose power during the nth flash write or erase from now\n"
+      "  wear, time              print erase counts and where the time went\n"
+      "-u links pty to the emulated UART0 for serflash and the serial bridge on TCP port 2323,\n"
+      "listen lets them talk.\n"
+      "An image is a file or <size>[:<seed>] for a generated firmware image.\n");
+  exit(2);
+}
+
+static cgiSendCallback findCgi(const char *url) {
+  for (int i = 0; i < sizeof(urls)/sizeof(urls[0]); i++) {
+    size_t n = strlen(urls[i].url);
+    if (strncmp(url, urls[i].url, n) == 0 && (url[n] == 0 || url[n] == '?')) return urls[i].cgi;
+  }
+  fprintf(stderr, "flashemu: unknown url %s\n", url);
+  exit(2);
+}
+
+// Read an image file, or generate firmware with a valid header and pseudo random content
+static uint8 *loadImage(const char *spec, uint32 *len) {
+  char *end;
+  uint32 size = strtoul(spec, &end, 0);
+  if (end != spec && (*end == 0 || *end == ':')) {
+    uint32 x = *end == ':' ? strtoul(end + 1, NULL, 0) : size;
+    uint8 *img = malloc(size + 4);
+    for (uint32 i = 0; i < size; i += 4) {
+      x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+      memcpy(img + i, &x, 4);
+    }
+    static const uint8 header[12] = { 0xea, 0x04, 0x00, 0x20, 0x04, 0x00, 0x10, 0x40 };
+    memcpy(img, header, size < sizeof(header) ? size : sizeof(header));
+    *len = size;
+    return img;
+  }
+
+  FILE *f = fopen(spec, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "flashemu: cannot read %s\n", spec);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  uint8 *img = malloc(*len + 4);
+  if (fread(img, 1, *len, f) != *len) *len = 0;
+  fclose(f);
+  return img;
+}
+
+static void imageDigest(const uint8 *img, uint32 len, uint8 *digest) {
+  md5_context_t ctx;
+  MD5Init(&ctx);
+  for (uint32 off = 0; off < len; off += 0x8000) {
+    MD5Update(&ctx, img + off, len - off < 0x8000 ? len - off : 0x8000);
+  }
+  MD5Final(digest, &ctx);
+}
+
+static void upload(cgiSendCallback cgi, const char *url, const char *spec) {
+  uint32 len;
+  uint8 *img = loadImage(spec, &len);
+  uint8 digest[OTA_DIGEST_LEN];
+  char headers[64] = "X-Image-Digest: ";
+  imageDigest(img, len, digest);
+  otaFormatDigest(digest, headers + strlen(headers));
+  emuRequest(cgi, url, headers, img, len, rate);
+  free(img);
+}
+
+// Upload the sectors whose hash differs from the image, like wiflash does: nothing if the
+// partition has the image already, otherwise the first request carries the map of the sectors
+// that match, at least one sector is always sent.
+static void update(const char *spec) {
+  uint32 len;
+  uint8 *img = loadImage(spec, &len);
+  uint32 sectors = (len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+  uint8 digest[OTA_DIGEST_LEN], *padded = malloc(sectors*SPI_FLASH_SEC_SIZE);
+  char hex[OTA_DIGEST_HEX_LEN + 1], map[sectors/4 + 3];
+  memset(padded, 0xff, sectors*SPI_FLASH_SEC_SIZE);
+  memcpy(padded, img, len);
+  imageDigest(img, len, digest);
+  otaFormatDigest(digest, hex);
+
+  char probe[64] = "If-None-Match: ";
+  strcat(probe, hex);
+  if (emuRequest(cgiUploadFirmware, "/flash/upload", probe, img, 0, rate) == 304) {
+    free(padded);
+    free(img);
+    return;
+  }
+  emuRequest(cgiSectorHashes, "/flash/sectors", "", NULL, 0, rate);
+  const char *hashes = emuResponse() != NULL ? strstr(emuResponse(), "\"hashes\":\"") : NULL;
+  uint8 same[sectors];
+  for (uint32 s = 0; s < sectors; s++) {
+    uint8 h[OTA_DIGEST_LEN];
+    char hx[OTA_DIGEST_HEX_LEN + 1];
+    imageDigest(padded + s*SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, h);
+    otaFormatDigest(h, hx);
+    same[s] = hashes != NULL && strlen(hashes + 10) >= (s + 1)*2*SECTOR_HASH_LEN &&
+        strncmp(hashes + 10 + s*2*SECTOR_HASH_LEN, hx, 2*SECTOR_HASH_LEN) == 0;
+  }
+  same[sectors - 1] = 0;
+  memset(map, 0, sizeof(map));
+  for (uint32 s = 0; s < sectors; s += 8) {
+    uint8 byte = 0;
+    for (int b = 0; b < 8 && s + b < sectors; b++) byte |= same[s + b] << b;
+    sprintf(map + s/4, "%02x", byte);
+  }
+
+  bool first = true;
+  for (uint32 s = 0; s < sectors; s++) {
+    if (same[s]) continue;
+    uint32 e = s;
+    while (e + 1 < sectors && !same[e + 1]) e++;
+    uint32 start = s*SPI_FLASH_SEC_SIZE, end = (e + 1)*SPI_FLASH_SEC_SIZE;
+    if (end > len) end = len;
+    char headers[256];
+    snprintf(headers, sizeof(headers), "X-Image-Digest: %s\nContent-Range: bytes %u-%u/%u\n%s%s",
+        hex, start, end - 1, len, first ? "X-Sector-Map: " : "", first ? map : "");
+      emuRequest(cgiUploadFirmware, "/flash/upload", headers, img + start, end - start, rate);
+    first = false;
+    s = e;
+  }
+  free(padded);
+  free(img);
+}
+
+// Like the request callback of esp-link/main.c
+static void requestCb(HttpdConnData *connData, int code) {
+  if (code > 0 && code < 500) bootHealthSignal(BOOT_SIGNAL_REQUEST);
+}
+
+// What esp-link/main.c does once the wifi is up, the station has 127.0.0.1
+static void networkUp(void) {
+  static bool up;
+  if (up) return;
+  up = true;
+  announceInit();
+  mcastOtaInit();
+  tftpOtaInit();
+  serialBridgeInit();
+  bootHealthSignal(BOOT_SIGNAL_WIFI);
+  announceReady();
+  mcastOtaJoin();
+}
+
+static int argCount(const char *cmd) {
+  static const char *cmds[] = { "load", "upload", "update", "data", "bundle", "reboot", "get", "post",
+    "signal", "wait", "listen", "crash", "cut", "wear", "time" };
+  static const int args[] = { 2, 1, 1, 1, 1, 0, 1, 2, 1, 1, 1, 0, 1, 0, 0 };
+  for (int i = 0; i < sizeof(cmds)/sizeof(cmds[0]); i++) {
+    if (strcmp(cmd, cmds[i]) == 0) return args[i];
+  }
+  fprintf(stderr, "flashemu: unknown command %s\n", cmd);
+  usage();
+  return 0;
+}
+
+static void run(char **argv) {
+  char *cmd = argv[0];
+  if (strcmp(cmd, "load") == 0) {
+    uint32 len;
+    uint8 *img = loadImage(argv[2], &len);
+    emuLoad(strtoul(argv[1], NULL, 0), img, len);
+    free(img);
+  } else if (strcmp(cmd, "upload") == 0) {
+    upload(cgiUploadFirmware, "/flash/upload", argv[1]);
+  } else if (strcmp(cmd, "update") == 0) {
+    update(argv[1]);
+  } else if (strcmp(cmd, "data") == 0) {
+    upload(cgiUploadData, "/data/upload", argv[1]);
+  } else if (strcmp(cmd, "bundle") == 0) {
+    char url[256];
+    const char *args = strchr(argv[1], '?');
+    snprintf(url, sizeof(url), "/flash/bundle%s", args != NULL ? args : "");
+    char *file = strndup(argv[1], args != NULL ? args - argv[1] : strlen(argv[1]));
+    uint32 len;
+    uint8 *img = loadImage(file, &len);
+    emuRequest(cgiUploadBundle, url, "", img, len, rate);
+    emuRunUntil(emuNow + 5000000); // a bundle with firmware reboots like /flash/reboot
+    free(img);
+    free(file);
+  } else if (strcmp(cmd, "reboot") == 0) {
+    emuRequest(cgiRebootFirmware, "/flash/reboot", "", NULL, 0, rate);
+    emuRunUntil(emuNow + 5000000); // the reboot happens 2s after the response
+  } else if (strcmp(cmd, "get") == 0) {
+    emuRequest(findCgi(argv[1]), argv[1], "", NULL, 0, rate);
+  } else if (strcmp(cmd, "post") == 0) {
+    emuRequest(findCgi(argv[1]), argv[1], "", (uint8 *)argv[2], strlen(argv[2]), rate);
+  } else if (strcmp(cmd, "signal") == 0) {
+    for (int i = 0; i < BOOT_SIGNALS; i++) {
+      if (strcmp(argv[1], signals[i]) == 0) bootHealthSignal(i);
+    }
+  } else if (strcmp(cmd, "wait") == 0) {
+    emuRunUntil(emuNow + strtoull(argv[1], NULL, 0)*1000);
+  } else if (strcmp(cmd, "listen") == 0) {
+    networkUp();
+    emuNetRun(strtoull(argv[1], NULL, 0));
+  } else if (strcmp(cmd, "crash") == 0) {
+    printf("*** crash\n");
+    emuReboot(REASON_WDT_RST);
+  } else if (strcmp(cmd, "cut") == 0) {
+    emuChip->cutAfter = atoi(argv[1]) - 1;
+  } else if (strcmp(cmd, "wear") == 0) {
+    emuPrintWear();
+  } else if (strcmp(cmd, "time") == 0) {
+    emuPrintTimes();
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *state = "flashemu.state", *pty = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "+s:r:l:u:w")) != -1) {
+    switch (c) {
+    case 's': state = optarg; break;
+    case 'r': rate = strtoul(optarg, NULL, 0); break;
+    case 'l': emuNetLoss = strtoul(optarg, NULL, 0); break;
+    case 'u': pty = optarg; break;
+    case 'w': emuTimings = &emuWorstCase; break;
+    default: usage();
+    }
+  }
+  if (optind >= argc) usage();
+  for (int i = optind; i < argc; i += 1 + argCount(argv[i])) {
+    if (i + argCount(argv[i]) >= argc) usage();
+  }
+
+  emuArgv = argv;
+  if (!emuOpen(state)) {
+    fprintf(stderr, "flashemu: cannot open %s\n", state);
+    return 1;
+  }
+  // a reboot continues the script, anything else starts it
+  if (getenv("FLASHEMU_REBOOT") == NULL) emuChip->pc = optind;
+  emuBoot();
+  if (pty != NULL && !emuUartOpen(pty)) {
+    fprintf(stderr, "flashemu: cannot create %s\n", pty);
+    return 1;
+  }
+
+  // what esp-link/main.c does on every boot
+  httpdSetRequestCb(requestCb);
+  cgiFlashCheckUpgradeHealthy();
+  bootHealthSignal(BOOT_SIGNAL_HTTPD);
+  if (pty != NULL) {
+    uart_init(SERIAL_OTA_BAUD);
+    serialOtaInit();
+  }
+
+  while (emuChip->pc < argc) {
+    char **cmd = argv + emuChip->pc;
+    emuChip->pc += 1 + argCount(cmd[0]);
+    run(cmd);
+  }
+  emuChip->elapsed += emuNow;
+  emuChip->resetReason = REASON_DEFAULT_RST;
+  return 0;
+}
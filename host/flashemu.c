@@ -0,0 +1,457 @@
+/*
+Host emulation of the parts of the esp8266 and its SDK the flash code uses: a NOR flash with
+timing, wear and power loss models, the RTC memory, the boot loader's upgrade flag and image
+selection, reset reasons, and software timers and tasks on a virtual clock.
+*/
+
+#include <esp8266.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "flashemu.h"
+
+#define EMU_MAGIC           0x554d4546 // "FEMU"
+#define EMU_PAGE_SIZE       256
+#define IMAGE_BASE          0x40200000
+
+EmuChip *emuChip;
+uint64 emuNow;
+char **emuArgv;
+uint8 emuMac[6] = { 0x5c, 0xcf, 0x7f };
+
+const EmuTimings emuTypical = { 45000, 700, 30, 3, 5, 26 };
+const EmuTimings emuWorstCase = { 400000, 3000, 50, 12, 5, 26 };
+const EmuTimings *emuTimings = &emuTypical;
+
+static struct rst_info rstInfo;
+static ETSTimer *timers;       // armed timers, soonest first
+static struct {
+  ETSTask task;
+  ETSEvent *queue;
+  uint8 len, posted;           // size of the event queue and events in it
+} tasks[USER_TASK_PRIO_MAX];
+static uint8 osPrint = 1;
+
+extern uint32 _irom0_text_start;
+
+//===== Chip state
+
+// Map the chip state from a file, a new file starts with erased flash and boots user1
+bool emuOpen(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+  struct stat st;
+  bool fresh = fstat(fd, &st) == 0 && st.st_size != sizeof(EmuChip);
+  if (fresh && ftruncate(fd, sizeof(EmuChip)) != 0) {
+    close(fd);
+    return false;
+  }
+  // chips with different state files have different MAC addresses
+  uint32 h = 2166136261u;
+  for (const char *p = path; *p != 0; p++) h = (h ^ (uint8)*p) * 16777619u;
+  memcpy(emuMac + 3, &h, 3);
+
+  emuChip = mmap(NULL, sizeof(EmuChip), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (emuChip == MAP_FAILED) return false;
+
+  if (fresh || emuChip->magic != EMU_MAGIC) {
+    memset(emuChip, 0, sizeof(EmuChip));
+    memset(emuChip->flash, 0xff, sizeof(emuChip->flash));
+    emuChip->magic = EMU_MAGIC;
+    emuChip->bootAddr = 0x1000;
+    emuChip->cutAfter = -1;
+    emuChip->resetReason = REASON_DEFAULT_RST;
+  }
+  return true;
+}
+
+// Flash address of the image this binary was linked for
+uint32 emuImageAddr(void) {
+  return ((uint32)(uintptr_t)&_irom0_text_start - IMAGE_BASE) & ~(SPI_FLASH_SEC_SIZE - 1);
+}
+
+// What the boot loader does: start the image it is configured for, which may be the other build
+void emuBoot(void) {
+  if (emuChip->bootAddr != emuImageAddr()) emuReboot(emuChip->resetReason);
+  emuChip->boots++;
+  rstInfo.reason = emuChip->resetReason;
+  // a reset without a cause is what it looks like when the process just ends
+  emuChip->resetReason = REASON_EXT_SYS_RST;
+  emuNow = 0;
+  printf("--- boot %d: user%d.bin at 0x%x, reset reason %d\n", emuChip->boots,
+      emuChip->bootAddr == 0x1000 ? 1 : 2, emuChip->bootAddr, rstInfo.reason);
+}
+
+// Restart the chip: the process is replaced by the build of the image the boot loader starts
+void emuReboot(uint8 reason) {
+  emuChip->resetReason = reason;
+  emuChip->elapsed += emuNow;
+  msync(emuChip, sizeof(EmuChip), MS_SYNC);
+  fflush(stdout);
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s", emuArgv[0]);
+  char *p = strstr(path, "user");
+  if (p == NULL || (p[4] != '1' && p[4] != '2')) {
+    fprintf(stderr, "flashemu: can't derive the other image's binary from %s\n", path);
+    exit(1);
+  }
+  if (emuChip->bootAddr != 0x1000 && emuChip->bootAddr != USER2_BIN_SPI_FLASH_ADDR) {
+    fprintf(stderr, "flashemu: no image to boot at 0x%x\n", emuChip->bootAddr);
+    exit(1);
+  }
+  p[4] = emuChip->bootAddr == 0x1000 ? '1' : '2';
+  setenv("FLASHEMU_REBOOT", "1", 1);
+  execv(path, emuArgv);
+  fprintf(stderr, "flashemu: exec %s failed\n", path);
+  exit(1);
+}
+
+// The power fails in the middle of a flash operation. The RTC memory loses its content, the
+// flash keeps what made it so far.
+static void powerLoss(const char *op, uint32 address) {
+  printf("*** power lost during %s at 0x%x after %lluus\n", op, address,
+      (unsigned long long)emuNow);
+  emuChip->cutAfter = -1;
+  memset(emuChip->rtc, 0, sizeof(emuChip->rtc));
+  emuReboot(REASON_DEFAULT_RST);
+}
+
+// Counts down to the armed power loss, returns true if it hits this operation
+static bool powerCut(void) {
+  if (emuChip->cutAfter < 0) return false;
+  return emuChip->cutAfter-- == 0;
+}
+
+static void account(EmuOpStats *st, uint32 bytes, uint32 time) {
+  st->ops++;
+  st->bytes += bytes;
+  st->time += time;
+  emuNow += time;
+}
+
+//===== SPI flash
+
+// The SDK checks addresses against the size of the map, the chip ignores the bits above its own
+// size. False if the range is outside the map or runs over the end of the chip.
+static bool chipAddr(uint32 *address, uint32 size) {
+  if (*address + size > EMU_MAP_SIZE || *address + size < *address) return false;
+  *address %= EMU_FLASH_SIZE;
+  return *address + size <= EMU_FLASH_SIZE;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+  if (sec >= EMU_MAP_SIZE / SPI_FLASH_SEC_SIZE) return SPI_FLASH_RESULT_ERR;
+  sec %= EMU_SECTORS;
+  uint8 *p = emuChip->flash + sec*SPI_FLASH_SEC_SIZE;
+  if (powerCut()) {
+    memset(p, 0xff, SPI_FLASH_SEC_SIZE/2);
+    emuNow += emuTimings->sectorErase/2;
+    powerLoss("erase", sec*SPI_FLASH_SEC_SIZE);
+  }
+  memset(p, 0xff, SPI_FLASH_SEC_SIZE);
+  emuChip->eraseCount[sec]++;
+  account(&emuChip->erases, SPI_FLASH_SEC_SIZE, emuTimings->sectorErase);
+  return SPI_FLASH_RESULT_OK;
+}
+
+// NOR flash programming can only clear bits, raising one takes an erase of the sector
+static void program(uint32 address, const uint8 *data, uint32 len) {
+  bool raised = false;
+  for (uint32 i = 0; i < len; i++) {
+    uint8 *p = &emuChip->flash[address + i];
+    if (data[i] & ~*p) raised = true;
+    *p &= data[i];
+  }
+  if (raised) {
+    emuChip->violations++;
+    printf("*** flash write raises bits in 0x%x-0x%x\n", address, address + len);
+  }
+}
+
+// Programming time, page by page
+static uint32 programTime(uint32 address, uint32 len) {
+  uint32 time = 0;
+  while (len > 0) {
+    uint32 n = EMU_PAGE_SIZE - address % EMU_PAGE_SIZE;
+    if (n > len) n = len;
+    uint32 t = emuTimings->firstByte + (n - 1)*emuTimings->nextByte;
+    time += t < emuTimings->pageProgram ? t : emuTimings->pageProgram;
+    address += n;
+    len -= n;
+  }
+  return time;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+  if (des_addr % 4 != 0 || size % 4 != 0 || (uintptr_t)src_addr % 4 != 0) {
+    emuChip->violations++;
+    printf("*** unaligned flash write of %d bytes to 0x%x\n", size, des_addr);
+    return SPI_FLASH_RESULT_ERR;
+  }
+  if (!chipAddr(&des_addr, size)) return SPI_FLASH_RESULT_ERR;
+  if (powerCut()) {
+    uint32 part = size/2 & ~3;
+    program(des_addr, (uint8 *)src_addr, part);
+    emuNow += programTime(des_addr, part);
+    powerLoss("write", des_addr + part);
+  }
+  program(des_addr, (uint8 *)src_addr, size);
+  account(&emuChip->writes, size, programTime(des_addr, size));
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+  if (!chipAddr(&src_addr, size)) return SPI_FLASH_RESULT_ERR;
+  memcpy(des_addr, emuChip->flash + src_addr, size);
+  account(&emuChip->reads, size, emuTimings->readSetup + (size*emuTimings->readPerKB + 1023)/1024);
+  return SPI_FLASH_RESULT_OK;
+}
+
+uint32 spi_flash_get_id(void) {
+  return 0x1540ef; // Winbond W25Q16
+}
+
+// Write an image like esptool does over the serial port, this is not accounted
+void emuLoad(uint32 address, const uint8 *data, uint32 len) {
+  for (uint32 a = address & ~(SPI_FLASH_SEC_SIZE - 1); a < address + len; a += SPI_FLASH_SEC_SIZE) {
+    memset(emuChip->flash + a, 0xff, SPI_FLASH_SEC_SIZE);
+  }
+  memcpy(emuChip->flash + address, data, len);
+}
+
+// Erase counts, and the most worn sectors
+void emuPrintWear(void) {
+  uint32 total = 0, used = 0, shown[8];
+  int n = 0;
+  for (int i = 0; i < EMU_SECTORS; i++) {
+    total += emuChip->eraseCount[i];
+    if (emuChip->eraseCount[i] > 0) used++;
+  }
+  printf("wear: %d erases in %d sectors\n", total, used);
+  while (n < 8) {
+    int max = -1;
+    for (int i = 0; i < EMU_SECTORS; i++) {
+      bool seen = false;
+      for (int j = 0; j < n; j++) seen |= shown[j] == i;
+      if (!seen && emuChip->eraseCount[i] > 0 &&
+          (max < 0 || emuChip->eraseCount[i] > emuChip->eraseCount[max])) max = i;
+    }
+    if (max < 0) break;
+    shown[n++] = max;
+    printf("  sector 0x%x: %d erases\n", max*SPI_FLASH_SEC_SIZE, emuChip->eraseCount[max]);
+  }
+}
+
+void emuPrintTimes(void) {
+  const EmuOpStats *st[] = { &emuChip->reads, &emuChip->writes, &emuChip->erases };
+  const char *names[] = { "read", "write", "erase" };
+  printf("time: %lluus this boot, %lluus in total\n", (unsigned long long)emuNow,
+      (unsigned long long)(emuChip->elapsed + emuNow));
+  for (int i = 0; i < 3; i++) {
+    printf("  %-5s %6d ops %9llu bytes %9lluus\n", names[i], st[i]->ops,
+        (unsigned long long)st[i]->bytes, (unsigned long long)st[i]->time);
+  }
+  if (emuChip->violations > 0) printf("  %d flash write violations\n", emuChip->violations);
+}
+
+//===== Timers
+
+void ets_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *parg) {
+  t->timer_func = fn;
+  t->timer_arg = parg;
+}
+
+void ets_timer_disarm(ETSTimer *a) {
+  for (ETSTimer **p = &timers; *p != NULL; p = &(*p)->timer_next) {
+    if (*p == a) {
+      *p = a->timer_next;
+      break;
+    }
+  }
+  a->timer_next = NULL;
+}
+
+// The expiry time is kept in ms since boot, the virtual clock only goes up to 49 days
+static void timerInsert(ETSTimer *a) {
+  ETSTimer **p = &timers;
+  while (*p != NULL && (*p)->timer_expire <= a->timer_expire) p = &(*p)->timer_next;
+  a->timer_next = *p;
+  *p = a;
+}
+
+void ets_timer_arm_new(ETSTimer *a, int b, int c, int isMstimer) {
+  ets_timer_disarm(a);
+  uint32 ms = isMstimer ? b : (b + 999)/1000;
+  a->timer_expire = emuNow/1000 + ms;
+  a->timer_period = c ? ms : 0;
+  timerInsert(a);
+}
+
+static void timerFire(void) {
+  ETSTimer *t = timers;
+  timers = t->timer_next;
+  t->timer_next = NULL;
+  if (emuNow < t->timer_expire*1000ULL) emuNow = t->timer_expire*1000ULL;
+  if (t->timer_period > 0) {
+    t->timer_expire += t->timer_period;
+    timerInsert(t);
+  }
+  t->timer_func(t->timer_arg);
+}
+
+// When the next timer expires, us
+uint64 emuNextTimer(void) {
+  return timers != NULL ? timers->timer_expire*1000ULL : ~0ULL;
+}
+
+// Advance the virtual clock, firing the timers that expire on the way. Posted tasks run while
+// the clock is before time, overdue timers go first.
+void emuRunUntil(uint64 time) {
+  for (;;) {
+    if (timers != NULL && timers->timer_expire*1000ULL <= emuNow) timerFire();
+    else if (emuNow < time && emuRunTask()) ;
+    else if (timers != NULL && timers->timer_expire*1000ULL <= time) timerFire();
+    else break;
+  }
+  if (emuNow < time) emuNow = time;
+}
+
+//===== Tasks
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen) {
+  if (prio >= USER_TASK_PRIO_MAX || tasks[prio].task != NULL || qlen == 0) return false;
+  tasks[prio].task = task;
+  tasks[prio].queue = queue;
+  tasks[prio].len = qlen;
+  return true;
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par) {
+  if (prio >= USER_TASK_PRIO_MAX || tasks[prio].task == NULL) return false;
+  if (tasks[prio].posted == tasks[prio].len) return false;
+  tasks[prio].queue[tasks[prio].posted++] = (os_event_t){ sig, par };
+  return true;
+}
+
+// Run the first event of the highest priority task that has one, false if there is none
+bool emuRunTask(void) {
+  for (int prio = USER_TASK_PRIO_MAX - 1; prio >= 0; prio--) {
+    if (tasks[prio].posted == 0) continue;
+    os_event_t e = tasks[prio].queue[0];
+    memmove(tasks[prio].queue, tasks[prio].queue + 1, --tasks[prio].posted*sizeof(os_event_t));
+    tasks[prio].task(&e);
+    return true;
+  }
+  return false;
+}
+
+//===== System
+
+uint32 system_get_time(void) {
+  return (uint32)emuNow;
+}
+
+struct rst_info *system_get_rst_info(void) {
+  return &rstInfo;
+}
+
+enum flash_size_map system_get_flash_size_map(void) {
+  return EMU_FLASH_MAP;
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size) {
+  if (src_addr < 64 || src_addr*4 + load_size > EMU_RTC_SIZE) return false;
+  memcpy(des_addr, emuChip->rtc + src_addr*4, load_size);
+  return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size) {
+  if (des_addr < 64 || des_addr*4 + save_size > EMU_RTC_SIZE) return false;
+  memcpy(emuChip->rtc + des_addr*4, src_addr, save_size);
+  return true;
+}
+
+void system_upgrade_flag_set(uint8 flag) {
+  emuChip->upgradeFlag = flag;
+}
+
+uint8 system_upgrade_flag_check(void) {
+  return emuChip->upgradeFlag;
+}
+
+uint8 system_upgrade_userbin_check(void) {
+  return emuImageAddr() == 0x1000 ? UPGRADE_FW_BIN1 : UPGRADE_FW_BIN2;
+}
+
+// Boot the other image if the upgrade has been flagged as finished. The SDK rewrites the boot
+// loader config sector with the new selection, which clears what follows the config.
+void system_upgrade_reboot(void) {
+  if (emuChip->upgradeFlag == UPGRADE_FLAG_FINISH) {
+    emuChip->bootAddr = emuImageAddr() == 0x1000 ? USER2_BIN_SPI_FLASH_ADDR : 0x1000;
+    memset(emuChip->flash + BOOTLOADER_CONFIG_ADDR + 0x100, 0xff, SPI_FLASH_SEC_SIZE - 0x100);
+    emuChip->eraseCount[BOOTLOADER_CONFIG_ADDR / SPI_FLASH_SEC_SIZE]++;
+  }
+  emuChip->upgradeFlag = UPGRADE_FLAG_IDLE;
+  emuReboot(REASON_SOFT_RESTART);
+}
+
+bool system_restart_enhance(uint8 bin_type, uint32 bin_addr) {
+  if (bin_addr != 0x1000 && bin_addr != USER2_BIN_SPI_FLASH_ADDR) return false;
+  emuChip->bootAddr = bin_addr;
+  emuChip->upgradeFlag = UPGRADE_FLAG_IDLE;
+  emuReboot(REASON_SOFT_RESTART);
+  return true;
+}
+
+void system_restart(void) {
+  emuReboot(REASON_SOFT_RESTART);
+}
+
+void system_soft_wdt_feed(void) {
+}
+
+void system_set_os_print(uint8 onoff) {
+  osPrint = onoff;
+}
+
+uint8 system_get_os_print(void) {
+  return osPrint;
+}
+
+int os_printf_plus(const char *format, ...) {
+  if (!osPrint) return 0;
+  va_list ap;
+  va_start(ap, format);
+  int n = vprintf(format, ap);
+  va_end(ap);
+  return n;
+}
+
+//===== ROM and libc
+
+int ets_sprintf(char *str, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  int n = vsprintf(str, format, ap);
+  va_end(ap);
+  return n;
+}
+
+int ets_memcmp(const void *s1, const void *s2, size_t n) { return memcmp(s1, s2, n); }
+void *ets_memcpy(void *dest, const void *src, size_t n) { return memcpy(dest, src, n); }
+void *ets_memmove(void *dest, const void *src, size_t n) { return memmove(dest, src, n); }
+void *ets_memset(void *s, int c, size_t n) { return memset(s, c, n); }
+int ets_strcmp(const char *s1, const char *s2) { return strcmp(s1, s2); }
+char *ets_strcpy(char *dest, const char *src) { return strcpy(dest, src); }
+size_t ets_strlen(const char *s) { return strlen(s); }
+int ets_strncmp(const char *s1, const char *s2, int len) { return strncmp(s1, s2, len); }
+char *ets_strncpy(char *dest, const char *src, size_t n) { return strncpy(dest, src, n); }
+char *ets_strstr(const char *haystack, const char *needle) { return strstr(haystack, needle); }
+
+void *pvPortMalloc(size_t xWantedSize, char *file, int line) { return malloc(xWantedSize); }
+void *pvPortZalloc(size_t size, char *file, int line) { return calloc(1, size); }
+void vPortFree(void *ptr, char *file, int line) { free(ptr); }
@@ -0,0 +1,73 @@
+#ifndef FLASHEMU_H
+#define FLASHEMU_H
+
+#include <esp8266.h>
+
+// Everything that survives a reboot of the emulated esp8266 lives in the chip state, which is
+// mapped from a file: the flash content, the RTC memory, the boot loader's choice of image and
+// the counters of the timing and wear model. Each boot is a process of its own, so the static
+// state of the firmware starts out fresh like on the real chip.
+// The 2MB build declares a 4MB map, addresses past the end of the chip wrap around onto its start
+#define EMU_FLASH_SIZE      (2*1024*1024)
+#define EMU_FLASH_MAP       FLASH_SIZE_32M_MAP_512_512
+#define EMU_MAP_SIZE        (4*1024*1024)
+#define EMU_SECTORS         (EMU_FLASH_SIZE / SPI_FLASH_SEC_SIZE)
+#define EMU_RTC_SIZE        768
+
+typedef struct {
+  uint32 ops;                 // number of operations
+  uint64 bytes;
+  uint64 time;                // modelled time spent in them, us
+} EmuOpStats;
+
+typedef struct {
+  uint32 magic;
+  uint32 bootAddr;            // image the boot loader starts
+  uint8  upgradeFlag;         // system_upgrade_flag_set()
+  uint8  resetReason;         // reported by system_get_rst_info() on the next boot
+  uint16 reserved;
+  uint32 boots;
+  uint32 pc;                  // index of the next script command in argv
+  int32  cutAfter;            // flash writes and erases left until the power fails, -1 if none
+  uint32 violations;          // writes that tried to raise bits or were misaligned
+  uint64 elapsed;             // time of the previous boots, us
+  EmuOpStats reads, writes, erases;
+  uint32 eraseCount[EMU_SECTORS];
+  uint8  rtc[EMU_RTC_SIZE];
+  uint8  flash[EMU_FLASH_SIZE];
+} EmuChip;
+
+// Timings of the flash chip in us, typical and worst case values of a Winbond W25Q16/W25Q32
+typedef struct {
+  uint32 sectorErase;         // tSE
+  uint32 pageProgram;         // tPP, programming a whole 256 byte page
+  uint32 firstByte;           // tBP1
+  uint32 nextByte;            // tBP2, per additional byte of a partial page
+  uint32 readSetup;           // command and address phase of a read
+  uint32 readPerKB;           // data phase of a read at 80MHz QIO
+} EmuTimings;
+
+extern EmuChip *emuChip;
+extern uint64 emuNow;         // time since boot, us
+extern char **emuArgv;        // command line, a reboot runs it again
+extern const EmuTimings *emuTimings;
+extern const EmuTimings emuTypical, emuWorstCase;
+extern uint8 emuMac[6];       // station MAC, derived from the name of the state file
+extern uint32 emuNetLoss;     // percentage of the received UDP packets that get lost
+
+bool emuOpen(const char *path);
+uint32 emuImageAddr(void);
+void emuBoot(void);
+void emuReboot(uint8 reason);
+void emuRunUntil(uint64 time);
+bool emuRunTask(void);
+uint64 emuNextTimer(void);
+void emuNetRun(uint64 ms);
+bool emuUartOpen(const char *path);
+int emuUartFd(void);
+void emuUartReceive(void);
+void emuLoad(uint32 address, const uint8 *data, uint32 len);
+void emuPrintWear(void);
+void emuPrintTimes(void);
+
+#endif // FLASHEMU_H
@@ -0,0 +1,170 @@
+/*
+Host stand-in for the http server: runs a request through a cgi function the way httpd.c does,
+with the POST body in 1KB chunks, and prints the response. The time the chunks take to arrive
+follows a simple network model: the sender streams at a fixed rate but has at most two chunks
+in flight that the esp8266 hasn't processed yet, which is about what its TCP window allows.
+Tasks posted by the firmware run while it waits for the next chunk.
+*/
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "flashemu.h"
+#include "httpdemu.h"
+
+#define MAX_POST    1024
+#define IN_FLIGHT   2
+
+struct HttpdPriv {
+  const char *headers;    // "Name: value\n" lines
+  int code;
+  char *body;
+  int bodyLen;
+  int result;             // what the cgi returned last
+  bool held;              // httpdRecvHold
+};
+
+static httpdRequestCallback requestCb;
+static char *lastBody;
+
+void httpdSetRequestCb(httpdRequestCallback cb) {
+  requestCb = cb;
+}
+
+void httpdStartResponse(HttpdConnData *conn, int code) {
+  conn->priv->code = code;
+}
+
+void httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
+}
+
+void httpdEndHeaders(HttpdConnData *conn) {
+}
+
+int httpdSend(HttpdConnData *conn, const char *data, int len) {
+  HttpdPriv *priv = conn->priv;
+  if (len < 0) len = strlen(data);
+  priv->body = realloc(priv->body, priv->bodyLen + len + 1);
+  memcpy(priv->body + priv->bodyLen, data, len);
+  priv->bodyLen += len;
+  priv->body[priv->bodyLen] = 0;
+  return 1;
+}
+
+void httpdContinue(HttpdConnData *conn) {
+  if (conn->cgi == NULL) return;
+  conn->priv->result = conn->cgi(conn);
+  if (conn->priv->result == HTTPD_CGI_DONE) conn->cgi = NULL;
+}
+
+void httpdRecvHold(HttpdConnData *conn, bool hold) {
+  conn->priv->held = hold;
+}
+
+int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+  const char *p = conn->priv->headers;
+  size_t n = strlen(header);
+  while (p != NULL && *p != 0) {
+    if (strncmp(p, header, n) == 0 && p[n] == ':') {
+      p += n + 1;
+      while (*p == ' ') p++;
+      while (*p != 0 && *p != '\n' && retLen > 1) {
+        *ret++ = *p++;
+        retLen--;
+      }
+      *ret = 0;
+      return 1;
+    }
+    p = strchr(p, '\n');
+    if (p != NULL) p++;
+  }
+  return 0;
+}
+
+int httpdFindArg(char *line, char *arg, char *buff, int buffLen) {
+  size_t n = strlen(arg);
+  char *p = line;
+  while (p != NULL && *p != 0) {
+    if (strncmp(p, arg, n) == 0 && p[n] == '=') {
+      p += n + 1;
+      char *e = strchr(p, '&');
+      int len = e != NULL ? e - p : (int)strlen(p);
+      if (len >= buffLen) len = buffLen - 1;
+      memcpy(buff, p, len);
+      buff[len] = 0;
+      return len;
+    }
+    p = strchr(p, '&');
+    if (p != NULL) p++;
+  }
+  return -1;
+}
+
+// Body of the response to the last request, NULL if there was none
+const char *emuResponse(void) {
+  return lastBody;
+}
+
+// Run a request through a cgi function, returns the status code. Rate is the speed of the
+// network in bytes per second, 0 for a network that never keeps the esp8266 waiting.
+int emuRequest(cgiSendCallback cgi, const char *url, const char *headers, const uint8 *body,
+    int len, uint32 rate) {
+  static struct espconn conn;
+  HttpdPriv priv = { headers, 200, NULL, 0, HTTPD_CGI_MORE, false };
+  HttpdPostData post = { 0 };
+  char path[256];
+  snprintf(path, sizeof(path), "%s", url);
+  char *args = strchr(path, '?');
+  if (args != NULL) *args++ = 0;
+  HttpdConnData c = { .conn = &conn, .startTime = system_get_time(), .url = path,
+    .getArgs = args, .priv = &priv, .cgi = cgi, .post = &post,
+    .requestType = body != NULL ? HTTPD_METHOD_POST : HTTPD_METHOD_GET };
+  uint64 start = emuNow;
+
+  int r;
+  if (body == NULL || len == 0) {
+    while ((r = cgi(&c)) == HTTPD_CGI_MORE) ;
+  } else {
+    post.len = len;
+    post.buffSize = len < MAX_POST ? len : MAX_POST;
+    post.buff = malloc(post.buffSize + 1);
+    uint64 arrived = emuNow, done[IN_FLIGHT] = { emuNow, emuNow };
+    r = HTTPD_CGI_MORE;
+    for (int i = 0; r == HTTPD_CGI_MORE && post.received < len; i++) {
+      int n = len - post.received < post.buffSize ? len - post.received : post.buffSize;
+      // nothing is delivered to a held connection, it starts over once receiving resumes
+      if (priv.held) {
+        while (priv.held && emuRunTask()) ;
+        if (arrived < emuNow) arrived = emuNow;
+      }
+      // the chunk can only be sent once the window has room for it
+      uint64 sendable = done[i % IN_FLIGHT] > arrived ? done[i % IN_FLIGHT] : arrived;
+      arrived = sendable + (rate > 0 ? (uint64)n*1000000/rate : 0);
+      emuRunUntil(arrived);
+      memcpy(post.buff, body + post.received, n);
+      post.buff[n] = 0;
+      post.buffLen = n;
+      post.received += n;
+      r = priv.result = cgi(&c);
+      done[i % IN_FLIGHT] = emuNow;
+    }
+    // the cgi may wait for background work, which continues the request once it's done
+    while (r == HTTPD_CGI_MORE && post.received == len && emuRunTask()) r = priv.result;
+    if (r == HTTPD_CGI_MORE) {
+      // the cgi wants more than there is, httpd drops such a connection
+      c.conn = NULL;
+      cgi(&c);
+      priv.code = 0;
+    }
+    free(post.buff);
+  }
+
+  printf("%s %s: %d in %lluus\n", body != NULL ? "POST" : "GET", url, priv.code,
+      (unsigned long long)(emuNow - start));
+  if (priv.body != NULL) {
+    printf("%s%s", priv.body, priv.bodyLen > 0 && priv.body[priv.bodyLen - 1] == '\n' ? "" : "\n");
+  }
+  free(lastBody);
+  lastBody = priv.body;
+  if (requestCb != NULL) requestCb(&c, priv.code);
+  return priv.code;
+}
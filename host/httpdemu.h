@@ -0,0 +1,10 @@
+#ifndef HTTPDEMU_H
+#define HTTPDEMU_H
+
+#include "httpd.h"
+
+int emuRequest(cgiSendCallback cgi, const char *url, const char *headers, const uint8 *body,
+    int len, uint32 rate);
+const char *emuResponse(void);
+
+#endif // HTTPDEMU_H
@@ -0,0 +1,282 @@
+/*
+Turn the binary log records of esp-link/binlog.c back into text, with the format strings the
+firmware build wrote to firmware/logfmt.bin. The records come from the device's /log, which is
+polled, or from its serial console, where the text in between them is passed through as is.
+*/
+
+#include <c_types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// esp-link/binlog.h
+#define BINLOG_FRAME        'L'
+#define BINLOG_MAGIC        0x474f4c42
+#define BINLOG_RING_WORDS   512
+
+#define POLL_MS   500
+
+static char *table;
+static uint32 tableLen;
+static uint32 expected = ~0;   // seq of the next record, to notice lost ones
+
+static void usage(void) {
+  fprintf(stderr, "Usage: logdump [-1] logfmt.bin host[:port]\n"
+      "       logdump -s [-b baud] logfmt.bin port\n"
+      "Print the log records of the device, from its /log or its serial console.\n"
+      "  -1      print what /log has and stop, instead of following it\n"
+      "  -s      read the serial console, other output is printed as it comes\n"
+      "  -b N    baud rate of the console (115200)\n");
+  exit(2);
+}
+
+static bool loadTable(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return false;
+  fseek(f, 0, SEEK_END);
+  tableLen = ftell(f);
+  rewind(f);
+  table = malloc(tableLen + 1);
+  bool ok = table != NULL && fread(table, 1, tableLen, f) == tableLen;
+  fclose(f);
+  if (ok) table[tableLen] = 0;
+  return ok;
+}
+
+// Format a record of words words like the device's os_printf would have
+static void printRecord(uint32 seq, const uint32 *rec, uint32 words) {
+  // an earlier seq is a device that rebooted
+  if (expected != ~0 && seq > expected) printf("-- %u words of records lost --\n", seq - expected);
+  expected = seq + words;
+
+  uint32 id = rec[0] >> 8, n = 2;
+  printf("%10.6f ", rec[1] / 1e6);
+  if (id >= tableLen) {
+    printf("unknown format %u, is logfmt.bin from this build?\n", id);
+    return;
+  }
+  char out[1024];
+  int len = 0;
+  for (const char *f = table + id; *f != 0 && len < sizeof(out) - 64; f++) {
+    if (*f != '%') {
+      out[len++] = *f;
+      continue;
+    }
+    // flags, width and precision carry over, the length modifiers don't: all args are 32 bit
+    char spec[16] = "%";
+    int s = 1;
+    f++;
+    while (*f != 0 && strchr("-+ #0123456789.", *f) != NULL && s < 10) spec[s++] = *f++;
+    while (*f == 'l' || *f == 'h') f++;
+    if (*f == 0) break;
+    if (*f == '%') {
+      out[len++] = '%';
+      continue;
+    }
+    uint32 arg = n < words ? rec[n] : 0;
+    n++;
+    if (*f == 's') {
+      char str[64] = "";
+      uint32 strLen = arg < sizeof(str) ? arg : sizeof(str) - 1;
+      if (n + (strLen + 3)/4 <= words) memcpy(str, rec + n, strLen);
+      str[strLen] = 0;
+      n += (arg + 3)/4;
+      spec[s++] = 's';
+      len += snprintf(out + len, sizeof(out) - len, spec, str);
+    } else if (*f == 'p') {
+      len += snprintf(out + len, sizeof(out) - len, "0x%08x", arg);
+    } else {
+      spec[s++] = *f;
+      if (*f == 'd' || *f == 'i') len += snprintf(out + len, sizeof(out) - len, spec, (int)arg);
+      else len += snprintf(out + len, sizeof(out) - len, spec, arg);
+    }
+  }
+  // one line per record, whatever newlines the format has
+  while (len > 0 && (out[len - 1] == '\n' || out[len - 1] == '\r')) len--;
+  int start = 0;
+  while (start < len && out[start] == '\n') start++;
+  printf("%.*s\n", len - start, out + start);
+}
+
+// Print the records of a /log response, returns the seq to ask for next
+static uint32 printResponse(const uint8 *body, uint32 len, uint32 since) {
+  uint32 hdr[3];
+  if (len < sizeof(hdr)) return since;
+  memcpy(hdr, body, sizeof(hdr));
+  if (hdr[0] != BINLOG_MAGIC) {
+    fprintf(stderr, "logdump: not a log response\n");
+    exit(1);
+  }
+  // the device rebooted, its seq starts over
+  if (hdr[1] < since) expected = ~0;
+  if (expected == ~0 && since != 0) expected = since;
+  const uint32 *rec = (const uint32 *)(body + sizeof(hdr));
+  uint32 words = (len - sizeof(hdr)) / 4, seq = hdr[1];
+  for (uint32 i = 0; i < words; ) {
+    uint32 n = rec[i] & 0xff;
+    if (n < 2 || i + n > words) break;
+    printRecord(seq, rec + i, n);
+    seq += n;
+    i += n;
+  }
+  fflush(stdout);
+  return hdr[2];
+}
+
+// GET path from host, returns the length of the body in buf or -1
+static int httpGet(const char *host, const char *port, const char *path, uint8 *buf, int max) {
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) return -1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    freeaddrinfo(ai);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  freeaddrinfo(ai);
+  char req[256];
+  int reqLen = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host);
+  if (write(fd, req, reqLen) != reqLen) {
+    close(fd);
+    return -1;
+  }
+  int len = 0, n;
+  while (len < max && (n = read(fd, buf + len, max - len)) > 0) len += n;
+  close(fd);
+  int end = 0;
+  while (end + 4 <= len && memcmp(buf + end, "\r\n\r\n", 4) != 0) end++;
+  if (end + 4 > len || strncmp((char *)buf, "HTTP/1.", 7) != 0 ||
+      strncmp((char *)buf + 9, "200", 3) != 0) return -1;
+  uint8 *body = buf + end + 4;
+  len -= body - buf;
+  memmove(buf, body, len);
+  return len;
+}
+
+static int followHttp(const char *target, bool once) {
+  char host[128], *port = "80";
+  snprintf(host, sizeof(host), "%s", target);
+  char *colon = strchr(host, ':');
+  if (colon != NULL) {
+    *colon = 0;
+    port = colon + 1;
+  }
+  uint8 buf[BINLOG_RING_WORDS*4 + 1024];
+  uint32 since = 0;
+  for (;;) {
+    char path[64];
+    snprintf(path, sizeof(path), "/log?since=%u", since);
+    int len = httpGet(host, port, path, buf, sizeof(buf));
+    if (len < 0) {
+      fprintf(stderr, "logdump: GET %s from %s failed\n", path, target);
+      if (once) return 1;
+    } else {
+      // ask again right away until the device has nothing more
+      uint32 next = printResponse(buf, len, since);
+      bool more = next != since;
+      since = next;
+      if (more) continue;
+      if (once) return 0;
+    }
+    usleep(POLL_MS*1000);
+  }
+}
+
+static speed_t speedOf(uint32 baud) {
+  static const struct { uint32 baud; speed_t s; } speeds[] = {
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+    { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 } };
+  for (int i = 0; i < sizeof(speeds)/sizeof(speeds[0]); i++) {
+    if (speeds[i].baud == baud) return speeds[i].s;
+  }
+  return B0;
+}
+
+// Print the console, decoding the SLIP frames of log records: END 'L' seq record END
+static int followSerial(const char *path, uint32 baud) {
+  int fd = open(path, O_RDONLY | O_NOCTTY);
+  if (fd < 0) {
+    fprintf(stderr, "logdump: cannot open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct termios t;
+  if (tcgetattr(fd, &t) == 0) {
+    cfmakeraw(&t);
+    cfsetspeed(&t, speedOf(baud));
+    tcsetattr(fd, TCSANOW, &t);
+  }
+  uint8 frame[4 + BINLOG_RING_WORDS*4];
+  int len = 0;
+  bool inFrame = false, escaped = false;
+  uint8 buf[512];
+  int n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (int i = 0; i < n; i++) {
+      uint8 c = buf[i];
+      if (c == 0xC0) {
+        if (inFrame && len > 0) {
+          // the END of a frame: seq and a record of as many words as it says
+          uint32 seq, rec[(sizeof(frame) - 5)/4], words = (len - 5)/4;
+          if (frame[0] == BINLOG_FRAME && len >= 13 && (len - 1) % 4 == 0) {
+            memcpy(&seq, frame + 1, 4);
+            memcpy(rec, frame + 5, len - 5);
+            if ((rec[0] & 0xff) == words) printRecord(seq, rec, words);
+          }
+          inFrame = false;
+        } else {
+          inFrame = true;
+          len = 0;
+          escaped = false;
+        }
+        continue;
+      }
+      if (!inFrame) {
+        putchar(c);
+        continue;
+      }
+      if (len == 0 && c != BINLOG_FRAME) {
+        // not ours, e.g. a serial upload reply: pass it on as text
+        inFrame = false;
+        putchar(c);
+        continue;
+      }
+      if (c == 0xDB) {
+        escaped = true;
+        continue;
+      }
+      if (escaped) c = c == 0xDC ? 0xC0 : 0xDB;
+      escaped = false;
+      if (len < sizeof(frame)) frame[len++] = c;
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  bool serial = false, once = false;
+  uint32 baud = 115200;
+  int c;
+  while ((c = getopt(argc, argv, "1sb:h")) != -1) {
+    switch (c) {
+    case '1': once = true; break;
+    case 's': serial = true; break;
+    case 'b': baud = strtoul(optarg, NULL, 0); break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 2 || speedOf(baud) == B0) usage();
+  if (!loadTable(argv[optind])) {
+    fprintf(stderr, "logdump: cannot read %s\n", argv[optind]);
+    return 1;
+  }
+  return serial ? followSerial(argv[optind + 1], baud) : followHttp(argv[optind + 1], once);
+}
@@ -0,0 +1,429 @@
+/*
+UDP and TCP for the emulated esp8266: espconn connections and listeners are sockets of the host,
+so emulated devices in separate processes and the flashing tools can talk to each other over
+localhost. Packets are only delivered while emuNetRun lets real time pass, the virtual clock follows the real one and
+runs ahead of it while the flash is busy, like the chip doesn't get to its packets then. The
+emulated UART0 is received here too, see uartemu.c.
+*/
+
+#include <esp8266.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "flashemu.h"
+
+#define EMU_NET_CONNS     8
+#define EMU_NET_GROUPS    4
+// the esp8266 has room for a few packets that wait for the application, not more
+#define EMU_NET_RCVBUF    16384
+
+uint32 emuNetLoss;
+
+static struct {
+  struct espconn *conn;
+  int fd;
+  remot_info remote;            // sender of the last packet, the peer of a TCP connection
+  bool connecting;              // a TCP connect is in progress
+  bool held;                    // espconn_recv_hold()
+  bool sent;                    // the sent callback is due
+  bool closing;                 // espconn_disconnect(), the disconnect callback is due
+  bool listening;               // espconn_accept()
+  uint8 maxConn;                // of a listening one, espconn_tcp_set_max_con_allow()
+  struct espconn *server;       // the listening one an accepted connection came from
+} conns[EMU_NET_CONNS];
+static int connCount;
+static uint32 groups[EMU_NET_GROUPS];
+static int groupCount;
+
+static void joinGroup(int fd, uint32 group) {
+  struct ip_mreq mreq = { .imr_multiaddr.s_addr = group, .imr_interface.s_addr = htonl(INADDR_LOOPBACK) };
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+    fprintf(stderr, "flashemu: cannot join multicast group\n");
+}
+
+sint8 espconn_create(struct espconn *espconn) {
+  if (espconn->type != ESPCONN_UDP || connCount == EMU_NET_CONNS) return ESPCONN_ARG;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0), one = 1, size = EMU_NET_RCVBUF;
+  if (fd < 0) return ESPCONN_MEM;
+  // several emulated devices listen on the same ports
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY),
+    .sin_port = htons(espconn->proto.udp->local_port) };
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return ESPCONN_MEM;
+  }
+  for (int i = 0; i < groupCount; i++) joinGroup(fd, groups[i]);
+  memset(&conns[connCount], 0, sizeof(conns[0]));
+  conns[connCount].conn = espconn;
+  conns[connCount++].fd = fd;
+  return ESPCONN_OK;
+}
+
+static int connFind(struct espconn *espconn) {
+  for (int i = 0; i < connCount; i++) {
+    if (conns[i].conn == espconn) return i;
+  }
+  return -1;
+}
+
+static void connRemove(int i) {
+  close(conns[i].fd);
+  conns[i] = conns[--connCount];
+}
+
+// Listen for TCP connections. Each accepted one gets an espconn of its own with the callbacks of
+// this one, like on the SDK, it is freed after its last callback.
+sint8 espconn_accept(struct espconn *espconn) {
+  if (espconn->type != ESPCONN_TCP || connCount == EMU_NET_CONNS) return ESPCONN_ARG;
+  int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+  if (fd < 0) return ESPCONN_MEM;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY),
+    .sin_port = htons(espconn->proto.tcp->local_port) };
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+    close(fd);
+    return ESPCONN_MEM;
+  }
+  memset(&conns[connCount], 0, sizeof(conns[0]));
+  conns[connCount].conn = espconn;
+  conns[connCount].fd = fd;
+  conns[connCount].listening = true;
+  conns[connCount++].maxConn = EMU_NET_CONNS;
+  espconn->state = ESPCONN_LISTEN;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_tcp_set_max_con_allow(struct espconn *espconn, uint8 num) {
+  int i = connFind(espconn);
+  if (i < 0 || !conns[i].listening) return ESPCONN_ARG;
+  conns[i].maxConn = num;
+  return ESPCONN_OK;
+}
+
+// The SDK closes connections that are idle for longer, the emulated runs are shorter than that
+sint8 espconn_regist_time(struct espconn *espconn, uint32 interval, uint8 type_flag) {
+  return ESPCONN_OK;
+}
+
+// Sends are in the socket when espconn_send returns, as with ESPCONN_COPY, the options change
+// nothing
+sint8 espconn_set_opt(struct espconn *espconn, uint8 opt) {
+  return ESPCONN_OK;
+}
+
+// The callbacks of a TCP connection are those of the SDK, they run from the loop in emuNetRun
+sint8 espconn_connect(struct espconn *espconn) {
+  if (espconn->type != ESPCONN_TCP || connCount == EMU_NET_CONNS) return ESPCONN_ARG;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return ESPCONN_MEM;
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct sockaddr_in to = { .sin_family = AF_INET,
+    .sin_port = htons(espconn->proto.tcp->remote_port) };
+  memcpy(&to.sin_addr, espconn->proto.tcp->remote_ip, 4);
+  if (connect(fd, (struct sockaddr *)&to, sizeof(to)) != 0 && errno != EINPROGRESS) {
+    close(fd);
+    return ESPCONN_RTE;
+  }
+  memset(&conns[connCount], 0, sizeof(conns[0]));
+  conns[connCount].conn = espconn;
+  conns[connCount].fd = fd;
+  conns[connCount].connecting = true;
+  conns[connCount].remote.remote_port = espconn->proto.tcp->remote_port;
+  memcpy(conns[connCount++].remote.remote_ip, espconn->proto.tcp->remote_ip, 4);
+  espconn->state = ESPCONN_WAIT;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn) {
+  int i = connFind(espconn);
+  if (i < 0 || espconn->type != ESPCONN_TCP) return ESPCONN_ARG;
+  conns[i].closing = true;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb) {
+  espconn->proto.tcp->connect_callback = connect_cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb) {
+  espconn->proto.tcp->disconnect_callback = discon_cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb) {
+  espconn->proto.tcp->reconnect_callback = recon_cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb) {
+  espconn->sent_callback = sent_cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn *espconn) {
+  int i = connFind(espconn);
+  if (i < 0) return ESPCONN_ARG;
+  conns[i].held = true;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn *espconn) {
+  int i = connFind(espconn);
+  if (i < 0) return ESPCONN_ARG;
+  conns[i].held = false;
+  return ESPCONN_OK;
+}
+
+// The data is in the socket once this returns, like it is in lwIP's buffers on the chip
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+  if (espconn->type == ESPCONN_UDP) return espconn_sendto(espconn, psent, length);
+  int i = connFind(espconn);
+  if (i < 0 || conns[i].connecting || conns[i].closing) return ESPCONN_CONN;
+  for (uint16 off = 0; off < length; ) {
+    ssize_t n = send(conns[i].fd, psent + off, length - off, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN) return ESPCONN_CONN;
+    if (n < 0) poll(&(struct pollfd){ conns[i].fd, POLLOUT }, 1, 100);
+    else off += n;
+  }
+  conns[i].sent = true;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length) {
+  return espconn_send(espconn, psent, length);
+}
+
+uint32 espconn_port(void) {
+  static uint32 port = 49152;
+  return port++;
+}
+
+// Hosts are given as addresses, there is no DNS
+uint32 ipaddr_addr(const char *cp) {
+  return inet_addr(cp);
+}
+
+err_t espconn_gethostbyname(struct espconn *pespconn, const char *name, ip_addr_t *addr,
+    dns_found_callback found) {
+  return ESPCONN_ARG;
+}
+
+sint8 espconn_delete(struct espconn *espconn) {
+  for (int i = 0; i < connCount; i++) {
+    if (conns[i].conn != espconn) continue;
+    close(conns[i].fd);
+    conns[i] = conns[--connCount];
+    return ESPCONN_OK;
+  }
+  return ESPCONN_ARG;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb) {
+  espconn->recv_callback = recv_cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_sendto(struct espconn *espconn, uint8 *psent, uint16 length) {
+  for (int i = 0; i < connCount; i++) {
+    if (conns[i].conn != espconn) continue;
+    struct sockaddr_in to = { .sin_family = AF_INET,
+      .sin_port = htons(espconn->proto.udp->remote_port) };
+    memcpy(&to.sin_addr, espconn->proto.udp->remote_ip, 4);
+    return sendto(conns[i].fd, psent, length, 0, (struct sockaddr *)&to, sizeof(to)) == length ?
+      ESPCONN_OK : ESPCONN_IF;
+  }
+  return ESPCONN_ARG;
+}
+
+sint8 espconn_get_connection_info(struct espconn *pespconn, remot_info **pcon_info, uint8 typeflags) {
+  for (int i = 0; i < connCount; i++) {
+    if (conns[i].conn != pespconn) continue;
+    *pcon_info = &conns[i].remote;
+    return ESPCONN_OK;
+  }
+  return ESPCONN_ARG;
+}
+
+sint8 espconn_igmp_join(ip_addr_t *host_ip, ip_addr_t *multicast_ip) {
+  if (groupCount == EMU_NET_GROUPS) return ESPCONN_MEM;
+  groups[groupCount++] = multicast_ip->addr;
+  for (int i = 0; i < connCount; i++) joinGroup(conns[i].fd, multicast_ip->addr);
+  return ESPCONN_OK;
+}
+
+// The station is connected to localhost
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info) {
+  memset(info, 0, sizeof(*info));
+  if (if_index == STATION_IF) {
+    info->ip.addr = htonl(INADDR_LOOPBACK);
+    info->netmask.addr = htonl(0xff000000);
+  }
+  return true;
+}
+
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr) {
+  memcpy(macaddr, emuMac, 6);
+  if (if_index == SOFTAP_IF) macaddr[0] |= 0x02;
+  return true;
+}
+
+unsigned long os_random(void) {
+  static bool seeded;
+  if (!seeded) srandom(getpid());
+  seeded = true;
+  return random();
+}
+
+static uint64 realNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+// Run a sent or disconnect callback that is due, false if there is none
+static bool tcpCallback(void) {
+  for (int i = 0; i < connCount; i++) {
+    struct espconn *conn = conns[i].conn;
+    if (conns[i].closing) {
+      bool accepted = conns[i].server != NULL;
+      connRemove(i);
+      conn->state = ESPCONN_CLOSE;
+      if (conn->proto.tcp->disconnect_callback != NULL) conn->proto.tcp->disconnect_callback(conn);
+      if (accepted) free(conn);
+      return true;
+    }
+    if (conns[i].sent) {
+      conns[i].sent = false;
+      if (conn->sent_callback != NULL) conn->sent_callback(conn);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A TCP connection is established, failed, has data or was closed by the peer
+static void tcpEvent(int i) {
+  struct espconn *conn = conns[i].conn;
+  esp_tcp *tcp = conn->proto.tcp;
+  if (conns[i].connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conns[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      connRemove(i);
+      if (tcp->reconnect_callback != NULL) tcp->reconnect_callback(conn, ESPCONN_CONN);
+      return;
+    }
+    conns[i].connecting = false;
+    conn->state = ESPCONN_CONNECT;
+    if (tcp->connect_callback != NULL) tcp->connect_callback(conn);
+    return;
+  }
+  char buf[1460];
+  ssize_t len = recv(conns[i].fd, buf, sizeof(buf), 0);
+  if (len < 0 && errno == EAGAIN) return;
+  if (len <= 0) {
+    bool accepted = conns[i].server != NULL;
+    connRemove(i);
+    conn->state = ESPCONN_CLOSE;
+    if (len == 0 && tcp->disconnect_callback != NULL) tcp->disconnect_callback(conn);
+    if (len < 0 && tcp->reconnect_callback != NULL) tcp->reconnect_callback(conn, ESPCONN_RST);
+    if (accepted) free(conn);
+    return;
+  }
+  conn->state = ESPCONN_READ;
+  if (conn->recv_callback != NULL) conn->recv_callback(conn, buf, len);
+}
+
+// A client connects to listening connection i, past the limit it is closed right away
+static void tcpAccept(int i) {
+  struct sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  int fd = accept(conns[i].fd, (struct sockaddr *)&from, &fromLen);
+  if (fd < 0) return;
+  struct espconn *server = conns[i].conn;
+  int count = 0;
+  for (int j = 0; j < connCount; j++) count += conns[j].server == server;
+  if (count >= conns[i].maxConn || connCount == EMU_NET_CONNS) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  struct espconn *conn = calloc(1, sizeof(*conn) + sizeof(esp_tcp));
+  esp_tcp *tcp = (esp_tcp *)(conn + 1);
+  *tcp = *server->proto.tcp;
+  tcp->remote_port = ntohs(from.sin_port);
+  memcpy(tcp->remote_ip, &from.sin_addr, 4);
+  conn->type = ESPCONN_TCP;
+  conn->state = ESPCONN_CONNECT;
+  conn->proto.tcp = tcp;
+  memset(&conns[connCount], 0, sizeof(conns[0]));
+  conns[connCount].conn = conn;
+  conns[connCount].fd = fd;
+  conns[connCount].server = server;
+  conns[connCount].remote.remote_port = tcp->remote_port;
+  memcpy(conns[connCount++].remote.remote_ip, tcp->remote_ip, 4);
+  if (tcp->connect_callback != NULL) tcp->connect_callback(conn);
+}
+
+// Wait up to us for packets and hand them to the receive callbacks
+static void deliver(uint64 us) {
+  if (tcpCallback()) return;
+  struct pollfd pfd[EMU_NET_CONNS + 1];
+  int n = connCount;
+  for (int i = 0; i < n; i++) {
+    pfd[i] = (struct pollfd){ conns[i].fd, conns[i].connecting ? POLLOUT : conns[i].held ? 0 : POLLIN };
+  }
+  pfd[n] = (struct pollfd){ emuUartFd(), POLLIN };
+  if (poll(pfd, n + 1, (us + 999)/1000) <= 0) return;
+  if (pfd[n].revents & POLLIN) emuUartReceive();
+  // the callbacks may create and delete connections
+  for (int i = 0; i < n && i < connCount; i++) {
+    if (pfd[i].revents == 0 || conns[i].fd != pfd[i].fd) continue;
+    if (conns[i].listening) {
+      tcpAccept(i);
+      continue;
+    }
+    if (conns[i].conn->type == ESPCONN_TCP) {
+      if (!conns[i].held) tcpEvent(i);
+      continue;
+    }
+    char buf[1500];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t len = recvfrom(conns[i].fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen);
+    if (len < 0 || (emuNetLoss > 0 && random() % 100 < emuNetLoss)) continue;
+    conns[i].remote.remote_port = ntohs(from.sin_port);
+    memcpy(conns[i].remote.remote_ip, &from.sin_addr, 4);
+    if (conns[i].conn->recv_callback != NULL) conns[i].conn->recv_callback(conns[i].conn, buf, len);
+  }
+}
+
+// Let ms of real time pass, running timers and tasks and receiving packets
+void emuNetRun(uint64 ms) {
+  uint64 base = realNow() - emuNow, end = emuNow + ms*1000;
+  for (;;) {
+    uint64 real = realNow() - base;
+    if (real >= end) break;
+    if (emuNow < real) emuRunUntil(real);
+    if (emuNow > real) {
+      // the flash keeps the chip busy, packets that arrive meanwhile pile up or get lost
+      usleep(emuNow - real);
+      continue;
+    }
+    uint64 wait = 10000;
+    if (emuNextTimer() > emuNow && emuNextTimer() - emuNow < wait) wait = emuNextTimer() - emuNow;
+    deliver(wait);
+  }
+  emuRunUntil(end);
+}
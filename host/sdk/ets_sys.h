@@ -0,0 +1,25 @@
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+#include "c_types.h"
+#include "eagle_soc.h"
+typedef uint32_t ETSSignal;
+typedef uint32_t ETSParam;
+typedef struct ETSEventTag ETSEvent;
+struct ETSEventTag { ETSSignal sig; ETSParam par; };
+typedef void (*ETSTask)(ETSEvent *e);
+typedef void ETSTimerFunc(void *timer_arg);
+typedef struct _ETSTIMER_ {
+  struct _ETSTIMER_ *timer_next; uint32_t timer_expire; uint32_t timer_period;
+  ETSTimerFunc *timer_func; void *timer_arg;
+} ETSTimer;
+#define ETS_UART_INUM 5
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+#define ETS_INTR_LOCK() ets_intr_lock()
+#define ETS_INTR_UNLOCK() ets_intr_unlock()
+#define ETS_INTR_ENABLE(inum) ets_isr_unmask((1<<inum))
+#define ETS_INTR_DISABLE(inum) ets_isr_mask((1<<inum))
+#define ETS_UART_INTR_ATTACH(func, arg) ets_isr_attach(ETS_UART_INUM, (func), (void *)(arg))
+#define ETS_UART_INTR_ENABLE() ETS_INTR_ENABLE(ETS_UART_INUM)
+#define ETS_UART_INTR_DISABLE() ETS_INTR_DISABLE(ETS_UART_INUM)
+#endif
@@ -0,0 +1,7 @@
+#ifndef _GPIO_H_
+#define _GPIO_H_
+#include "c_types.h"
+void gpio_init(void);
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask);
+uint32 gpio_input_get(void);
+#endif
@@ -0,0 +1,10 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+#define os_free(s) vPortFree(s, "", 0)
+#define os_malloc(s) pvPortMalloc(s, "", 0)
+#define os_calloc(n, s) pvPortCalloc(n, s, "", 0)
+#define os_realloc(p, s) pvPortRealloc(p, s, "", 0)
+#define os_zalloc(s) pvPortZalloc(s, "", 0)
+void *pvPortCalloc(unsigned int count, unsigned int size, char *, int);
+void *pvPortRealloc(void *ptr, unsigned int size, char *, int);
+#endif
@@ -0,0 +1,128 @@
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+#include "os_type.h"
+#include "ip_addr.h"
+#include "spi_flash.h"
+#include "gpio.h"
+enum rst_reason { REASON_DEFAULT_RST = 0, REASON_WDT_RST = 1, REASON_EXCEPTION_RST = 2,
+  REASON_SOFT_WDT_RST = 3, REASON_SOFT_RESTART = 4, REASON_DEEP_SLEEP_AWAKE = 5, REASON_EXT_SYS_RST = 6 };
+struct rst_info { uint32 reason; uint32 exccause; uint32 epc1; uint32 epc2; uint32 epc3; uint32 excvaddr; uint32 depc; };
+struct rst_info *system_get_rst_info(void);
+#define UPGRADE_FW_BIN1 0x00
+#define UPGRADE_FW_BIN2 0x01
+void system_restore(void);
+void system_restart(void);
+bool system_deep_sleep_set_option(uint8 option);
+void system_deep_sleep(uint32 time_in_us);
+uint8 system_upgrade_userbin_check(void);
+void system_upgrade_reboot(void);
+uint8 system_upgrade_flag_check(void);
+void system_upgrade_flag_set(uint8 flag);
+void system_timer_reinit(void);
+uint32 system_get_time(void);
+#define USER_TASK_PRIO_0 0
+#define USER_TASK_PRIO_1 1
+#define USER_TASK_PRIO_2 2
+#define USER_TASK_PRIO_MAX 3
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+void system_print_meminfo(void);
+uint32 system_get_free_heap_size(void);
+void system_set_os_print(uint8 onoff);
+uint8 system_get_os_print(void);
+uint64 system_mktime(uint32 year, uint32 mon, uint32 day, uint32 hour, uint32 min, uint32 sec);
+uint32 system_get_chip_id(void);
+typedef void (* init_done_cb_t)(void);
+void system_init_done_cb(init_done_cb_t cb);
+uint32 system_rtc_clock_cali_proc(void);
+uint32 system_get_rtc_time(void);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+void system_uart_swap(void);
+void system_uart_de_swap(void);
+uint16 system_adc_read(void);
+uint16 system_get_vdd33(void);
+const char *system_get_sdk_version(void);
+#define SYS_BOOT_ENHANCE_MODE 0
+#define SYS_BOOT_NORMAL_MODE 1
+#define SYS_BOOT_NORMAL_BIN 0
+#define SYS_BOOT_TEST_BIN 1
+uint8 system_get_boot_version(void);
+uint32 system_get_userbin_addr(void);
+uint8 system_get_boot_mode(void);
+bool system_restart_enhance(uint8 bin_type, uint32 bin_addr);
+#define SYS_CPU_80MHZ 80
+#define SYS_CPU_160MHZ 160
+bool system_update_cpu_freq(uint8 freq);
+uint8 system_get_cpu_freq(void);
+enum flash_size_map { FLASH_SIZE_4M_MAP_256_256 = 0, FLASH_SIZE_2M, FLASH_SIZE_8M_MAP_512_512,
+  FLASH_SIZE_16M_MAP_512_512, FLASH_SIZE_32M_MAP_512_512, FLASH_SIZE_16M_MAP_1024_1024,
+  FLASH_SIZE_32M_MAP_1024_1024 };
+enum flash_size_map system_get_flash_size_map(void);
+bool system_param_save_with_protect(uint16 start_sec, void *param, uint16 len);
+bool system_param_load(uint16 start_sec, uint16 offset, void *param, uint16 len);
+void system_soft_wdt_stop(void);
+void system_soft_wdt_restart(void);
+void system_soft_wdt_feed(void);
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+#define SOFTAP_MODE 0x02
+#define STATIONAP_MODE 0x03
+typedef enum _auth_mode { AUTH_OPEN = 0, AUTH_WEP, AUTH_WPA_PSK, AUTH_WPA2_PSK, AUTH_WPA_WPA2_PSK, AUTH_MAX } AUTH_MODE;
+uint8 wifi_get_opmode(void);
+uint8 wifi_get_opmode_default(void);
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_set_opmode_current(uint8 opmode);
+uint8 wifi_get_broadcast_if(void);
+bool wifi_set_broadcast_if(uint8 interface);
+struct bss_info;
+struct station_config { uint8 ssid[32]; uint8 password[64]; uint8 bssid_set; uint8 bssid[6]; };
+bool wifi_station_get_config(struct station_config *config);
+bool wifi_station_get_config_default(struct station_config *config);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+sint8 wifi_station_get_rssi(void);
+uint8 wifi_station_get_auto_connect(void);
+bool wifi_station_set_auto_connect(uint8 set);
+bool wifi_station_set_reconnect_policy(bool set);
+enum { STATION_IDLE = 0, STATION_CONNECTING, STATION_WRONG_PASSWORD, STATION_NO_AP_FOUND, STATION_CONNECT_FAIL, STATION_GOT_IP };
+uint8 wifi_station_get_connect_status(void);
+bool wifi_station_dhcpc_start(void);
+bool wifi_station_dhcpc_stop(void);
+struct softap_config { uint8 ssid[32]; uint8 password[64]; uint8 ssid_len; uint8 channel; AUTH_MODE authmode; uint8 ssid_hidden; uint8 max_connection; uint16 beacon_interval; };
+bool wifi_softap_get_config(struct softap_config *config);
+bool wifi_softap_get_config_default(struct softap_config *config);
+bool wifi_softap_set_config(struct softap_config *config);
+bool wifi_softap_set_config_current(struct softap_config *config);
+uint8 wifi_softap_get_station_num(void);
+#define STATION_IF 0x00
+#define SOFTAP_IF 0x01
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr);
+bool wifi_set_macaddr(uint8 if_index, uint8 *macaddr);
+uint8 wifi_get_channel(void);
+bool wifi_set_channel(uint8 channel);
+enum sleep_type { NONE_SLEEP_T = 0, LIGHT_SLEEP_T, MODEM_SLEEP_T };
+bool wifi_set_sleep_type(enum sleep_type type);
+enum sleep_type wifi_get_sleep_type(void);
+enum { EVENT_STAMODE_CONNECTED = 0, EVENT_STAMODE_DISCONNECTED, EVENT_STAMODE_AUTHMODE_CHANGE,
+  EVENT_STAMODE_GOT_IP, EVENT_STAMODE_DHCP_TIMEOUT, EVENT_SOFTAPMODE_STACONNECTED,
+  EVENT_SOFTAPMODE_STADISCONNECTED, EVENT_SOFTAPMODE_PROBEREQRECVED, EVENT_MAX };
+typedef struct { uint8 ssid[32]; uint8 ssid_len; uint8 bssid[6]; uint8 channel; } Event_StaMode_Connected_t;
+typedef struct { uint8 ssid[32]; uint8 ssid_len; uint8 bssid[6]; uint8 reason; } Event_StaMode_Disconnected_t;
+typedef struct { uint8 old_mode; uint8 new_mode; } Event_StaMode_AuthMode_Change_t;
+typedef struct { struct ip_addr ip; struct ip_addr mask; struct ip_addr gw; } Event_StaMode_Got_IP_t;
+typedef struct { uint8 mac[6]; uint8 aid; } Event_SoftAPMode_StaConnected_t;
+typedef struct { uint8 mac[6]; uint8 aid; } Event_SoftAPMode_StaDisconnected_t;
+typedef struct { int rssi; uint8 mac[6]; } Event_SoftAPMode_ProbeReqRecved_t;
+typedef union { Event_StaMode_Connected_t connected; Event_StaMode_Disconnected_t disconnected;
+  Event_StaMode_AuthMode_Change_t auth_change; Event_StaMode_Got_IP_t got_ip;
+  Event_SoftAPMode_StaConnected_t sta_connected; Event_SoftAPMode_StaDisconnected_t sta_disconnected;
+  Event_SoftAPMode_ProbeReqRecved_t ap_probereqrecved; } Event_Info_u;
+typedef struct _esp_event { uint32 event; Event_Info_u event_info; } System_Event_t;
+typedef void (* wifi_event_handler_cb_t)(System_Event_t *event);
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+#endif
@@ -0,0 +1,324 @@
+/*
+Flash an esp8266 over its serial port (esp-link/serialota.c), for the bench and the factory where
+there is no wifi. The device says which image it needs, gets it with its digest at up to 2Mbaud,
+verifies it and boots it like after an upload over the network. An interrupted upload resumes
+with the blocks the device is still missing.
+
+Each frame waits for its reply, a DATA frame until the block is in the flash. A frame without a
+reply is sent again, the device replies to one it has seen already without doing it twice.
+*/
+
+#include <c_types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "espmissingincludes.h"
+
+// esp-link/serialota.h
+#define SERIAL_OTA_BAUD       115200
+#define SERIAL_OTA_END        0xC0
+#define SERIAL_OTA_ESC        0xDB
+#define SERIAL_OTA_ESC_END    0xDC
+#define SERIAL_OTA_ESC_ESC    0xDD
+#define SERIAL_OTA_HEADER     4
+#define SERIAL_OTA_MAX_DATA   1024
+#define SERIAL_OTA_SYNC       0x01
+#define SERIAL_OTA_BEGIN      0x02
+#define SERIAL_OTA_DATA       0x03
+#define SERIAL_OTA_FINISH     0x04
+#define SERIAL_OTA_REPLY      0x80
+#define SERIAL_OTA_REBOOT     0x01
+
+typedef struct {
+  uint32 maxLen;
+  uint32 baud;
+  char   next[12];
+} SerialOtaInfo;
+
+typedef struct {
+  uint32 length;
+  uint8  digest[16];
+  uint8  flags;
+  uint8  reserved[3];
+} SerialOtaBegin;
+
+#define REPLY_MS      1000  // an erase takes up to 400ms, the block write follows
+#define SYNC_MS       200
+#define SYNC_TRIES    25
+#define RETRIES       5
+
+typedef struct {
+  uint8 *data;
+  uint32 len;
+  uint8 digest[16];
+} Image;
+
+static int fd;
+static uint8 seq;
+static int verbose;
+static uint32 resent;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: serflash [-b baud] [-a] [-n] [-v] port user1.bin user2.bin\n"
+      "Upload the image the device on port needs next, verify it and boot it.\n"
+      "  -b N    switch to N baud for the upload (921600)\n"
+      "  -a      start at N baud too, the device detects the rate\n"
+      "  -n      leave the device running the old firmware\n"
+      "  -v      print every frame\n");
+  exit(2);
+}
+
+static uint64 nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static speed_t speedOf(uint32 baud) {
+  static const struct { uint32 baud; speed_t s; } speeds[] = {
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+    { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+    { 1500000, B1500000 }, { 2000000, B2000000 } };
+  for (int i = 0; i < sizeof(speeds)/sizeof(speeds[0]); i++) {
+    if (speeds[i].baud == baud) return speeds[i].s;
+  }
+  return B0;
+}
+
+static bool setBaud(uint32 baud) {
+  struct termios t;
+  if (tcgetattr(fd, &t) < 0) return false;
+  cfmakeraw(&t);
+  t.c_cflag |= CLOCAL | CREAD;
+  t.c_cc[VMIN] = 0;
+  t.c_cc[VTIME] = 0;
+  if (cfsetspeed(&t, speedOf(baud)) < 0) return false;
+  tcdrain(fd);
+  if (tcsetattr(fd, TCSANOW, &t) < 0) return false;
+  tcflush(fd, TCIFLUSH);
+  return true;
+}
+
+static bool loadImage(Image *img, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return false;
+  fseek(f, 0, SEEK_END);
+  img->len = ftell(f);
+  rewind(f);
+  img->data = malloc(img->len);
+  bool ok = img->data != NULL && fread(img->data, 1, img->len, f) == img->len;
+  fclose(f);
+
+  md5_context_t ctx;
+  MD5Init(&ctx);
+  for (uint32 off = 0; ok && off < img->len; off += 0x8000) {
+    MD5Update(&ctx, img->data + off, img->len - off < 0x8000 ? img->len - off : 0x8000);
+  }
+  MD5Final(img->digest, &ctx);
+  return ok;
+}
+
+// The same CRC-16/CCITT as the device
+static uint16 crc16(const uint8 *data, uint32 len) {
+  uint16 crc = 0xffff;
+  while (len-- > 0) {
+    crc ^= *data++ << 8;
+    for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static void sendFrame(uint8 cmd, const void *payload, uint16 len) {
+  uint8 frame[SERIAL_OTA_HEADER + 4 + SERIAL_OTA_MAX_DATA + 2];
+  frame[0] = cmd;
+  frame[1] = seq;
+  frame[2] = len;
+  frame[3] = len >> 8;
+  memcpy(frame + SERIAL_OTA_HEADER, payload, len);
+  uint16 crc = crc16(frame, SERIAL_OTA_HEADER + len);
+  frame[SERIAL_OTA_HEADER + len] = crc;
+  frame[SERIAL_OTA_HEADER + len + 1] = crc >> 8;
+
+  uint8 buf[2*sizeof(frame) + 2];
+  uint32 n = 0;
+  buf[n++] = SERIAL_OTA_END;
+  for (uint32 i = 0; i < SERIAL_OTA_HEADER + len + 2; i++) {
+    if (frame[i] == SERIAL_OTA_END || frame[i] == SERIAL_OTA_ESC) {
+      buf[n++] = SERIAL_OTA_ESC;
+      buf[n++] = frame[i] == SERIAL_OTA_END ? SERIAL_OTA_ESC_END : SERIAL_OTA_ESC_ESC;
+    } else {
+      buf[n++] = frame[i];
+    }
+  }
+  buf[n++] = SERIAL_OTA_END;
+  for (uint32 off = 0; off < n; ) {
+    ssize_t w = write(fd, buf + off, n - off);
+    if (w < 0 && errno != EAGAIN) return;
+    if (w > 0) off += w;
+    else usleep(1000);
+  }
+  if (verbose) fprintf(stderr, "> cmd %d seq %d len %d\n", cmd, seq, len);
+}
+
+// Wait up to ms for the reply to cmd/seq, returns its payload length or -1. Console output and
+// replies to earlier frames are skipped.
+static int readReply(uint8 cmd, uint8 *payload, int max, int ms) {
+  static uint8 frame[SERIAL_OTA_HEADER + 64 + 2];
+  static int len;
+  static bool escaped, overrun;
+  uint64 end = nowMs() + ms;
+  for (;;) {
+    uint64 now = nowMs();
+    if (now >= end) return -1;
+    struct pollfd pfd = { fd, POLLIN };
+    if (poll(&pfd, 1, end - now) <= 0) continue;
+    uint8 buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    for (ssize_t i = 0; i < n; i++) {
+      uint8 c = buf[i];
+      if (c == SERIAL_OTA_END) {
+        int flen = len;
+        bool ok = !overrun;
+        len = 0;
+        escaped = overrun = false;
+        if (!ok || flen < SERIAL_OTA_HEADER + 3) continue;
+        uint16 crc = frame[flen - 2] | frame[flen - 1] << 8;
+        int plen = frame[2] | frame[3] << 8;
+        if (crc16(frame, flen - 2) != crc || plen != flen - SERIAL_OTA_HEADER - 2) continue;
+        if (verbose) fprintf(stderr, "< cmd %d seq %d len %d\n", frame[0], frame[1], plen);
+        if (frame[0] != (cmd | SERIAL_OTA_REPLY) || frame[1] != seq) continue;
+        if (plen > max) plen = max;
+        memcpy(payload, frame + SERIAL_OTA_HEADER, plen);
+        return plen;
+      }
+      if (c == SERIAL_OTA_ESC) {
+        escaped = true;
+        continue;
+      }
+      if (escaped) c = c == SERIAL_OTA_ESC_END ? SERIAL_OTA_END : SERIAL_OTA_ESC;
+      escaped = false;
+      if (len == sizeof(frame)) overrun = true;
+      else frame[len++] = c;
+    }
+  }
+}
+
+// Send a request until it is replied, returns the reply's data length or -1. An error reply
+// is printed and makes it -1 too.
+static int request(uint8 cmd, const void *payload, uint16 len, void *reply, int max, int tries,
+    int ms) {
+  uint8 buf[64];
+  seq++;
+  for (int t = 0; t < tries; t++) {
+    if (t > 0) resent++;
+    sendFrame(cmd, payload, len);
+    int n = readReply(cmd, buf, sizeof(buf) - 1, ms);
+    if (n < 1) continue;
+    if (buf[0] != 0) {
+      buf[n] = 0;
+      fprintf(stderr, "serflash: %s\n", (char *)buf + 1);
+      return -1;
+    }
+    if (n - 1 > max) n = max + 1;
+    memcpy(reply, buf + 1, n - 1);
+    return n - 1;
+  }
+  fprintf(stderr, "serflash: no reply to command %d\n", cmd);
+  return -1;
+}
+
+static bool syncDevice(uint32 baud, SerialOtaInfo *info, int tries) {
+  return request(SERIAL_OTA_SYNC, &baud, 4, info, sizeof(*info), tries, SYNC_MS) ==
+      sizeof(*info);
+}
+
+int main(int argc, char **argv) {
+  uint32 baud = 921600;
+  bool autobaud = false, reboot = true;
+  int c;
+  while ((c = getopt(argc, argv, "b:anvh")) != -1) {
+    switch (c) {
+    case 'b': baud = strtoul(optarg, NULL, 0); break;
+    case 'a': autobaud = true; break;
+    case 'n': reboot = false; break;
+    case 'v': verbose = 1; break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 3 || speedOf(baud) == B0) usage();
+  Image images[2];
+  for (int i = 0; i < 2; i++) {
+    if (!loadImage(&images[i], argv[optind + 1 + i])) {
+      fprintf(stderr, "serflash: cannot read %s\n", argv[optind + 1 + i]);
+      return 1;
+    }
+  }
+  fd = open(argv[optind], O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0 || !setBaud(autobaud ? baud : SERIAL_OTA_BAUD)) {
+    fprintf(stderr, "serflash: cannot open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  // the device measures the rate on the 0x55 preamble, it alternates every bit. It must last
+  // long enough for 8 bytes at 115200 baud, which is how the device recognizes it.
+  SerialOtaInfo info;
+  if (autobaud) {
+    uint8 preamble[256];
+    memset(preamble, 'U', sizeof(preamble));
+    if (write(fd, preamble, sizeof(preamble)) < 0) return 1;
+    usleep(50000);
+  }
+  if (!syncDevice(autobaud ? 0 : baud, &info, SYNC_TRIES)) return 1;
+  if (info.baud != baud) {
+    fprintf(stderr, "serflash: device stays at %u baud\n", info.baud);
+    baud = info.baud;
+  }
+  // the device switches once its reply is out, check the link at the new rate
+  usleep(30000);
+  if (!setBaud(baud) || !syncDevice(0, &info, RETRIES)) return 1;
+  info.next[sizeof(info.next) - 1] = 0;
+  Image *img = strcmp(info.next, "user1.bin") == 0 ? &images[0] :
+      strcmp(info.next, "user2.bin") == 0 ? &images[1] : NULL;
+  if (img == NULL || img->len > info.maxLen) {
+    fprintf(stderr, "serflash: no image for %s (%u bytes at most)\n", info.next, info.maxLen);
+    return 1;
+  }
+  fprintf(stderr, "serflash: %s, %u bytes at %u baud\n", info.next, img->len, baud);
+
+  SerialOtaBegin begin;
+  memset(&begin, 0, sizeof(begin));
+  begin.length = img->len;
+  memcpy(begin.digest, img->digest, 16);
+  begin.flags = reboot ? SERIAL_OTA_REBOOT : 0;
+  uint32 state[2];
+  if (request(SERIAL_OTA_BEGIN, &begin, sizeof(begin), state, 8, RETRIES, REPLY_MS) != 8)
+    return 1;
+  if (state[0] != img->len) fprintf(stderr, "serflash: resuming, %u bytes missing\n", state[0]);
+
+  uint64 start = nowMs();
+  uint32 sent = 0;
+  uint8 data[4 + SERIAL_OTA_MAX_DATA];
+  for (uint32 offset = state[1]; offset < img->len; ) {
+    uint32 len = img->len - offset < SERIAL_OTA_MAX_DATA ? img->len - offset : SERIAL_OTA_MAX_DATA;
+    memcpy(data, &offset, 4);
+    memcpy(data + 4, img->data + offset, len);
+    uint32 next;
+    if (request(SERIAL_OTA_DATA, data, 4 + len, &next, 4, RETRIES, REPLY_MS) != 4) return 1;
+    sent += len;
+    offset = next > offset ? next : offset + len;
+  }
+  uint64 ms = nowMs() - start;
+
+  if (request(SERIAL_OTA_FINISH, NULL, 0, NULL, 0, RETRIES, 5000) < 0) return 1;
+  fprintf(stderr, "serflash: %u bytes in %.1fs (%.0f KB/s), %u frames sent again, %s\n", sent,
+      ms/1000.0, ms > 0 ? sent/1.024/ms : 0, resent,
+      reboot ? "booting the new firmware" : "verified");
+  return 0;
+}
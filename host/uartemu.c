@@ -0,0 +1,198 @@
+/*
+UART0 of the emulated esp8266: the driver API of serial/uart.h on a pseudo terminal, so serflash
+and other tools talk to the emulated device like to a USB serial adapter. Bytes are received
+while emuNetRun lets real time pass. The baud rate the tool set on its side is compared with
+the emulated one, if they differ the bytes arrive the way a UART at our rate samples the tool's
+waveform, mostly with framing errors, and the rate detection measures the tool's rate.
+*/
+
+#define _GNU_SOURCE
+#include <esp8266.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "flashemu.h"
+#include "uart.h"
+
+static int ptyFd = -1;
+static uint32 baud = 115200;
+static bool autobaud;
+static uint32 measured;
+static UartStats stats;
+static UartRecvCb recvCb;
+static uint8 rxRing[UART_RX_RING_SIZE];
+static uint16 rxHead, rxCount;
+static uint64 txDone;           // emuNow when the TX ring is out
+
+// Create the pty and link its slave side to path
+bool emuUartOpen(const char *path) {
+  ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (ptyFd < 0 || grantpt(ptyFd) < 0 || unlockpt(ptyFd) < 0) return false;
+  fcntl(ptyFd, F_SETFL, O_NONBLOCK);
+  // raw, so the line discipline leaves the frames alone
+  struct termios t;
+  tcgetattr(ptyFd, &t);
+  cfmakeraw(&t);
+  cfsetspeed(&t, B115200);
+  tcsetattr(ptyFd, TCSANOW, &t);
+  // keep the slave open, else the master hangs up while no tool has it open
+  if (open(ptsname(ptyFd), O_RDWR | O_NOCTTY) < 0) return false;
+  unlink(path);
+  return symlink(ptsname(ptyFd), path) == 0;
+}
+
+int emuUartFd(void) {
+  return ptyFd;
+}
+
+static uint32 speedOf(speed_t s) {
+  static const struct { speed_t s; uint32 baud; } speeds[] = {
+    { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+    { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 }, { B921600, 921600 },
+    { B1500000, 1500000 }, { B2000000, 2000000 } };
+  for (int i = 0; i < sizeof(speeds)/sizeof(speeds[0]); i++) {
+    if (speeds[i].s == s) return speeds[i].baud;
+  }
+  return 0;
+}
+
+// Level of the line n bits of the sender into data sent as 8N1, idle after it
+static int lineLevel(const uint8 *data, ssize_t len, uint64 bit) {
+  uint64 byte = bit / 10;
+  int pos = bit % 10;
+  if (byte >= len || pos == 9) return 1;
+  return pos == 0 ? 0 : (data[byte] >> (pos - 1)) & 1;
+}
+
+// Receive data sent at rate theirs with a UART at ours: each falling edge starts a frame, its
+// bits are sampled in their middle and a low stop bit is a framing error
+static void misread(const uint8 *data, ssize_t len, uint32 theirs) {
+  double t = 0, end = (double)len * 10 / theirs;
+  uint64 bit = 0;
+  while (t < end) {
+    // the next falling edge, the sender's bits change at their boundaries only
+    while (bit < (uint64)len*10 && (bit < t*theirs || lineLevel(data, len, bit) != 0 ||
+        (bit > 0 && lineLevel(data, len, bit - 1) != 1))) bit++;
+    if (bit == (uint64)len*10) break;
+    double edge = (double)bit / theirs;
+    if (lineLevel(data, len, (uint64)((edge + 0.5 / baud) * theirs)) != 0) {
+      t = edge + 0.5 / baud; // a glitch, not a start bit
+      continue;
+    }
+    uint8 c = 0;
+    for (int i = 0; i < 8; i++)
+      c |= lineLevel(data, len, (uint64)((edge + (i + 1.5) / baud) * theirs)) << i;
+    if (lineLevel(data, len, (uint64)((edge + 9.5 / baud) * theirs)) == 0) stats.frameErrors++;
+    if (rxCount < UART_RX_RING_SIZE) rxRing[(rxHead + rxCount++) % UART_RX_RING_SIZE] = c;
+    stats.rxBytes++;
+    t = edge + 9.5 / baud;
+  }
+}
+
+// The tool wrote to the slave side, the receive callback drains the RX ring as it fills like
+// the driver's task does
+void emuUartReceive(void) {
+  uint8 buf[UART_RX_RING_SIZE];
+  ssize_t len;
+  while ((len = read(ptyFd, buf, UART_RX_RING_SIZE - rxCount)) > 0) {
+    // master and slave share their settings, this is the rate of the tool
+    struct termios t;
+    tcgetattr(ptyFd, &t);
+    uint32 theirs = speedOf(cfgetospeed(&t));
+    if (theirs != baud) {
+      misread(buf, len, theirs);
+      if (autobaud) measured = theirs;
+    } else {
+      for (ssize_t i = 0; i < len; i++) rxRing[(rxHead + rxCount++) % UART_RX_RING_SIZE] = buf[i];
+      stats.rxBytes += len;
+    }
+    if (recvCb == NULL) rxCount = 0;
+    else recvCb();
+    if (rxCount == UART_RX_RING_SIZE) break;
+  }
+}
+
+void uart_init(UartBautRate uart0_br) {
+  baud = uart0_br;
+}
+
+uint16 uart0_read(void *buf, uint16 len) {
+  uint16 n = 0;
+  while (n < len && rxCount > 0) {
+    ((uint8 *)buf)[n++] = rxRing[rxHead];
+    rxHead = (rxHead + 1) % UART_RX_RING_SIZE;
+    rxCount--;
+  }
+  return n;
+}
+
+uint16 uart0_rx_peek(uint16 offset, const uint8 **data) {
+  if (offset >= rxCount) return 0;
+  uint16 pos = (rxHead + offset) % UART_RX_RING_SIZE, count = rxCount - offset;
+  *data = rxRing + pos;
+  return count < UART_RX_RING_SIZE - pos ? count : UART_RX_RING_SIZE - pos;
+}
+
+void uart0_rx_consume(uint16 len) {
+  if (len > rxCount) len = rxCount;
+  rxHead = (rxHead + len) % UART_RX_RING_SIZE;
+  rxCount -= len;
+}
+
+// The bytes are in the pty right away, but they take up the TX ring for as long as the UART
+// would take to send them
+uint16 uart0_write(const void *buf, uint16 len) {
+  uint16 n = uart0_tx_free();
+  if (n > len) n = len;
+  if (ptyFd >= 0) {
+    ssize_t w = write(ptyFd, buf, n);
+    n = w < 0 ? 0 : w;
+  }
+  if (txDone < emuNow) txDone = emuNow;
+  txDone += n*10000000ULL/baud;
+  stats.txBytes += n;
+  stats.txDropped += len - n;
+  return n;
+}
+
+uint16 uart0_rx_available(void) {
+  return rxCount;
+}
+
+uint16 uart0_tx_free(void) {
+  uint64 queued = txDone > emuNow ? ((txDone - emuNow)*baud + 9999999)/10000000 : 0;
+  // the ring keeps a byte free, as on the chip
+  return queued < UART_TX_RING_SIZE - 1 ? UART_TX_RING_SIZE - 1 - queued : 0;
+}
+
+UartRecvCb uart0_set_recv_cb(UartRecvCb cb) {
+  UartRecvCb prev = recvCb;
+  recvCb = cb;
+  return prev;
+}
+
+const UartStats *uart0_stats(void) {
+  return &stats;
+}
+
+bool uart0_tx_idle(void) {
+  return txDone <= emuNow;
+}
+
+void uart0_set_baud(uint32 rate) {
+  baud = rate;
+  autobaud = false;
+}
+
+uint32 uart0_get_baud(void) {
+  return baud;
+}
+
+void uart0_autobaud_start(void) {
+  autobaud = true;
+  measured = 0;
+}
+
+uint32 uart0_autobaud_result(void) {
+  return autobaud ? measured : 0;
+}
@@ -0,0 +1,828 @@
+/*
+Flash esp8266s over wifi, the compiled counterpart of the wiflash script for rolling out firmware
+to many devices. Each device is asked which image it needs, gets that image uploaded along with
+its digest, reboots into it and is watched until it comes back with the new firmware or rolls
+back. A pool of workers handles several devices at once, a failed upload resumes with the blocks
+the device reports missing, and a JSON summary of the run goes to stdout.
+
+A rebooted device broadcasts a readiness packet once it is back (esp-link/announce.c), a listener
+thread picks these up so the workers don't have to poll devices that are still booting. Devices
+the broadcast doesn't reach from here are still polled, just less often.
+
+The device's httpd closes the connection after every response, so each step is one request on
+its own connection; the steps themselves are the minimum: next, upload, reboot and the polls
+for the device to come back.
+
+Before uploading, the device is asked whether the partition holds the image already, in which
+case it only gets rebooted. Otherwise it is asked for the hashes of the sectors of the partition the image
+goes to (/flash/sectors). Only the sectors that differ are sent, the first piece tells the device
+which ones it can keep. A device that doesn't know /flash/sectors gets the whole image.
+
+With -l it lists the devices on the LAN instead: a discovery query is broadcast to the
+announcement port and every device answers with its identity, flash layout and firmware state.
+
+With -m it flashes all devices that answer the discovery query at once (esp-link/mcastota.c):
+each image is sent once to a multicast group or broadcast address, then the devices are polled
+and report the blocks they are missing, and the union of these is sent again until all have the
+image. The airtime is that of one upload plus the repairs, however many devices there are. The
+devices reboot on their own once the image verified, their readiness announcement confirms they
+run it.
+*/
+
+#include <c_types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "espmissingincludes.h"
+
+#define DIGEST_HEX_LEN  32
+#define RESP_LEN        4096
+#define SEND_CHUNK      4096
+#define ANNOUNCE_PORT   8267  // esp-link/announce.h
+#define DISCOVER_MS     800   // how long answers to a discovery query are collected
+#define DISCOVER_HOSTS  1024
+#define SECTOR_SIZE     4096
+#define SECTOR_HASH_HEX 8     // esp-link/sectorhash.h, the first 4 bytes of the MD5
+#define MCAST_PORT      8268  // esp-link/mcastota.h
+#define MCAST_MAGIC     0x41544f4d
+#define MCAST_BLOCK     1024  // OTA_BLOCK_SIZE, the blocks devices report missing
+#define MCAST_ROUNDS    30    // polls before devices that haven't got the image are given up
+#define MCAST_POLL_MS   500   // devices answer within 200ms, plus the flash writes they wait for
+#define MCAST_SILENT    5     // rounds without an answer before a device is given up
+
+typedef struct {
+  const char *path;
+  uint8 *data;
+  uint32 len;
+  char digest[DIGEST_HEX_LEN + 1];
+  char *sectorHashes;       // hex hash of each sector, padded with 0xff like the flash is
+} Image;
+
+typedef struct {
+  const char *host;
+  bool ok;
+  bool rolledBack;          // the new firmware failed on the device, no point in retrying
+  int attempts;
+  const char *image;        // name of the image the device asked for
+  uint32 uploaded;          // bytes sent, including resumed pieces
+  uint64 uploadMs, totalMs;
+  uint32 addr;              // IPv4 address, to match announcements
+  bool announced;           // a readiness packet arrived since the reboot
+  char id[13];              // station MAC in hex, to match devices that share an address
+  char running[16];         // image the last readiness packet named
+  int silent;               // multicast rounds without an answer
+  char err[128];
+} Device;
+
+static Image images[2];         // user1.bin, user2.bin
+static Device *devices;
+static int deviceCount, nextDevice;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t announced = PTHREAD_COND_INITIALIZER;
+static int announceFd = -1;
+static int retries = 3, bootTimeout = 60, verbose, fullUpload;
+static uint64 airBytes, repairBytes;  // multicast data sent, and the part of it sent again
+
+static void usage(void) {
+  fprintf(stderr, "Usage: wiflash [-j workers] [-r retries] [-t seconds] [-f] [-v] user1.bin user2.bin host...\n"
+      "       wiflash -l [-b broadcast-address]\n"
+      "       wiflash -m [-b broadcast-address] [-g group] [-i interface-address] [-p KB/s] [-t seconds]\n"
+      "               [-v] user1.bin user2.bin\n"
+      "Flash each host with the image it needs next, reboot it and wait until it is back.\n"
+      "Or list the devices that answer a discovery broadcast (255.255.255.255) as JSON.\n"
+      "Or flash all of them at once, sending each image to a multicast group (239.255.82.68) or\n"
+      "broadcast address once and the blocks devices miss again.\n"
+      "  -j N    flash up to N devices at the same time (8)\n"
+      "  -r N    retry a device N times, uploads resume with the missing blocks (3)\n"
+      "  -t N    seconds a device may take to come back after the reboot (60)\n"
+      "  -f      upload whole images, not just the sectors that differ\n"
+      "  -p N    send multicast data at N KB/s (64)\n"
+      "  -v      print every request\n"
+      "A JSON summary of all devices goes to stdout, progress to stderr.\n");
+  exit(2);
+}
+
+static uint64 nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void say(const Device *d, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  pthread_mutex_lock(&lock);
+  if (d->id[0] != 0) fprintf(stderr, "%s %s: ", d->host, d->id);
+  else fprintf(stderr, "%s: ", d->host);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  pthread_mutex_unlock(&lock);
+  va_end(ap);
+}
+
+static bool fail(Device *d, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(d->err, sizeof(d->err), format, ap);
+  va_end(ap);
+  say(d, "%s", d->err);
+  return false;
+}
+
+//===== HTTP
+
+// Connect to host[:port]
+static int dial(Device *d, int timeoutMs) {
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+  char host[64];
+  snprintf(host, sizeof(host), "%s", d->host);
+  char *port = strchr(host, ':');
+  if (port != NULL) *port++ = 0;
+  if (getaddrinfo(host, port != NULL ? port : "80", &hints, &ai) != 0) return -1;
+  d->addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+  int fd = socket(ai->ai_family, ai->ai_socktype, 0);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  if (fd < 0) return -1;
+
+  struct pollfd p = { fd, POLLOUT };
+  int soErr = 0;
+  socklen_t soLen = sizeof(soErr);
+  if (poll(&p, 1, timeoutMs) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soErr, &soLen) != 0 ||
+      soErr != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool sendAll(int fd, const void *data, uint32 len, int timeoutMs) {
+  const uint8 *p = data;
+  while (len > 0) {
+    struct pollfd pfd = { fd, POLLOUT };
+    if (poll(&pfd, 1, timeoutMs) != 1) return false;
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Run one request, returns the status code or -1. The response body goes to resp. A POST body
+// is streamed in pieces with a progress line every 10%.
+static int request(Device *d, const char *method, const char *path, const char *headers,
+    const uint8 *body, uint32 len, char *resp, int timeoutMs) {
+  if (verbose) say(d, "%s %s", method, path);
+  int fd = dial(d, 3000);
+  if (fd < 0) return -1;
+
+  char head[512];
+  int n = snprintf(head, sizeof(head), "%s %s HTTP/1.0\r\nHost: %s\r\n%sContent-Length: %u\r\n\r\n",
+      method, path, d->host, headers, len);
+  bool ok = sendAll(fd, head, n, timeoutMs);
+  uint64 start = nowMs();
+  for (uint32 sent = 0, shown = 0; ok && sent < len; ) {
+    uint32 k = len - sent < SEND_CHUNK ? len - sent : SEND_CHUNK;
+    ok = sendAll(fd, body + sent, k, timeoutMs);
+    sent += k;
+    if (ok && len >= 65536 && sent*10/len > shown) {
+      shown = sent*10/len;
+      uint64 ms = nowMs() - start;
+      say(d, "%3d%% %6.1f KB/s", sent*100/len, ms > 0 ? sent/1.024/ms : 0.0);
+    }
+  }
+
+  // the device closes the connection after the response
+  char buf[RESP_LEN];
+  int got = 0;
+  while (ok && got < RESP_LEN - 1) {
+    struct pollfd pfd = { fd, POLLIN };
+    if (poll(&pfd, 1, timeoutMs) != 1) {
+      ok = false;
+      break;
+    }
+    ssize_t r = recv(fd, buf + got, RESP_LEN - 1 - got, 0);
+    if (r < 0) ok = false;
+    if (r <= 0) break;
+    got += r;
+  }
+  close(fd);
+  buf[got] = 0;
+  int code;
+  if (!ok || sscanf(buf, "HTTP/%*d.%*d %d", &code) != 1) return -1;
+  char *b = strstr(buf, "\r\n\r\n");
+  if (resp != NULL) strcpy(resp, b != NULL ? b + 4 : "");
+  if (verbose) say(d, "%d %s", code, resp != NULL ? resp : "");
+  return code;
+}
+
+//===== Readiness announcements
+
+// Copy the value of a string field of the JSON the devices send, empty if it isn't there
+static void jsonString(const char *json, const char *name, char *value, int size) {
+  char key[32];
+  snprintf(key, sizeof(key), "\"%s\":\"", name);
+  const char *p = strstr(json, key);
+  int n = 0;
+  if (p != NULL) {
+    for (p += strlen(key); *p != 0 && *p != '"' && n < size - 1; p++) value[n++] = *p;
+  }
+  value[n] = 0;
+}
+
+static void *listener(void *arg) {
+  for (;;) {
+    char buf[512];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(announceFd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromLen);
+    if (n < 0) return NULL;
+    buf[n] = 0;
+    if (strstr(buf, "\"type\":\"ready\"") == NULL) continue;
+
+    char id[13] = "", running[16] = "";
+    jsonString(buf, "id", id, sizeof(id));
+    jsonString(buf, "running", running, sizeof(running));
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < deviceCount; i++) {
+      Device *d = &devices[i];
+      if (d->id[0] != 0 ? strcmp(d->id, id) != 0 : d->addr != from.sin_addr.s_addr) continue;
+      d->announced = true;
+      strcpy(d->running, running);
+      if (verbose) fprintf(stderr, "%s: %s\n", d->host, buf);
+    }
+    pthread_cond_broadcast(&announced);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void startListener(void) {
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(ANNOUNCE_PORT),
+    .sin_addr.s_addr = htonl(INADDR_ANY) };
+  int one = 1;
+  announceFd = socket(AF_INET, SOCK_DGRAM, 0);
+  setsockopt(announceFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (announceFd < 0 || bind(announceFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "wiflash: cannot listen on udp port %d, polling devices instead\n",
+        ANNOUNCE_PORT);
+    if (announceFd >= 0) close(announceFd);
+    announceFd = -1;
+    return;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, listener, NULL);
+  pthread_detach(thread);
+}
+
+// Wait up to ms for the device's readiness packet
+static bool waitForAnnouncement(Device *d, uint64 ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms/1000;
+  ts.tv_nsec += ms%1000*1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&lock);
+  while (!d->announced && pthread_cond_timedwait(&announced, &lock, &ts) == 0) ;
+  bool heard = d->announced;
+  pthread_mutex_unlock(&lock);
+  return heard;
+}
+
+//===== Discovery
+
+// Broadcast a discovery query a few times and print the devices that answer, or add them to
+// devices with -m. Returns their count.
+static int discover(const char *broadcast, bool add) {
+  struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(ANNOUNCE_PORT) };
+  int fd = socket(AF_INET, SOCK_DGRAM, 0), one = 1;
+  if (fd < 0 || inet_pton(AF_INET, broadcast, &to.sin_addr) != 1) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+
+  static const char query[] = "{\"type\":\"discover\"}";
+  static char seen[DISCOVER_HOSTS][13];
+  int count = 0, sent = 0;
+  uint64 start = nowMs();
+  if (add) devices = calloc(DISCOVER_HOSTS, sizeof(Device));
+  else printf("[");
+  for (uint64 now = start; now < start + DISCOVER_MS; now = nowMs()) {
+    // the query goes out at 0, 100 and 300ms, a lost one costs little
+    if (sent < 3 && now >= start + (sent == 0 ? 0 : 100 << (sent - 1))) {
+      sendto(fd, query, sizeof(query) - 1, 0, (struct sockaddr *)&to, sizeof(to));
+      sent++;
+    }
+    struct pollfd pfd = { fd, POLLIN };
+    if (poll(&pfd, 1, 20) != 1) continue;
+
+    char buf[512], ip[INET_ADDRSTRLEN];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromLen);
+    if (n <= 1) continue;
+    buf[n] = 0;
+    if (buf[0] != '{' || strstr(buf, "\"type\":\"device\"") == NULL) continue;
+    // devices behind one address (a NAT, the emulator) are told apart by their MAC
+    char id[13];
+    int i;
+    jsonString(buf, "id", id, sizeof(id));
+    for (i = 0; i < count && strcmp(seen[i], id) != 0; i++) ;
+    if (i < count || count == DISCOVER_HOSTS) continue;
+    strcpy(seen[count++], id);
+    inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+    if (add) {
+      Device *d = &devices[deviceCount++];
+      d->host = strdup(ip);
+      d->addr = from.sin_addr.s_addr;
+      strcpy(d->id, id);
+      char next[16];
+      jsonString(buf, "next", next, sizeof(next));
+      if (strcmp(next, "user1.bin") == 0) d->image = "user1.bin";
+      if (strcmp(next, "user2.bin") == 0) d->image = "user2.bin";
+    } else {
+      printf("%s\n {\"ip\":\"%s\",%s", count > 1 ? "," : "", ip, buf + 1);
+    }
+  }
+  if (!add) printf("\n]\n");
+  close(fd);
+  fprintf(stderr, "%d devices in %dms\n", count, DISCOVER_MS);
+  return count;
+}
+
+//===== Flashing
+
+static bool loadImage(Image *img, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return false;
+  fseek(f, 0, SEEK_END);
+  img->len = ftell(f);
+  rewind(f);
+  img->data = malloc(img->len);
+  bool ok = img->data != NULL && fread(img->data, 1, img->len, f) == img->len;
+  fclose(f);
+
+  md5_context_t ctx;
+  uint8 digest[16];
+  MD5Init(&ctx);
+  for (uint32 off = 0; ok && off < img->len; off += 0x8000) {
+    MD5Update(&ctx, img->data + off, img->len - off < 0x8000 ? img->len - off : 0x8000);
+  }
+  MD5Final(digest, &ctx);
+  for (int i = 0; i < 16; i++) sprintf(img->digest + 2*i, "%02x", digest[i]);
+
+  uint32 sectors = (img->len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  img->sectorHashes = malloc(sectors*SECTOR_HASH_HEX + 1);
+  for (uint32 s = 0; ok && s < sectors; s++) {
+    uint8 sector[SECTOR_SIZE];
+    uint32 n = img->len - s*SECTOR_SIZE < SECTOR_SIZE ? img->len - s*SECTOR_SIZE : SECTOR_SIZE;
+    memset(sector, 0xff, SECTOR_SIZE);
+    memcpy(sector, img->data + s*SECTOR_SIZE, n);
+    MD5Init(&ctx);
+    MD5Update(&ctx, sector, SECTOR_SIZE);
+    MD5Final(digest, &ctx);
+    for (int i = 0; i < SECTOR_HASH_HEX/2; i++) {
+      sprintf(img->sectorHashes + s*SECTOR_HASH_HEX + 2*i, "%02x", digest[i]);
+    }
+  }
+  img->path = path;
+  return ok;
+}
+
+// Ask the device which image it needs, NULL if it doesn't answer
+static Image *nextImage(Device *d) {
+  char resp[RESP_LEN];
+  if (request(d, "GET", "/flash/next", "", NULL, 0, resp, 10000) != 200) return NULL;
+  if (strncmp(resp, "user1.bin", 9) == 0) return &images[0];
+  if (strncmp(resp, "user2.bin", 9) == 0) return &images[1];
+  return NULL;
+}
+
+static bool uploadRange(Device *d, Image *img, uint32 first, uint32 last, const char *map,
+    char *resp) {
+  char headers[512];
+  uint32 len = last - first + 1;
+  int n = snprintf(headers, sizeof(headers), "X-Image-Digest: %s\r\nContent-Range: bytes %u-%u/%u\r\n",
+      img->digest, first, last, img->len);
+  if (map != NULL) snprintf(headers + n, sizeof(headers) - n, "X-Sector-Map: %s\r\n", map);
+  int code = request(d, "POST", "/flash/upload", headers, img->data + first, len, resp, 120000);
+  if (code == 200 || code == 202) d->uploaded += len;
+  return code == 200 || code == 202;
+}
+
+// Upload the sectors whose hash differs from what the device has in the partition, false if the
+// device can't tell or refuses the sector map. The last sector is always sent, so that there is
+// a piece to carry the map and finish the session even if nothing changed.
+static bool uploadChanged(Device *d, Image *img, char *resp) {
+  if (request(d, "GET", "/flash/sectors", "", NULL, 0, resp, 10000) != 200) return false;
+  char *hashes = strstr(resp, "\"hashes\":\"");
+  if (hashes == NULL) return false;
+  hashes += 10;
+
+  uint32 sectors = (img->len + SECTOR_SIZE - 1) / SECTOR_SIZE, kept = 0;
+  bool same[sectors];
+  char map[sectors/4 + 3];
+  for (uint32 s = 0; s < sectors; s++) {
+    same[s] = s + 1 < sectors && strlen(hashes) >= (s + 1)*SECTOR_HASH_HEX &&
+        strncmp(hashes + s*SECTOR_HASH_HEX, img->sectorHashes + s*SECTOR_HASH_HEX,
+        SECTOR_HASH_HEX) == 0;
+    kept += same[s];
+  }
+  for (uint32 s = 0; s < sectors; s += 8) {
+    uint8 byte = 0;
+    for (int b = 0; b < 8 && s + b < sectors; b++) byte |= same[s + b] << b;
+    sprintf(map + s/4, "%02x", byte);
+  }
+  say(d, "%u of %u sectors unchanged", kept, sectors);
+
+  bool first = true;
+  for (uint32 s = 0; s < sectors; s++) {
+    if (same[s]) continue;
+    uint32 e = s;
+    while (e + 1 < sectors && !same[e + 1]) e++;
+    uint32 last = (e + 1)*SECTOR_SIZE < img->len ? (e + 1)*SECTOR_SIZE - 1 : img->len - 1;
+    // a device that doesn't take the map fails the first piece, before anything is written
+    if (!uploadRange(d, img, s*SECTOR_SIZE, last, first ? map : NULL, resp)) return !first;
+    first = false;
+    s = e;
+  }
+  return true;
+}
+
+// Upload the image, or only the ranges the device's session for it is missing
+static bool upload(Device *d, Image *img) {
+  char resp[RESP_LEN];
+  uint64 start = nowMs();
+  // an empty request with the digest is answered with 304 if the image is there already
+  char probe[64];
+  snprintf(probe, sizeof(probe), "If-None-Match: \"%s\"\r\n", img->digest);
+  if (request(d, "POST", "/flash/upload", probe, NULL, 0, resp, 10000) == 304) {
+    say(d, "%s is on the device already", d->image);
+    return true;
+  }
+  if (d->attempts > 1 && request(d, "GET", "/flash/status", "", NULL, 0, resp, 10000) == 200 &&
+      strstr(resp, img->digest) != NULL) {
+    // "missing":["0-1023","4096-8191"]
+    char *p = strstr(resp, "\"missing\":[");
+    uint32 first, last;
+    int n;
+    for (p = p != NULL ? p + 11 : NULL; p != NULL && sscanf(p, "\"%u-%u\"%n", &first, &last, &n) == 2;
+        p += n + (p[n] == ',')) {
+      say(d, "resuming bytes %u-%u", first, last);
+      if (last >= img->len || !uploadRange(d, img, first, last, NULL, resp)) return false;
+    }
+  } else if (fullUpload || !uploadChanged(d, img, resp)) {
+    if (!uploadRange(d, img, 0, img->len - 1, NULL, resp)) return false;
+  }
+  d->uploadMs += nowMs() - start;
+  if (request(d, "GET", "/flash/status", "", NULL, 0, resp, 10000) != 200 ||
+      strstr(resp, "\"complete\":true") == NULL || strstr(resp, img->digest) == NULL) {
+    return false;
+  }
+  return true;
+}
+
+// Wait for the device to come back after the reboot. It needs the other image next if it runs
+// the new firmware, the same one if it rolled back. Asking it also confirms the upgrade.
+static bool waitForDevice(Device *d, Image *flashed) {
+  uint64 start = nowMs(), deadline = start + bootTimeout*1000ULL;
+  bool heard = false;
+  while (nowMs() < deadline) {
+    // wait for the announcement, but ask the device every few seconds in case the broadcast
+    // doesn't make it here. Without a listener or once it's back the device is polled.
+    if (announceFd >= 0 && !heard) {
+      heard = waitForAnnouncement(d, 3000);
+      if (heard) say(d, "back after %.1fs", (nowMs() - start)/1000.0);
+    } else {
+      usleep(500000);
+    }
+    Image *next = nextImage(d);
+    if (next != NULL) {
+      if (next != flashed) return true;
+      d->rolledBack = true;
+      return fail(d, "rolled back to the old firmware");
+    }
+  }
+  return fail(d, "did not come back within %ds", bootTimeout);
+}
+
+static bool flashDevice(Device *d) {
+  Image *img = nextImage(d);
+  if (img == NULL) return fail(d, "cannot get /flash/next");
+  d->image = img == &images[0] ? "user1.bin" : "user2.bin";
+  if (d->attempts == 1) say(d, "flashing %s (%u bytes)", d->image, img->len);
+
+  if (!upload(d, img)) return fail(d, "upload of %s failed", d->image);
+  pthread_mutex_lock(&lock);
+  d->announced = false;
+  pthread_mutex_unlock(&lock);
+  if (request(d, "GET", "/flash/reboot", "", NULL, 0, NULL, 10000) != 200)
+    return fail(d, "reboot refused");
+  return waitForDevice(d, img);
+}
+
+static void *worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    Device *d = nextDevice < deviceCount ? &devices[nextDevice++] : NULL;
+    pthread_mutex_unlock(&lock);
+    if (d == NULL) return NULL;
+
+    uint64 start = nowMs();
+    while (!d->ok && !d->rolledBack && d->attempts <= retries) {
+      if (d->attempts++ > 0) usleep(1000000);
+      d->err[0] = 0;
+      d->ok = flashDevice(d);
+    }
+    d->totalMs = nowMs() - start;
+    if (d->ok) {
+      say(d, "done in %.1fs, upload %.1f KB/s", d->totalMs/1000.0,
+          d->uploadMs > 0 ? d->uploaded/1.024/d->uploadMs : 0.0);
+    }
+  }
+}
+
+static void printSummary(uint64 elapsed) {
+  int ok = 0;
+  printf("{\"devices\":[");
+  for (int i = 0; i < deviceCount; i++) {
+    Device *d = &devices[i];
+    ok += d->ok;
+    printf("%s\n {\"host\":\"%s\",\"id\":\"%s\",\"ok\":%s,\"image\":\"%s\",\"attempts\":%d,\"bytes\":%u,"
+        "\"rolled_back\":%s,\"upload_ms\":%llu,\"total_ms\":%llu,\"error\":\"%s\"}",
+        i > 0 ? "," : "", d->host, d->id, d->ok ? "true" : "false", d->image != NULL ? d->image : "",
+        d->attempts, d->uploaded, d->rolledBack ? "true" : "false",
+        (unsigned long long)d->uploadMs, (unsigned long long)d->totalMs, d->ok ? "" : d->err);
+  }
+  printf("\n],\"ok\":%d,\"failed\":%d,\"elapsed_ms\":%llu", ok, deviceCount - ok,
+      (unsigned long long)elapsed);
+  if (airBytes > 0) {
+    printf(",\"multicast_bytes\":%llu,\"repair_bytes\":%llu", (unsigned long long)airBytes,
+        (unsigned long long)repairBytes);
+  }
+  printf("}\n");
+}
+
+//===== Multicast
+
+// esp-link/mcastota.h, little endian like the esp8266 and the hosts this runs on
+typedef struct {
+  uint32 magic;
+  uint8 type, image;
+  uint16 count;
+  uint32 session, offset;
+} McastHeader;
+
+enum { MCAST_OFFER = 1, MCAST_DATA, MCAST_POLL, MCAST_NACK, MCAST_DONE };
+
+static int mcastFd;
+static struct sockaddr_in mcastTo;
+
+static void mcastSend(uint8 type, uint8 image, uint32 session, uint32 offset, const void *payload,
+    uint16 len, uint16 count) {
+  uint8 buf[sizeof(McastHeader) + MCAST_BLOCK];
+  McastHeader h = { MCAST_MAGIC, type, image, count, session, offset };
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), payload, len);
+  sendto(mcastFd, buf, sizeof(h) + len, 0, (struct sockaddr *)&mcastTo, sizeof(mcastTo));
+}
+
+static Device *deviceById(const uint8 *mac) {
+  char id[13];
+  for (int i = 0; i < 6; i++) sprintf(id + 2*i, "%02x", mac[i]);
+  for (int i = 0; i < deviceCount; i++) if (strcmp(devices[i].id, id) == 0) return &devices[i];
+  return NULL;
+}
+
+// The device waits for the image name and hasn't got it or failed yet
+static bool waitsFor(const Device *d, const char *name) {
+  return d->image != NULL && strcmp(d->image, name) == 0 && !d->ok && d->err[0] == 0;
+}
+
+// Poll the devices and collect their answers. Sets the blocks they miss in missing, returns
+// whether any device that is still at it answered.
+static bool mcastPoll(uint8 image, const char *name, uint32 session, uint8 *missing, uint32 blocks) {
+  bool answered[DISCOVER_HOSTS] = { false };
+  uint64 start = nowMs();
+  int polls = 0;
+  for (uint64 now = start; now < start + MCAST_POLL_MS; now = nowMs()) {
+    // a second poll for the devices that lost the first one
+    if (polls < 2 && now >= start + polls*MCAST_POLL_MS/3) {
+      mcastSend(MCAST_POLL, image, session, 0, NULL, 0, 0);
+      polls++;
+    }
+    struct pollfd pfd = { mcastFd, POLLIN };
+    if (poll(&pfd, 1, 20) != 1) continue;
+    uint8 buf[1500];
+    McastHeader h;
+    ssize_t n = recv(mcastFd, buf, sizeof(buf) - 1, 0);
+    if (n < (ssize_t)sizeof(h) + 8) continue;
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != MCAST_MAGIC || h.session != session) continue;
+    Device *d = deviceById(buf + sizeof(h));
+    if (d == NULL || !waitsFor(d, name)) continue;
+    answered[d - devices] = true;
+    d->silent = 0;
+
+    const uint8 *p = buf + sizeof(h) + 8;
+    if (h.type == MCAST_DONE) {
+      buf[n] = 0;
+      if (h.count == 0) d->ok = true;
+      else fail(d, "%s", (const char *)p);
+      if (d->ok) say(d, "has %s, rebooting", name);
+    } else if (h.type == MCAST_NACK) {
+      for (int r = 0; r < h.count && p + 4 <= buf + n; r++, p += 4) {
+        uint16 first = p[0] | p[1] << 8, count = p[2] | p[3] << 8;
+        for (uint32 b = first; b < (uint32)first + count && b < blocks; b++) missing[b] = 1;
+      }
+      if (verbose) say(d, "misses blocks in %d ranges", h.count);
+    }
+  }
+
+  bool any = false;
+  for (int i = 0; i < deviceCount; i++) {
+    Device *d = &devices[i];
+    if (!waitsFor(d, name)) continue;
+    any |= answered[i];
+    if (!answered[i] && ++d->silent == MCAST_SILENT) fail(d, "does not answer");
+  }
+  return any;
+}
+
+// Send img to all devices that need it, until they have it or are given up
+static void mcastImage(Image *img, const char *name, int pace) {
+  uint8 image = img == &images[0] ? 1 : 2;
+  uint32 blocks = (img->len + MCAST_BLOCK - 1) / MCAST_BLOCK, session;
+  uint8 *missing = malloc(blocks);
+  uint8 offer[20] = { 0, [16] = 0x01 };   // digest and the flag to reboot into the image
+  for (int i = 0; i < 16; i++) sscanf(img->digest + 2*i, "%2hhx", &offer[i]);
+  do session = random(); while (session == 0);
+  memset(missing, 1, blocks);
+
+  int waiting = 0;
+  uint32 total = 0;
+  for (int i = 0; i < deviceCount; i++) waiting += waitsFor(&devices[i], name);
+  if (waiting == 0) return;
+  fprintf(stderr, "sending %s (%u bytes) to %d devices\n", name, img->len, waiting);
+
+  for (int round = 0; round < MCAST_ROUNDS; round++) {
+    // offered every round, devices that missed it come in late, the others ignore it
+    for (int i = 0; i < 2; i++) mcastSend(MCAST_OFFER, image, session, img->len, offer, sizeof(offer), 0);
+    uint64 start = nowMs();
+    uint32 sent = 0;
+    for (uint32 b = 0; b < blocks; b++) {
+      if (!missing[b]) continue;
+      uint32 len = img->len - b*MCAST_BLOCK < MCAST_BLOCK ? img->len - b*MCAST_BLOCK : MCAST_BLOCK;
+      mcastSend(MCAST_DATA, image, session, b*MCAST_BLOCK, img->data + b*MCAST_BLOCK, len, len);
+      sent += len;
+      // pace: sleep until the bytes sent so far are due
+      uint64 due = start + (uint64)sent*1000/(pace*1024);
+      if (due > nowMs()) usleep((due - nowMs())*1000);
+    }
+    airBytes += sent;
+    total += sent;
+    if (round > 0) repairBytes += sent;
+    if (sent > 0) {
+      fprintf(stderr, "round %d: sent %u bytes in %.1fs\n", round, sent, (nowMs() - start)/1000.0);
+    }
+
+    memset(missing, 0, blocks);
+    mcastPoll(image, name, session, missing, blocks);
+    waiting = 0;
+    for (int i = 0; i < deviceCount; i++) waiting += waitsFor(&devices[i], name);
+    if (waiting == 0) break;
+  }
+  for (int i = 0; i < deviceCount; i++) {
+    Device *d = &devices[i];
+    if (d->image != NULL && strcmp(d->image, name) == 0) d->uploaded = total;
+    if (waitsFor(d, name)) fail(d, "no image after %d rounds", MCAST_ROUNDS);
+  }
+  free(missing);
+}
+
+// Flash all devices that answer the discovery query, over multicast
+static bool flashMulticast(const char *broadcast, const char *group, const char *interface, int pace) {
+  uint64 start = nowMs();
+  int one = 1, ttl = 1;
+  mcastFd = socket(AF_INET, SOCK_DGRAM, 0);
+  mcastTo = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(MCAST_PORT) };
+  if (mcastFd < 0 || inet_pton(AF_INET, group, &mcastTo.sin_addr) != 1) {
+    fprintf(stderr, "wiflash: bad group %s\n", group);
+    return false;
+  }
+  setsockopt(mcastFd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  setsockopt(mcastFd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  struct in_addr ifAddr;
+  if (interface != NULL) {
+    if (inet_pton(AF_INET, interface, &ifAddr) != 1) {
+      fprintf(stderr, "wiflash: bad interface address %s\n", interface);
+      return false;
+    }
+    setsockopt(mcastFd, IPPROTO_IP, IP_MULTICAST_IF, &ifAddr, sizeof(ifAddr));
+  }
+
+  // discovery prints nothing with add, the devices go to the summary
+  if (discover(broadcast, true) <= 0) {
+    fprintf(stderr, "wiflash: no devices\n");
+    return false;
+  }
+  startListener();
+  for (int i = 0; i < deviceCount; i++) {
+    if (devices[i].image == NULL) fail(&devices[i], "no partition to flash");
+  }
+  srandom(time(NULL) ^ getpid());
+  mcastImage(&images[0], "user1.bin", pace);
+  mcastImage(&images[1], "user2.bin", pace);
+  uint64 sentMs = nowMs() - start;
+
+  // the devices reboot on their own, they are back when they announce the image they run
+  uint64 deadline = nowMs() + bootTimeout*1000ULL;
+  for (int i = 0; i < deviceCount; i++) {
+    Device *d = &devices[i];
+    if (!d->ok) continue;
+    uint64 now = nowMs();
+    bool heard = now < deadline && waitForAnnouncement(d, deadline - now);
+    d->ok = heard && strcmp(d->running, d->image) == 0;
+    d->uploadMs = sentMs;
+    d->totalMs = nowMs() - start;
+    if (d->ok) {
+      say(d, "runs %s", d->image);
+    } else if (heard) {
+      // the devices announced before the transfer, so this one booted the new image and left it
+      d->rolledBack = true;
+      fail(d, "rolled back to %s", d->running);
+    } else {
+      fail(d, "did not come back with %s within %ds", d->image, bootTimeout);
+    }
+  }
+  close(mcastFd);
+  printSummary(nowMs() - start);
+  for (int i = 0; i < deviceCount; i++) if (!devices[i].ok) return false;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int workers = 8, pace = 64, c;
+  bool list = false, multicast = false;
+  const char *broadcast = "255.255.255.255", *group = "239.255.82.68", *interface = NULL;
+  while ((c = getopt(argc, argv, "j:r:t:fvlb:mg:i:p:h")) != -1) {
+    switch (c) {
+    case 'l': list = true; break;
+    case 'b': broadcast = optarg; break;
+    case 'm': multicast = true; break;
+    case 'g': group = optarg; break;
+    case 'i': interface = optarg; break;
+    case 'p': pace = atoi(optarg); break;
+    case 'j': workers = atoi(optarg); break;
+    case 'r': retries = atoi(optarg); break;
+    case 't': bootTimeout = atoi(optarg); break;
+    case 'f': fullUpload = 1; break;
+    case 'v': verbose = 1; break;
+    default: usage();
+    }
+  }
+  if (list) return discover(broadcast, false) < 0 ? 1 : 0;
+  if (argc - optind < (multicast ? 2 : 3) || workers < 1 || pace < 1) usage();
+  for (int i = 0; i < 2; i++) {
+    if (!loadImage(&images[i], argv[optind + i])) {
+      fprintf(stderr, "wiflash: cannot read %s\n", argv[optind + i]);
+      return 1;
+    }
+  }
+
+  if (multicast) return flashMulticast(broadcast, group, interface, pace) ? 0 : 1;
+
+  deviceCount = argc - optind - 2;
+  devices = calloc(deviceCount, sizeof(Device));
+  for (int i = 0; i < deviceCount; i++) devices[i].host = argv[optind + 2 + i];
+  if (workers > deviceCount) workers = deviceCount;
+
+  startListener();
+  uint64 start = nowMs();
+  pthread_t threads[workers];
+  for (int i = 0; i < workers; i++) pthread_create(&threads[i], NULL, worker, NULL);
+  for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+  printSummary(nowMs() - start);
+
+  for (int i = 0; i < deviceCount; i++) if (!devices[i].ok) return 1;
+  return 0;
+}
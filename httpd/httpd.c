@@ -16,8 +16,13 @@ Esp8266 http server - core routines
 
 #include <esp8266.h>
 #include "httpd.h"
+#ifdef BINARY_LOG
+#include "binlog.h"
+#endif
 
-#ifdef HTTPD_DBG
+#if defined(HTTPD_DBG) && defined(BINARY_LOG)
+#define DBG(format, ...) LOG(format, ## __VA_ARGS__)
+#elif defined(HTTPD_DBG)
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
 #else
 #define DBG(format, ...) do { } while(0)
@@ -36,6 +41,8 @@ Esp8266 http server - core routines
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
+//Called for every request that has been handled
+static httpdRequestCallback requestCb;
 
 //Private data for http connection
 struct HttpdPriv {
@@ -45,6 +52,7 @@ struct HttpdPriv {
   short headPos;            // offset into header
   short sendBuffLen;        // offset into output buffer
   short code;               // http response code (only for logging)
+  bool held;                // receiving is on hold, see httpdRecvHold
 };
 
 //Connection pool
@@ -125,6 +133,7 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
       conn->requestType == HTTPD_METHOD_GET ? "GET" : "POST", conn->url,
       conn->priv->code, dt, (unsigned long)system_get_free_heap_size());
 #endif
+  if (requestCb != NULL && conn->conn && conn->url) requestCb(conn, conn->priv->code);
 
   conn->conn = NULL; // don't try to send anything, the SDK crashes...
   if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
@@ -299,6 +308,18 @@ static void ICACHE_FLASH_ATTR xmitSendBuff(HttpdConnData *conn) {
   }
 }
 
+//Stop or resume receiving on a connection. A cgi that can't keep up with the POST data holds
+//the connection, which closes the TCP window instead of piling up data in the SDK's buffers.
+void ICACHE_FLASH_ATTR httpdRecvHold(HttpdConnData *conn, bool hold) {
+  if (conn->conn == NULL || conn->priv->held == hold) return;
+  sint8 status = hold ? espconn_recv_hold(conn->conn) : espconn_recv_unhold(conn->conn);
+  if (status != 0) {
+    DBG("%sERROR! recv %s returned %d\n", connStr, hold ? "hold" : "unhold", status);
+    return;
+  }
+  conn->priv->held = hold;
+}
+
 //Callback called when the data on a socket has been successfully sent.
 static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   debugConn(arg, "httpdSentCb");
@@ -306,16 +327,24 @@ static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
   if (conn == NULL) return; // aborted connection
 
-  char sendBuff[MAX_SENDBUFF_LEN];
-  conn->priv->sendBuff = sendBuff;
-  conn->priv->sendBuffLen = 0;
-
   if (conn->cgi == NULL) { //Marked for destruction?
     //os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
     espconn_disconnect(conn->conn); // we will get a disconnect callback
     return; //No need to call xmitSendBuff.
   }
 
+  httpdContinue(conn);
+}
+
+//Run the cgi of a connection again. Used by cgis that returned HTTPD_CGI_MORE without sending
+//anything, e.g. to wait for background work, and so won't get a sent callback.
+void ICACHE_FLASH_ATTR httpdContinue(HttpdConnData *conn) {
+  if (conn->conn == NULL || conn->cgi == NULL) return;
+
+  char sendBuff[MAX_SENDBUFF_LEN];
+  conn->priv->sendBuff = sendBuff;
+  conn->priv->sendBuffLen = 0;
+
   int r = conn->cgi(conn); //Execute cgi fn.
   if (r == HTTPD_CGI_DONE) {
     conn->cgi = NULL; //mark for destruction.
@@ -579,6 +608,8 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   connData[i].conn = conn;
   conn->reverse = connData+i;
   connData[i].priv->headPos = 0;
+  connData[i].priv->code = 0;
+  connData[i].priv->held = false;
 
   esp_tcp *tcp = conn->proto.tcp;
   os_sprintf(connData[i].priv->from, "%d.%d.%d.%d:%d", tcp->remote_ip[0], tcp->remote_ip[1],
@@ -598,6 +629,11 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   espconn_set_opt(conn, ESPCONN_REUSEADDR | ESPCONN_NODELAY);
 }
 
+//Register a function that gets told about every request that has been handled.
+void ICACHE_FLASH_ATTR httpdSetRequestCb(httpdRequestCallback cb) {
+  requestCb = cb;
+}
+
 //Httpd initialization routine. Call this to kick off webserver functionality.
 void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
   int i;
@@ -41,6 +41,17 @@ void ets_timer_setfn(ETSTimer *t, ETSTimerFunc *fn, void *parg);
 
 void ets_update_cpu_frequency(int freqmhz);
 
+// MD5 routines that live in the ROM (see eagle.rom.addr.v6.ld)
+typedef struct {
+  uint32_t state[4];
+  uint32_t count[2];
+  uint8_t buffer[64];
+} md5_context_t;
+
+void MD5Init(md5_context_t *ctx);
+void MD5Update(md5_context_t *ctx, const uint8_t *input, const uint16_t len);
+void MD5Final(uint8_t digest[16], md5_context_t *ctx);
+
 #ifdef SDK_DBG
 #define DEBUG_SDK true
 #else
@@ -14,6 +14,31 @@
 #undef HTTPD_DBG
 #undef UART_DBG
 #undef SAFE_UPGRADE_DBG
+#undef BOOT_JOURNAL_DBG
+#undef OTA_SESSION_DBG
+#undef DATA_REGION_DBG
+#undef PULL_OTA_DBG
+#undef PARTITIONS_DBG
+#undef FLASH_QUEUE_DBG
+#undef ANNOUNCE_DBG
+#undef SECTOR_HASH_DBG
+#undef MCAST_OTA_DBG
+#undef TFTP_OTA_DBG
+#undef SERIAL_OTA_DBG
+#undef SERIAL_BRIDGE_DBG
+#undef WIFI_CACHE_DBG
+
+// Layout of the user area of the RTC memory (in 4 byte blocks, the user area starts at 64 and
+// ends at 191). Its content survives everything but a power loss.
+#define RTC_MEM_OTA_SESSION   64  // 41 blocks, see otasession.c
+#define RTC_MEM_WIFI_CACHE    105 // 7 blocks, see wificache.c
+#define RTC_MEM_BOOT_JOURNAL  112 // 9 blocks, see bootjournal.c
+#define RTC_MEM_END           192
+
+// Fails the build unless size bytes at block end by block end, each area checks that it doesn't
+// run into the next one
+#define RTC_MEM_FITS(block, size, end) \
+  typedef char rtcMemFits_##block[(block)*4 + (size) <= (end)*4 ? 1 : -1]
 
 
 #endif
@@ -29,6 +29,21 @@
 // UartDev is defined and initialized in rom code.
 extern UartDevice    UartDev;
 
+#define UART_TX_FIFO_SIZE   128
+#define UART_TX_EMPTY_LEVEL 16    // the TX interrupt refills the FIFO when it drops below this
+#define UART_RECV_PRIO      USER_TASK_PRIO_1
+
+// Single producer, single consumer rings: the interrupt handler only moves rxHead and txTail,
+// the rest of the firmware only rxTail and txHead, so neither side needs to lock out the other.
+static uint8 rxRing[UART_RX_RING_SIZE], txRing[UART_TX_RING_SIZE];
+static volatile uint16 rxHead, rxTail, txHead, txTail;
+static UartStats stats;
+static UartRecvCb recvCb;
+static volatile bool recvPosted;
+static os_event_t recvQueue[1];
+
+#define RING_COUNT(head, tail, size) ((uint16)((head) - (tail)) & ((size) - 1))
+
 
 /******************************************************************************
  * FunctionName : uart_config
@@ -61,8 +76,10 @@ uart_config0()
     // to set the threshold here...
     // We do not enable framing error interrupts 'cause they tend to cause an interrupt avalanche
     // and instead just poll for them when we get a std RX interrupt.
+    // The TX interrupt fires when the TX FIFO holds less than UART_TX_EMPTY_LEVEL characters.
     WRITE_PERI_REG(UART_CONF1(UART0),
                    ((80 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((UART_TX_EMPTY_LEVEL & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S) |
                    ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                    UART_RX_FLOW_EN |
                    (4 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
@@ -73,6 +90,206 @@ uart_config0()
   WRITE_PERI_REG(UART_INT_CLR(UART0), 0xffff);
 }
 
+// Move what the RX FIFO holds into the RX ring, count what doesn't fit
+static void
+uart0_rx_drain(void)
+{
+  uint8 n = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+  while (n-- > 0) {
+    uint8 c = READ_PERI_REG(UART_FIFO(UART0)) & UART_RXFIFO_RD_BYTE;
+    if (RING_COUNT(rxHead, rxTail, UART_RX_RING_SIZE) == UART_RX_RING_SIZE - 1) {
+      stats.rxDropped++;
+      continue;
+    }
+    rxRing[rxHead] = c;
+    rxHead = (rxHead + 1) & (UART_RX_RING_SIZE - 1);
+    stats.rxBytes++;
+  }
+}
+
+// Fill the TX FIFO from the TX ring, the TX interrupt stays enabled while the ring has data
+static void
+uart0_tx_fill(void)
+{
+  uint8 n = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+  while (n < UART_TX_FIFO_SIZE - 1 && txTail != txHead) {
+    WRITE_PERI_REG(UART_FIFO(UART0), txRing[txTail]);
+    txTail = (txTail + 1) & (UART_TX_RING_SIZE - 1);
+    stats.txBytes++;
+    n++;
+  }
+  if (txTail == txHead) CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Interrupt handler, runs from IRAM and leaves the data to a task
+static void
+uart0_intr_handler(void *arg)
+{
+  uint32 status = READ_PERI_REG(UART_INT_ST(UART0));
+  if (READ_PERI_REG(UART_INT_RAW(UART0)) & UART_FRM_ERR_INT_RAW) {
+    stats.frameErrors++;
+    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_FRM_ERR_INT_CLR);
+  }
+  if (status & UART_RXFIFO_OVF_INT_ST) stats.rxOverruns++;
+  if (status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST | UART_RXFIFO_OVF_INT_ST)) {
+    uart0_rx_drain();
+    if (recvCb != NULL && !recvPosted) recvPosted = system_os_post(UART_RECV_PRIO, 0, 0);
+  }
+  if (status & UART_TXFIFO_EMPTY_INT_ST) uart0_tx_fill();
+  WRITE_PERI_REG(UART_INT_CLR(UART0), status);
+}
+
+static void ICACHE_FLASH_ATTR
+uart0_recv_task(os_event_t *event)
+{
+  recvPosted = false;
+  if (recvCb != NULL && rxHead != rxTail) recvCb();
+}
+
+uint16 ICACHE_FLASH_ATTR
+uart0_rx_available(void)
+{
+  return RING_COUNT(rxHead, rxTail, UART_RX_RING_SIZE);
+}
+
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_free(void)
+{
+  return UART_TX_RING_SIZE - 1 - RING_COUNT(txHead, txTail, UART_TX_RING_SIZE);
+}
+
+uint16 ICACHE_FLASH_ATTR
+uart0_read(void *buf, uint16 len)
+{
+  uint8 *p = buf;
+  uint16 n = 0;
+  while (n < len && rxTail != rxHead) {
+    p[n++] = rxRing[rxTail];
+    rxTail = (rxTail + 1) & (UART_RX_RING_SIZE - 1);
+  }
+  return n;
+}
+
+uint16 ICACHE_FLASH_ATTR
+uart0_rx_peek(uint16 offset, const uint8 **data)
+{
+  uint16 count = RING_COUNT(rxHead, rxTail, UART_RX_RING_SIZE);
+  if (offset >= count) return 0;
+  uint16 pos = (rxTail + offset) & (UART_RX_RING_SIZE - 1);
+  *data = rxRing + pos;
+  count -= offset;
+  return count < UART_RX_RING_SIZE - pos ? count : UART_RX_RING_SIZE - pos;
+}
+
+void ICACHE_FLASH_ATTR
+uart0_rx_consume(uint16 len)
+{
+  uint16 count = RING_COUNT(rxHead, rxTail, UART_RX_RING_SIZE);
+  if (len > count) len = count;
+  rxTail = (rxTail + len) & (UART_RX_RING_SIZE - 1);
+}
+
+uint16 ICACHE_FLASH_ATTR
+uart0_write(const void *buf, uint16 len)
+{
+  const uint8 *p = buf;
+  uint16 n = 0, free = uart0_tx_free();
+  while (n < len && n < free) {
+    txRing[txHead] = p[n++];
+    txHead = (txHead + 1) & (UART_TX_RING_SIZE - 1);
+  }
+  stats.txDropped += len - n;
+  // the interrupt handler may just have turned it off because the ring was empty
+  if (n > 0) SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  return n;
+}
+
+// Whether interrupts are masked, the TX ring doesn't drain then
+static inline bool
+uart_intr_masked(void)
+{
+#ifdef __XTENSA__
+  uint32 ps;
+  __asm__ __volatile__("rsr %0, ps" : "=a"(ps));
+  return (ps & 0xf) != 0;
+#else
+  return false;
+#endif
+}
+
+// os_printf output, a line ends with CR LF on the wire. The exception handler prints the crash
+// dump with interrupts masked, that goes straight to the FIFO.
+static void
+uart0_putc(char c)
+{
+  if (uart_intr_masked()) {
+    if (c == '\n') uart0_putc('\r');
+    while (((READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT) >=
+        UART_TX_FIFO_SIZE - 1) ;
+    WRITE_PERI_REG(UART_FIFO(UART0), c);
+    return;
+  }
+  if (c == '\n') uart0_write("\r", 1);
+  uart0_write(&c, 1);
+}
+
+// Whether all written data is on the wire, a baud rate change waits for it
+bool ICACHE_FLASH_ATTR
+uart0_tx_idle(void)
+{
+  return txHead == txTail &&
+      ((READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT) == 0;
+}
+
+void ICACHE_FLASH_ATTR
+uart0_set_baud(uint32 baud)
+{
+  UartDev.baut_rate = baud;
+  uart_div_modify(UART0, UART_CLK_FREQ / baud);
+}
+
+uint32 ICACHE_FLASH_ATTR
+uart0_get_baud(void)
+{
+  return UartDev.baut_rate;
+}
+
+// Measure the baud rate of what arrives next, the sender should send 0x55 ('U') which has an
+// edge at every bit. Pulses shorter than the glitch filter (in clock cycles) are ignored.
+void ICACHE_FLASH_ATTR
+uart0_autobaud_start(void)
+{
+  WRITE_PERI_REG(UART_AUTOBAUD(UART0), (8 << UART_GLITCH_FILT_S) | UART_AUTOBAUD_EN);
+}
+
+// The measured baud rate once enough pulses were seen, 0 before
+uint32 ICACHE_FLASH_ATTR
+uart0_autobaud_result(void)
+{
+  if ((READ_PERI_REG(UART_PULSE_NUM(UART0)) & UART_PULSE_NUM_CNT) < 32) return 0;
+  // the shortest low and high pulses are a bit each, the average takes out the asymmetry
+  uint32 low = READ_PERI_REG(UART_LOWPULSE(UART0)) & UART_LOWPULSE_MIN_CNT;
+  uint32 high = READ_PERI_REG(UART_HIGHPULSE(UART0)) & UART_HIGHPULSE_MIN_CNT;
+  WRITE_PERI_REG(UART_AUTOBAUD(UART0), 0);
+  return UART_CLK_FREQ * 2 / (low + high + 2);
+}
+
+UartRecvCb ICACHE_FLASH_ATTR
+uart0_set_recv_cb(UartRecvCb cb)
+{
+  UartRecvCb prev = recvCb;
+  recvCb = cb;
+  // data that came before there was someone to take it
+  if (cb != NULL && rxHead != rxTail && !recvPosted) recvPosted = system_os_post(UART_RECV_PRIO, 0, 0);
+  return prev;
+}
+
+const UartStats* ICACHE_FLASH_ATTR
+uart0_stats(void)
+{
+  return &stats;
+}
+
 /******************************************************************************
  * FunctionName : uart_init
  * Description  : user interface for init uart
@@ -86,4 +303,11 @@ uart_init(UartBautRate uart0_br)
   // rom use 74880 baut_rate, here reinitialize
   UartDev.baut_rate = uart0_br;
   uart_config0();
+
+  system_os_task(uart0_recv_task, UART_RECV_PRIO, recvQueue, 1);
+  ETS_UART_INTR_ATTACH(uart0_intr_handler, NULL);
+  WRITE_PERI_REG(UART_INT_ENA(UART0),
+      UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA | UART_RXFIFO_OVF_INT_ENA);
+  ETS_UART_INTR_ENABLE();
+  os_install_putc1((void *)uart0_putc);
 }
@@ -3,8 +3,51 @@
 
 #include "uart_hw.h"
 
+// Sizes of the rings between the UART0 interrupt and the rest of the firmware, powers of 2
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE 1024
+#endif
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE 512
+#endif
+
+// Counters of the UART0 driver since boot
+typedef struct {
+  uint32 rxBytes;
+  uint32 txBytes;
+  uint32 rxOverruns;    // the RX FIFO overflowed before the interrupt got to it
+  uint32 rxDropped;     // received while the RX ring was full
+  uint32 frameErrors;
+  uint32 txDropped;     // written while the TX ring was full
+} UartStats;
+
+// Called from a task once received data is in the RX ring, it reads it with uart0_read
+typedef void (*UartRecvCb)(void);
+
 // Initialize UARTs to the provided baud rates (115200 recommended). This also makes the os_printf
-// calls use uart1 for output (for debugging purposes)
+// calls go through the TX ring, so they don't wait for the UART.
 void uart_init(UartBautRate uart0_br);
 
+// Non-blocking, they return the number of bytes read or queued
+uint16 uart0_read(void *buf, uint16 len);
+uint16 uart0_write(const void *buf, uint16 len);
+uint16 uart0_rx_available(void);
+uint16 uart0_tx_free(void);
+
+// Zero-copy access to the RX ring: the bytes from offset bytes past the oldest unread one up to
+// the end of the ring or of the data, whichever comes first. They stay put until released with
+// uart0_rx_consume, which counts from the oldest unread byte.
+uint16 uart0_rx_peek(uint16 offset, const uint8 **data);
+void uart0_rx_consume(uint16 len);
+
+// Returns the callback it replaces
+UartRecvCb uart0_set_recv_cb(UartRecvCb cb);
+const UartStats *uart0_stats(void);
+
+bool uart0_tx_idle(void);
+void uart0_set_baud(uint32 baud);
+uint32 uart0_get_baud(void);
+void uart0_autobaud_start(void);
+uint32 uart0_autobaud_result(void);
+
 #endif /* __UART_H__ */